@@ -40,8 +40,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "assert.h"
 #include "input.h"
@@ -65,7 +68,27 @@ static int sanity_check(void);
 /* a few constants */
 #define TICK_USEC      50000 /* tick length in microseconds          */
 #define STATUS_MSG_LEN 40    /* maximum length of status message     */
+#define STATUS_MSG_NSEC 1500000000L /* time a status message is shown */
 #define MOTION_SPEED   2     /* pixels moved per command             */
+#define PRERENDER_LINES 4    /* margin lines drawn per idle check    */
+#define PREVIEW_DRAW_USEC (TICK_USEC / 4) /* slower full draws preview */
+#define REFINE_ROWS    8     /* full rows replacing preview per check */
+#define MAX_ENTRY_ROOMS 128  /* rooms with separate entry statistics */
+
+/*
+ * While a direction is held down, the view scrolls at each tick, starting
+ * at one move(x_speed or y_speed pixels) per tick and speeding up by
+ * SCROLL_ACCEL sixteenths of a pixel each tick, to at most SCROLL_MAX_SPEED
+ * moves per tick.  A tick thus never exposes more than SCROLL_MAX_SPEED
+ * moves' worth of lines for the display thread to draw, however long the
+ * direction is held or however late the tick.
+ */
+#ifndef SCROLL_ACCEL
+#define SCROLL_ACCEL   4     /* sixteenths of a pixel per tick per tick */
+#endif
+#ifndef SCROLL_MAX_SPEED
+#define SCROLL_MAX_SPEED 4   /* moves per tick                          */
+#endif
 
 
 
@@ -78,6 +101,8 @@ typedef struct {
     unsigned int map_x, map_y;   /* current upper left display pixel      */
     int          x_speed;        /* number of pixels of x motion per move */
     int          y_speed;        /* number of pixels of y motion per move */
+    int32_t      x_vel, y_vel;   /* held scrolling speed(1/16 pixel/tick) */
+    int32_t      x_frac, y_frac; /* fraction of a pixel scrolled(1/16)    */
 } game_info_t;
 
 
@@ -135,19 +160,43 @@ static const typed_cmd_t cmd_list[] = {
 
 /* local functions--see function headers for details */
 
-static void cancel_status_thread(void* ignore); 
-static void cancel_tux_thread(void* ignore);	
+static void close_event_fds(void* ignore);
+static void cancel_precompose_thread(void* ignore);
+static void stop_display_thread(void* ignore);
+static void compose_status_bar(char bar[STATUS_MSG_LEN + 1]);
+static void overlay_status_msg(char bar[STATUS_MSG_LEN + 1]);
+static void* display_thread(void* ignore);
 static game_condition_t game_loop(void);
-static int32_t handle_typing(void);
+static int32_t handle_typing(const char* line);
+static void add_event_fd(int fd, uint32_t source);
+static void arm_status_timer(void);
+static int32_t open_event_fds(void);
+static int32_t run_command(const cmd_event_t* ev);
+static void scroll_held(uint32_t held);
+static int32_t held_velocity(int32_t vel, int32_t speed, int32_t dir);
 static void init_game(void);
+static int32_t load_precomposed_room(uint32_t gen);
+static void preview_room(void);
+static void note_full_draw(long usec);
+static void record_entry(const room_t* r, long usec);
 static void move_photo_down(void);
 static void move_photo_left(void);
 static void move_photo_right(void);
 static void move_photo_up(void);
+static void move_view(int32_t x, int32_t y);
+static void note_room_entry(void);
+static int32_t precomp_find(const room_t* r, uint32_t gen);
+static room_t* precomp_next(void);
+static int32_t precomp_victim(void);
+static int32_t precomp_wanted(const room_t* r);
+static void* precompose_thread(void* ignore);
+static void publish_view_state(int32_t force);
+static void record_loop_time(const struct timespec* start,
+                             const struct timespec* start_cpu);
+static void redraw_changes(int32_t n, const rect_t* rects);
 static void redraw_room(void);
-static void* status_thread(void* ignore);  
-static void* tux_thread(void* ignore);	
-static int time_is_after(struct timeval* t1, struct timeval* t2);
+static void advance_tick(struct timespec* t);
+static long usec_since(const struct timeval* start);
 
 
 /* file-scope variables */
@@ -155,60 +204,445 @@ static int time_is_after(struct timeval* t1, struct timeval* t2);
 static game_info_t game_info; /* game information */
 /*global variables below*/
 int32_t enter_room;
-cmd_t tux_cmd;
 int move_left_flag = 0;
 int move_right_flag = 0;
 int enter_flag = 0;
 
 /*
- * The variables below are used to keep track of the status message helper
- * thread, with Posix thread id recorded in status_thread_id.
- *
- * The status_msg records the current status message: when the
- * string recorded there is empty, no status message need be displayed, and
- * the status bar should instead reflect the name of the current room and the
+ * The status_msg records the current status message and the time at
+ * which it expires(on CLOCK_MONOTONIC): when the string recorded there is
+ * empty or has expired, no status message need be displayed, and the
+ * status bar should instead reflect the name of the current room and the
  * player's typing(for typed commands).
  *
- * The status_msg is protected by the msg_lock mutex, which should be
- * acquired before reading or writing the message.  Further, if the message
- * is changed, the helper thread must be notified by signaling it with the
- * condition variable msg_cv(while holding the msg_lock).
+ * The status_msg is published through a sequence lock, so that the
+ * display thread reads it without blocking.  A writer makes status_seq
+ * odd while it copies the message in, then even again; a reader copies
+ * the message out and retries if status_seq was odd or has changed.
+ * status_seq thus also counts the messages posted(the generation).
+ */
+typedef struct status_msg_t status_msg_t;
+struct status_msg_t {
+    char            text[STATUS_MSG_LEN + 1]; /* message, or empty       */
+    struct timespec expires;                  /* time to stop showing it */
+};
+static status_msg_t status_msg;
+static uint32_t status_seq;
+
+/*
+ * Time taken by redraw_changes after typed commands that move objects
+ * (get, drop, and so forth), printed at exit.
+ */
+static long redraw_count;     /* number of redraws           */
+static long redraw_usec;      /* total time in microseconds  */
+static long redraw_usec_max;  /* longest time in microseconds */
+
+/*
+ * Event loop tick statistics, printed at exit: ticks run and missed,
+ * the lateness of each wake-up after its tick time, and the processor
+ * time used by the event loop over its running time.
  */
-static pthread_t status_thread_id;
-static pthread_mutex_t msg_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  msg_cv = PTHREAD_COND_INITIALIZER;
-static char status_msg[STATUS_MSG_LEN + 1] = { '\0' };
+static long tick_count;       /* ticks run                     */
+static long tick_missed;      /* ticks skipped entirely        */
+static long tick_late_usec;   /* total wake-up lateness        */
+static long tick_late_max;    /* worst wake-up lateness        */
+static double loop_cpu;       /* event loop processor seconds  */
+static double loop_time;      /* event loop running seconds    */
 
-static pthread_t tux_thread_id;	
-static pthread_mutex_t tux_lock = PTHREAD_MUTEX_INITIALIZER;	
-static pthread_cond_t tux_cv = PTHREAD_COND_INITIALIZER;	
+/*
+ * Time from entering a room to its first frame being shown, in total
+ * and for each room(up to MAX_ENTRY_ROOMS rooms); see record_entry.
+ */
+typedef struct entry_stat_t entry_stat_t;
+struct entry_stat_t {
+    const room_t* room;       /* room entered, or NULL         */
+    long          count;      /* number of entries             */
+    long          usec;       /* total time in microseconds    */
+    long          usec_max;   /* longest time in microseconds  */
+};
+static entry_stat_t entry_total;
+static entry_stat_t entry_room[MAX_ENTRY_ROOMS];
+static long preview_count;    /* room entries shown as preview */
 
+/*
+ * Time taken to draw an entered room's view at full resolution(in one
+ * go, or as the rows refining a preview), as a running average.  Rooms
+ * are entered via a preview while it exceeds PREVIEW_DRAW_USEC.  Only
+ * the view is composed, so the time depends on the machine rather than
+ * on the size of the photo.
+ */
+static long full_draw_usec;   /* running average in microseconds */
+static long full_draw_count;  /* full draws measured             */
 
 /*
- * cancel_status_thread
- *   DESCRIPTION: Terminates the status message helper thread.  Used as
- *                a cleanup method to ensure proper shutdown.
+ * The event loop waits on an epoll instance for keystrokes, for Tux
+ * controller input, for the tick timer, and for the status message
+ * timer(set to expire with the message, so that the status bar can be
+ * restored on time).  The data of each epoll event identify its source.
+ */
+#define EVENT_KEYBOARD  0
+#define EVENT_TUX       1
+#define EVENT_TICK      2
+#define EVENT_STATUS    3
+#define NUM_EVENT_FDS   4
+static int event_fd = -1;     /* epoll instance              */
+static int tick_fd = -1;      /* timerfd for event loop ticks */
+static int status_fd = -1;    /* timerfd for message expiry   */
+static uint32_t status_armed; /* message generation timed     */
+
+/*
+ * The world and game_info are protected by world_lock, which the game
+ * loop holds while running commands and publishing the view state, and
+ * the precompose thread holds while copying a room.  Nothing is drawn
+ * while it is held.
+ */
+static pthread_mutex_t world_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Snapshots of the view state, published by the game loop for the
+ * display thread, which draws and shows them at its own pace.  The
+ * three snapshots form a triple buffer: publishers(holding world_lock)
+ * fill view_back, then swap it with view_middle; the display thread swaps
+ * view_middle with view_front when view_fresh is set, and draws from
+ * view_front.  Only the swaps need view_lock, so neither side waits for
+ * the other to copy or draw.  A snapshot holds a copy of the room's image
+ * (its photo and object placements) and the parts of it changed since the
+ * last snapshot, so the display thread draws without reading the world.
+ * A snapshot replaced before the display thread took it passes its
+ * changes on to the one replacing it.
+ */
+typedef struct view_state_t view_state_t;
+struct view_state_t {
+    room_t*        where;        /* room to show                     */
+    uint32_t       entry;        /* number of room entries           */
+    struct timeval entry_time;   /* time of latest room entry        */
+    uint32_t       gen;          /* generation of room's contents    */
+    room_image_t   image;        /* what the room is drawn from      */
+    int32_t        n_damage;     /* changed rectangles(-1 for all)   */
+    rect_t         damage[MAX_ROOM_DAMAGE]; /* changed rectangles    */
+    int32_t        map_x, map_y; /* upper left pixel of view         */
+    char           status[STATUS_MSG_LEN + 1]; /* room and typing    */
+};
+static pthread_t display_thread_id;
+static pthread_mutex_t view_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t view_cv = PTHREAD_COND_INITIALIZER;
+static view_state_t view_state[3];
+static int32_t view_back = 0;     /* filled by publishers       */
+static int32_t view_middle = 1;   /* latest published snapshot  */
+static int32_t view_front = 2;    /* drawn by display thread    */
+static int32_t view_fresh;        /* middle not yet displayed   */
+static int32_t display_stop;      /* display thread must exit   */
+static uint32_t view_entry;       /* number of room entries     */
+static struct timeval view_entry_time; /* latest room entry     */
+
+/*
+ * What the latest snapshot showed(used only by publishers, which hold
+ * world_lock), so that a snapshot is published only when the view changes.
+ */
+static room_t* published_where;
+static uint32_t published_entry;
+static uint32_t published_gen;
+static int32_t published_x, published_y;
+static uint32_t published_status_seq;
+static char published_status[STATUS_MSG_LEN + 1];
+
+/* room drawn by the display thread(used only by that thread) */
+static room_t* shown_room;
+
+/*
+ * Pre-composed first frames(the view at(0,0)) of the rooms next to the
+ * player's room, so that moving into one of them needs only a copy into
+ * the build buffer.  Each slot records the room and the room's generation
+ * when its frame was composed; a frame is used only if the generation is
+ * unchanged.  The slots and precomp_room(the room whose neighbors are
+ * wanted) are protected by precomp_lock, which is taken before world_lock
+ * when both are needed.
+ * The precompose thread copies a room's image under world_lock, composes
+ * the frame from the copy into a scratch frame without either lock, and
+ * swaps the scratch frame into a slot once it is complete.  It waits on
+ * precomp_cv when every neighbor has an up-to-date frame.
+ */
+typedef struct precomp_t precomp_t;
+struct precomp_t {
+    room_t*        room;   /* room in frame, or NULL      */
+    uint32_t       gen;    /* room generation when drawn  */
+    unsigned char* frame;  /* image of view at(0,0)      */
+};
+static pthread_t precomp_thread_id;
+static pthread_mutex_t precomp_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t precomp_cv = PTHREAD_COND_INITIALIZER;
+static room_t* precomp_room;
+static precomp_t precomp[NUM_ROOM_NEIGHBORS];
+static unsigned char precomp_frames[NUM_ROOM_NEIGHBORS + 1][FRAME_SIZE];
+static unsigned char* precomp_scratch;
+static room_image_t precomp_image;   /* room being composed    */
+static long precomp_hits;     /* room entries from frames     */
+
+/* view position drawn by the display thread(used only by that thread) */
+static int32_t shown_x, shown_y;
+
+
+/*
+ * close_event_fds
+ *   DESCRIPTION: Closes the event loop's epoll instance and timers.
+ *                Used as a cleanup method to ensure proper shutdown.
  *   INPUTS: none(ignored)
  *   OUTPUTS: none
  *   RETURN VALUE: none
  *   SIDE EFFECTS: none
  */
-static void cancel_status_thread(void* ignore) {
-    (void)pthread_cancel(status_thread_id);
+static void close_event_fds(void* ignore) {
+    (void)close(status_fd);
+    (void)close(tick_fd);
+    (void)close(event_fd);
 }
 
 
 /*
- * cancel_tux_thread
- *   DESCRIPTION: Terminates the status message helper thread.  Used as
- *                a cleanup method to ensure proper shutdown.
- *   INPUTS: none(ignored)
+ * cancel_precompose_thread
+ *   DESCRIPTION: Terminate the frame pre-composition thread.  Used as a
+ *                cleanup function.
+ *   INPUTS: ignore -- ignored
  *   OUTPUTS: none
  *   RETURN VALUE: none
+ *   SIDE EFFECTS: attempts to cancel the pre-composition thread
+ */
+static void cancel_precompose_thread(void* ignore) {
+    (void)pthread_cancel(precomp_thread_id);
+}
+
+
+/*
+ * stop_display_thread
+ *   DESCRIPTION: Tell the display thread to exit and wait for it to do
+ *                so, so that it no longer writes to video memory.  The
+ *                thread finishes what it is drawing first; it is not
+ *                cancelled, as it could then die holding view_lock or
+ *                the render pool's lock, and clear_mode_X would wait
+ *                forever for the latter.  Used as a cleanup function.
+ *   INPUTS: ignore -- ignored
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: joins the display thread
+ */
+static void stop_display_thread(void* ignore) {
+    /* A signal in the display thread itself runs the cleanups there. */
+    if (pthread_equal(pthread_self(), display_thread_id)) {
+        return;
+    }
+    (void)pthread_mutex_lock(&view_lock);
+    display_stop = 1;
+    (void)pthread_cond_signal(&view_cv);
+    (void)pthread_mutex_unlock(&view_lock);
+    (void)pthread_join(display_thread_id, NULL);
+}
+
+
+/*
+ * compose_status_bar
+ *   DESCRIPTION: Compose the text of the status bar without a status
+ *                message: the name of the player's room on the left and
+ *                the player's typing on the right.  Called while holding
+ *                world_lock.
+ *   INPUTS: none
+ *   OUTPUTS: bar -- the STATUS_MSG_LEN characters of the bar, followed
+ *                   by a NUL
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void compose_status_bar(char bar[STATUS_MSG_LEN + 1]) {
+    const char* room;   /* name of the player's room */
+    const char* typing; /* the player's typing       */
+    int32_t room_len;   /* characters of name shown  */
+    int32_t typing_len; /* characters of typing shown */
+
+    room = room_name(game_info.where);
+    typing = get_typed_command();
+    room_len = strlen(room);
+    if (STATUS_MSG_LEN < room_len)
+        room_len = STATUS_MSG_LEN;
+
+    /*
+     * Typing is right-aligned; once longer than half the bar, its start
+     * fills the right half.
+     */
+    typing_len = strlen(typing);
+    if (STATUS_MSG_LEN / 2 < typing_len)
+        typing_len = STATUS_MSG_LEN / 2;
+
+    memset(bar, ' ', STATUS_MSG_LEN);
+    bar[STATUS_MSG_LEN] = '\0';
+    memcpy(bar, room, room_len);
+    memcpy(bar + STATUS_MSG_LEN - typing_len, typing, typing_len);
+}
+
+
+/*
+ * overlay_status_msg
+ *   DESCRIPTION: Replace the status bar text with the current status
+ *                message, centered, if there is one that has not yet
+ *                expired.  Reads the message without blocking; may be
+ *                called from any thread.
+ *   INPUTS: bar -- the status bar text composed by compose_status_bar
+ *   OUTPUTS: bar -- the text to show
+ *   RETURN VALUE: none
  *   SIDE EFFECTS: none
  */
-static void cancel_tux_thread(void* ignore){
-	(void)pthread_cancel(tux_thread_id);
+static void overlay_status_msg(char bar[STATUS_MSG_LEN + 1]) {
+    status_msg_t msg;    /* copy of the message        */
+    uint32_t seq;        /* sequence number before copy */
+    struct timespec now; /* current time               */
+    int32_t len;         /* length of the message      */
+
+    do {
+        seq = __atomic_load_n(&status_seq, __ATOMIC_ACQUIRE);
+        memcpy(&msg, &status_msg, sizeof(msg));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (0 != (seq & 1) || seq != __atomic_load_n(&status_seq, __ATOMIC_RELAXED));
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    if ('\0' == msg.text[0] || now.tv_sec > msg.expires.tv_sec ||
+        (now.tv_sec == msg.expires.tv_sec && now.tv_nsec >= msg.expires.tv_nsec))
+        return;
+
+    msg.text[STATUS_MSG_LEN] = '\0';
+    len = strlen(msg.text);
+    memset(bar, ' ', STATUS_MSG_LEN);
+    memcpy(bar + (STATUS_MSG_LEN - len) / 2, msg.text, len);
+}
+
+
+/*
+ * display_thread
+ *   DESCRIPTION: Function executed by the display thread, which does all
+ *                of the drawing.  Waits for a new snapshot of the view
+ *                state, then draws the changes since the last one(a new
+ *                room, moved objects, or a moved view) and shows the
+ *                screen and status bar.  While no snapshot is waiting,
+ *                replaces preview rows with full-resolution ones, then
+ *                pre-renders the margin around the view, a few lines at
+ *                a time.  Draws only from the snapshot, so never takes
+ *                world_lock.  Exits once display_stop is set.
+ *   INPUTS: none(ignored)
+ *   OUTPUTS: none
+ *   RETURN VALUE: NULL
+ *   SIDE EFFECTS: draws into the build buffer and video memory
+ */
+static void* display_thread(void* ignore) {
+    view_state_t* s;    /* snapshot being drawn                */
+    const photo_t* p;   /* photo of shown room                 */
+    uint32_t entry;     /* room entries already drawn          */
+    uint32_t gen;       /* generation of shown room's contents */
+    int32_t refine_y;   /* next preview row to redraw          */
+    long refine_usec;   /* time spent refining the preview     */
+    struct timeval draw_start; /* time before a full draw       */
+    int prerender;      /* margin around view is incomplete    */
+    int32_t entered;    /* snapshot shows a newly entered room */
+    int32_t tmp;        /* for swapping snapshots              */
+
+    s = NULL;
+    entry = 0;
+    gen = 0;
+    refine_y = SCROLL_Y_DIM;
+    refine_usec = 0;
+    prerender = 0;
+    while (1) {
+        /* Wait for a snapshot, doing idle work first. */
+        (void)pthread_mutex_lock(&view_lock);
+        while (!view_fresh && !display_stop) {
+            if (SCROLL_Y_DIM > refine_y || prerender) {
+                (void)pthread_mutex_unlock(&view_lock);
+                if (SCROLL_Y_DIM > refine_y) {
+                    (void)gettimeofday(&draw_start, NULL);
+                    redraw_rect(0, refine_y, SCROLL_X_DIM,
+                                (SCROLL_Y_DIM - refine_y < REFINE_ROWS ?
+                                 SCROLL_Y_DIM - refine_y : REFINE_ROWS));
+                    refine_usec += usec_since(&draw_start);
+                    refine_y += REFINE_ROWS;
+                    if (SCROLL_Y_DIM <= refine_y) {
+                        note_full_draw(refine_usec);
+                    }
+                }
+                else {
+                    p = s->image.photo;
+                    prerender = (0 != prerender_view_margins
+                                 (photo_width(p), photo_height(p),
+                                  PRERENDER_LINES));
+                }
+                (void)pthread_mutex_lock(&view_lock);
+            }
+            else {
+                (void)pthread_cond_wait(&view_cv, &view_lock);
+            }
+        }
+        if (display_stop) {
+            (void)pthread_mutex_unlock(&view_lock);
+            return NULL;
+        }
+        tmp = view_front;
+        view_front = view_middle;
+        view_middle = tmp;
+        view_fresh = 0;
+        (void)pthread_mutex_unlock(&view_lock);
+        s = &view_state[view_front];
+        p = s->image.photo;
+
+        entered = (entry != s->entry);
+        if (entered) {
+            /* Prepare colors and photo drawing for the new room. */
+            entry = s->entry;
+            gen = s->gen;
+            shown_room = s->where;
+            shown_x = shown_y = 0;
+            set_view_window(shown_x, shown_y);
+            prep_room(&s->image);
+
+            /*
+             * Draw the room, unless it was pre-composed.  If full draws
+             * have been slow, the room is shown first as a preview, which
+             * is replaced by full-resolution rows before the margins are
+             * pre-rendered.
+             */
+            refine_y = SCROLL_Y_DIM;
+            if (!load_precomposed_room(gen)) {
+                if (0 < full_draw_count && PREVIEW_DRAW_USEC < full_draw_usec) {
+                    preview_room();
+                    refine_y = 0;
+                    refine_usec = 0;
+                }
+                else {
+                    (void)gettimeofday(&draw_start, NULL);
+                    redraw_room();
+                    note_full_draw(usec_since(&draw_start));
+                }
+            }
+        }
+        else {
+            /* Draw from this snapshot's copy of the room from now on. */
+            set_room_image(&s->image);
+            if (gen != s->gen) {
+                /* Objects moved or the photo changed. */
+                gen = s->gen;
+                redraw_changes(s->n_damage, s->damage);
+            }
+        }
+        move_view(s->map_x, s->map_y);
+        prerender = 1;
+
+        /*
+         * Stage the status bar(with any live status message, which may
+         * have been posted or have expired since the snapshot); then
+         * show_screen shows both at once.
+         */
+        overlay_status_msg(s->status);
+        show_status_bar(s->status);
+        show_screen();
+
+        /* Record the time taken to show the new room. */
+        if (entered) {
+            record_entry(shown_room, usec_since(&s->entry_time));
+        }
+    }
 }
 
 
@@ -225,224 +659,365 @@ static game_condition_t game_loop() {
      * Variables used to carry information between event loop ticks; see
      * initialization below for explanations of purpose.
      */
-    struct timeval start_time, tick_time;//
-
-    struct timeval cur_time; /* current time(during tick)      */
-    cmd_t cmd;               /* command issued by input control */
-    //int32_t enter_room;      /* player has changed rooms        */
+    struct timespec start_time, tick_time;
+
+    struct timespec start_cpu; /* processor time at start        */
+    struct timespec cur_time;  /* current time(during events)    */
+    struct itimerspec its;     /* tick timer setting             */
+    struct epoll_event events[NUM_EVENT_FDS]; /* ready sources   */
+    cmd_event_t ev;            /* command read from input        */
+    uint64_t expired;          /* timer expirations              */
+    int32_t ticked;            /* a tick has passed              */
+    int32_t status_expired;    /* a status message has expired   */
+    int32_t tux_clock;         /* the Tux controller counts time */
+    long usec;                 /* lateness of wake-up            */
+    int32_t quit;              /* player has quit                */
+    int n;                     /* number of ready sources        */
+    int i;                     /* loop index over ready sources  */
 
-    /* Record the starting time--assume success. */
-    (void)gettimeofday(&start_time, NULL);
+    /*
+     * Record the starting time--assume success.  Ticks are timed on the
+     * monotonic clock, which is not affected by changes to the date.
+     */
+    (void)clock_gettime(CLOCK_MONOTONIC, &start_time);
+    (void)clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start_cpu);
 
     /* Calculate the time at which the first event loop tick should occur. */
     tick_time = start_time;
-    if ((tick_time.tv_usec += TICK_USEC) > 1000000) {
-        tick_time.tv_sec++;
-        tick_time.tv_usec -= 1000000;
+    advance_tick(&tick_time);
+    its.it_value = tick_time;
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = TICK_USEC * 1000L;
+    if (0 != timerfd_settime(tick_fd, TFD_TIMER_ABSTIME, &its, NULL)) {
+        PANIC("cannot start tick timer");
     }
 
-    /* The player has just entered the first room. */
+    /* The player has just entered the first room; show it. */
+    (void)pthread_mutex_lock(&world_lock);
     enter_room = 1;
+    note_room_entry();
+    publish_view_state(1);
+    (void)pthread_mutex_unlock(&world_lock);
 	
 	//display time elapsed
 	tuxcontro_int();
+	add_event_fd(get_tux_fd(), EVENT_TUX);
+
+    /*
+     * Let the Tux controller count the time itself if it can(the driver
+     * restarts its clock after a controller reset); if not, the time is
+     * sent to it at each tick.
+     */
+    tux_clock = (0 == start_clock_on_tux(0));
 	
-    /* The main event loop. */
+    /*
+     * The main event loop.  The display thread draws and shows the view
+     * published after each batch of events, so this loop only runs the
+     * game.  Keystrokes and Tux controller button reports are handled
+     * as soon as they arrive.  Directions held down scroll the view at
+     * each tick.
+     */
     while (1) {
+        n = epoll_wait(event_fd, events, NUM_EVENT_FDS, -1);
+        if (0 > n) {
+            if (EINTR == errno)
+                continue;
+            /* Panic!(should never happen) */
+            clear_mode_X();
+            shutdown_input();
+            perror("epoll_wait");
+            exit(3);
+        }
+        (void)clock_gettime(CLOCK_MONOTONIC, &cur_time);
+
+        /* Read input from each ready source, queueing the commands. */
+        ticked = 0;
+        status_expired = 0;
+        for (i = 0; n > i; i++) {
+            switch (events[i].data.u32) {
+                case EVENT_KEYBOARD:
+                    read_keyboard();
+                    break;
+                case EVENT_TUX:
+                    read_tux_buttons();
+                    break;
+                case EVENT_TICK:
+                    /*
+                     * Record the lateness of the tick.  If we missed one
+                     * or more ticks completely, the timer counts them;
+                     * skip the extra ticks.
+                     */
+                    if (sizeof(expired) != read(tick_fd, &expired, sizeof(expired)))
+                        break;
+                    usec = (cur_time.tv_sec - tick_time.tv_sec) * 1000000L +
+                           (cur_time.tv_nsec - tick_time.tv_nsec) / 1000;
+                    tick_count++;
+                    tick_late_usec += usec;
+                    if (tick_late_max < usec)
+                        tick_late_max = usec;
+                    tick_missed += expired - 1;
+                    while (0 < expired--)
+                        advance_tick(&tick_time);
+                    ticked = 1;
+
+                    if (!tux_clock)
+                        display_time_on_tux(cur_time.tv_sec - start_time.tv_sec);
+                    break;
+                case EVENT_STATUS:
+                    /* The message has expired; republishing removes it. */
+                    (void)read(status_fd, &expired, sizeof(expired));
+                    status_expired = 1;
+                    break;
+            }
+        }
+
         /*
-         * Update the screen, preparing the VGA palette and photo-drawing
-         * routines and drawing a new room photo first if the player has
-         * entered a new room, then showing the screen(and status bar,
-         * once you have it working).
+         * Run the commands read, in order.  Commands may change the world
+         * and the view, which the display and precompose threads read.
+         * Note that typed commands that move objects change the room's
+         * generation, which makes the display thread redraw them.  Once the
+         * player wins, their room is NULL, and the rest are not run.
          */
-        if (enter_room) {
-            /* Reset the view window to(0,0). */
-            game_info.map_x = game_info.map_y = 0;
-            set_view_window(game_info.map_x, game_info.map_y);
-
-            /* Discard any partially-typed command. */
-            reset_typed_command();
-
-            /* Adjust colors and photo drawing for the current room photo. */
-            prep_room(game_info.where);
+        (void)pthread_mutex_lock(&world_lock);
+        quit = 0;
+        while (NULL != game_info.where && dequeue_command(&ev)) {
+            quit |= run_command(&ev);
+        }
+        if (quit) {
+            (void)pthread_mutex_unlock(&world_lock);
+            record_loop_time(&start_time, &start_cpu);
+            return GAME_QUIT;
+        }
 
-            /* Draw the room(calls show). */
-            redraw_room();
+        /* If player wins the game, their room becomes NULL. */
+        if (NULL == game_info.where) {
+            (void)pthread_mutex_unlock(&world_lock);
+            record_loop_time(&start_time, &start_cpu);
+            return GAME_WON;
+        }
 
-            /* Only draw once on entry. */
-            enter_room = 0;
+        /* Scroll for the directions held down, once per tick. */
+        if (ticked) {
+            scroll_held(get_held_directions(&cur_time));
         }
 
+        /* Show the results(and the status bar). */
+        note_room_entry();
+        publish_view_state(status_expired);
+        (void)pthread_mutex_unlock(&world_lock);
+        arm_status_timer();
+    } /* end of the main event loop */
+}
 
-	show_screen();
-	
-	//critical section starts here	
-	pthread_mutex_lock(&msg_lock);
-	
-	char combined_string[40];
-	int p;
-	for(p=0; p<40; p++){
-		combined_string[p] = 0x20;	//set all the status bar to space
-	}
-	
-	
-	//If need to show the status message, show it on the status bar
-	if(status_msg[0] != '\0'){	
-		int message_len = strlen(status_msg);
-		int index = (40 - message_len)/2;
-		int a;
-		int i = 0;
-		for(a=index; a<(index+message_len); a++){
-			combined_string[a] = status_msg[i];
-			i+=1;
-		}
-		show_status_bar(&(combined_string[0]));	//Show the status bar on the video display.
-		pthread_mutex_unlock(&msg_lock);
-		//critical section ends here
-	}
-	
-	//if there is no status message, show the room name and typing string 
-	//by combining room name string typing string in a single big string
-	else{
-		const char *str_room;			
-		const char *str_typing;
-		str_room = room_name(game_info.where);	//get room name
-		str_typing = get_typed_command();	//get typing string
-	
-	
-		int str_typing_start_index = 0;
-		int str_room_len = strlen(str_room);	
-		int str_typing_len = strlen(str_typing);
-		int i;
-		int j;
-	
-		for(i=0; i<str_room_len; i++){	//write room name starting from the left of the string
-			combined_string[i] = str_room[i];
-		}
-	
-		if(str_typing_len <= 20){	
-			str_typing_start_index = 40 - str_typing_len;	
-			i = 0;
-			for(j=str_typing_start_index; j<40; j++){	//write typing characters
-				combined_string[j] = str_typing[i];
-				i+=1;
-			}
-		}
-		else{
-			str_typing_start_index = 20;	//fill all right half of the status bar
-			i = 0;
-			for(j=str_typing_start_index; j<40; j++){	//write typing characters
-				combined_string[j] = str_typing[i];
-				i+=1;
-			}
-		}
-	
-		show_status_bar(&(combined_string[0]));	//Show the status bar on the video display.
-	
-			
-		pthread_mutex_unlock(&msg_lock);
-		//critical section ends here	
-	}
-		
-		
-		
-		
-        
 
-        /*
-         * Wait for tick.  The tick defines the basic timing of our
-         * event loop, and is the minimum amount of time between events.
-         */
-        do {
-            if (gettimeofday(&cur_time, NULL) != 0) {
-                /* Panic!(should never happen) */
-                clear_mode_X();
-                shutdown_input();
-                perror("gettimeofday");
-                exit(3);
+/*
+ * run_command
+ *   DESCRIPTION: Carry out a command from the keyboard or the Tux
+ *                controller.  Called while holding world_lock.
+ *   INPUTS: ev -- the command(and, for CMD_TYPED, the line entered)
+ *   OUTPUTS: none
+ *   RETURN VALUE: 1 if the player quits, 0 otherwise
+ *   SIDE EFFECTS: may move the view, move the player, or change the world
+ */
+static int32_t run_command(const cmd_event_t* ev) {
+    switch (ev->cmd) {
+        case CMD_UP:    move_photo_down();  break;
+        case CMD_RIGHT: move_photo_left();  break;
+        case CMD_DOWN:  move_photo_up();    break;
+        case CMD_LEFT:  move_photo_right(); break;
+        case CMD_MOVE_LEFT:
+            enter_room |= (TC_CHANGE_ROOM == try_to_move_left(&game_info.where));
+            break;
+        case CMD_ENTER:
+            enter_room |= (TC_CHANGE_ROOM == try_to_enter(&game_info.where));
+            break;
+        case CMD_MOVE_RIGHT:
+            enter_room |= (TC_CHANGE_ROOM == try_to_move_right(&game_info.where));
+            break;
+        case CMD_TYPED:
+            if (handle_typing(ev->typed)) {
+                enter_room = 1;
             }
-        } while (!time_is_after(&cur_time, &tick_time));
+            break;
+        case CMD_QUIT:
+            return 1;
+        default: break;
+    }
+    return 0;
+}
 
-        /*
-         * Advance the tick time.  If we missed one or more ticks completely,
-         * i.e., if the current time is already after the time for the next
-         * tick, just skip the extra ticks and advance the clock to the one
-         * that we haven't missed.
-         */
-        do {
-            if ((tick_time.tv_usec += TICK_USEC) > 1000000) {
-                tick_time.tv_sec++;
-                tick_time.tv_usec -= 1000000;
-            }
-        } while (time_is_after(&cur_time, &tick_time));
 
-        /*
-         * Handle asynchronous events.  These events use real time rather
-         * than tick counts for timing, although the real time is rounded
-         * off to the nearest tick by definition.
-         */
-        /*(none right now...) */
+/*
+ * scroll_held
+ *   DESCRIPTION: Scroll the view for the directions held down on the
+ *                keyboard or Tux controller; see SCROLL_ACCEL.  Movement
+ *                stops at the edges of the photo.  Called at each tick
+ *                while holding world_lock.
+ *   INPUTS: held -- bit(1 << cmd) set for each direction command held
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: shifts view window(drawn by the display thread)
+ */
+static void scroll_held(uint32_t held) {
+    int32_t dx, dy;       /* distance, then origin */
+    int32_t max_x, max_y; /* largest view origin */
+
+    game_info.x_vel = held_velocity(game_info.x_vel, game_info.x_speed,
+                                    ((held >> CMD_RIGHT) & 1) - ((held >> CMD_LEFT) & 1));
+    game_info.y_vel = held_velocity(game_info.y_vel, game_info.y_speed,
+                                    ((held >> CMD_DOWN) & 1) - ((held >> CMD_UP) & 1));
+
+    /* Scroll by whole pixels, carrying the fractions to the next tick. */
+    game_info.x_frac = (0 == game_info.x_vel ? 0 : game_info.x_frac + game_info.x_vel);
+    game_info.y_frac = (0 == game_info.y_vel ? 0 : game_info.y_frac + game_info.y_vel);
+    dx = game_info.x_frac / 16;
+    dy = game_info.y_frac / 16;
+    game_info.x_frac -= dx * 16;
+    game_info.y_frac -= dy * 16;
+
+    max_x = room_photo_width(game_info.where) - SCROLL_X_DIM;
+    max_y = room_photo_height(game_info.where) - SCROLL_Y_DIM;
+    dx += game_info.map_x;
+    dy += game_info.map_y;
+    game_info.map_x = (0 > dx ? 0 : (max_x < dx ? max_x : dx));
+    game_info.map_y = (0 > dy ? 0 : (max_y < dy ? max_y : dy));
+}
 
-        /*
-         * Handle synchronous events--in this case, only player commands.
-         * Note that typed commands that move objects may cause the room
-         * to be redrawn.
-         */
 
-		 
-		 
-		display_time_on_tux(cur_time.tv_sec - start_time.tv_sec);
-		
-		//critical section for tux controller control
-		(void)pthread_mutex_lock(&tux_lock);
-		//tux_cmd = CMD_NONE;
-		tux_cmd = get_tux_command();
-		(void)pthread_cond_signal(&tux_cv);
-		(void)pthread_mutex_unlock(&tux_lock);
- 
-		 
-		 
-        cmd = get_command();
-        switch (cmd) {
-            case CMD_UP:    move_photo_down();  break;
-            case CMD_RIGHT: move_photo_left();  break;
-            case CMD_DOWN:  move_photo_up();    break;
-            case CMD_LEFT:  move_photo_right(); break;
-            case CMD_MOVE_LEFT:
-                enter_room = (TC_CHANGE_ROOM == try_to_move_left(&game_info.where));
-                break;
-            case CMD_ENTER:
-                enter_room = (TC_CHANGE_ROOM == try_to_enter(&game_info.where));
-                break;
-            case CMD_MOVE_RIGHT:
-                enter_room = (TC_CHANGE_ROOM == try_to_move_right(&game_info.where));
-                break;
-            case CMD_TYPED:
-                if (handle_typing()) {
-                    enter_room = 1;
-                }
-                break;
-            case CMD_QUIT: return GAME_QUIT;
-            default: break;
-        }
+/*
+ * held_velocity
+ *   DESCRIPTION: Find the scrolling speed along one axis for the next
+ *                tick.  A direction newly held(or reversed) starts at one
+ *                move per tick, then speeds up by SCROLL_ACCEL per tick.
+ *   INPUTS: vel -- speed over the last tick(1/16 pixel per tick)
+ *           speed -- pixels per move along the axis
+ *           dir -- 1 or -1 for the direction held, or 0 for none
+ *   OUTPUTS: none
+ *   RETURN VALUE: speed for the next tick(1/16 pixel per tick)
+ *   SIDE EFFECTS: none
+ */
+static int32_t held_velocity(int32_t vel, int32_t speed, int32_t dir) {
+    if (0 == dir) {
+        return 0;
+    }
+    if (0 >= vel * dir) {
+        return dir * speed * 16;
+    }
+    vel += dir * SCROLL_ACCEL;
+    if (SCROLL_MAX_SPEED * speed * 16 < vel * dir) {
+        vel = dir * SCROLL_MAX_SPEED * speed * 16;
+    }
+    return vel;
+}
 
-        /* If player wins the game, their room becomes NULL. */
-        if (NULL == game_info.where) {
-            return GAME_WON;
-        }
-    } /* end of the main event loop */
+
+/*
+ * open_event_fds
+ *   DESCRIPTION: Create the event loop's epoll instance and timers, and
+ *                add the keyboard and the timers to the instance.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: 0 on success, -1 on failure
+ *   SIDE EFFECTS: prints an error message on failure
+ */
+static int32_t open_event_fds() {
+    struct epoll_event ev; /* event for each source */
+
+    if (0 > (event_fd = epoll_create(NUM_EVENT_FDS)) ||
+        0 > (tick_fd = timerfd_create(CLOCK_MONOTONIC, 0)) ||
+        0 > (status_fd = timerfd_create(CLOCK_MONOTONIC, 0))) {
+        perror("create event loop");
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.u32 = EVENT_KEYBOARD;
+    if (0 != epoll_ctl(event_fd, EPOLL_CTL_ADD, get_keyboard_fd(), &ev)) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    add_event_fd(tick_fd, EVENT_TICK);
+    add_event_fd(status_fd, EVENT_STATUS);
+    return 0;
+}
+
+
+/*
+ * add_event_fd
+ *   DESCRIPTION: Add a source of input to the event loop.  Failure is
+ *                ignored, since the Tux controller need not be present(its
+ *                buttons are then never pressed).
+ *   INPUTS: fd -- file descriptor of the source
+ *           source -- EVENT_* value identifying the source
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void add_event_fd(int fd, uint32_t source) {
+    struct epoll_event ev; /* event for the source */
+
+    ev.events = EPOLLIN;
+    ev.data.u32 = source;
+    (void)epoll_ctl(event_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+
+/*
+ * arm_status_timer
+ *   DESCRIPTION: Set the status message timer to expire with the latest
+ *                status message, if it has not already been set for
+ *                that message.  Status messages are posted only by the
+ *                event loop thread, which calls this function.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: changes the status message timer
+ */
+static void arm_status_timer() {
+    struct itimerspec its; /* expiry time of the message */
+
+    if (status_armed == __atomic_load_n(&status_seq, __ATOMIC_ACQUIRE))
+        return;
+    status_armed = status_seq;
+    its.it_value = status_msg.expires;
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = 0;
+    (void)timerfd_settime(status_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+
+/*
+ * record_loop_time
+ *   DESCRIPTION: Record the processor time used by the event loop and
+ *                the time for which it ran.  Called by the event loop
+ *                thread as the loop ends.
+ *   INPUTS: start -- the time at which the loop started
+ *           start_cpu -- the processor time of the thread at that time
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: sets loop_cpu and loop_time
+ */
+static void record_loop_time(const struct timespec* start,
+                             const struct timespec* start_cpu) {
+    struct timespec now; /* current time                 */
+    struct timespec cpu; /* processor time of the thread */
+
+    (void)clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    loop_cpu = (cpu.tv_sec - start_cpu->tv_sec) + (cpu.tv_nsec - start_cpu->tv_nsec) / 1e9;
+    loop_time = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
 }
 
 
 /*
  * handle_typing
- *   DESCRIPTION: Parse and execute a typed command.
- *   INPUTS: none(reads typed command)
+ *   DESCRIPTION: Parse and execute a typed command.  A line that is not
+ *                carried out is given back for editing.
+ *   INPUTS: line -- the line entered
  *   OUTPUTS: none
  *   RETURN VALUE: 1 if the player's room changes, 0 otherwise
  *   SIDE EFFECTS: may move the player, move objects, and/or redraw the screen
  */
-static int32_t handle_typing() {
+static int32_t handle_typing(const char* line) {
     const char*      cmd;     /* command verb typed                */
     int32_t          cmd_len; /* length of command verb            */
     const char*      arg;     /* argument given to command verb    */
@@ -450,7 +1025,7 @@ static int32_t handle_typing() {
     tc_action_t      result;  /* result of typed command execution */
 
     /* Read the command and strip leading spaces.  If it's empty, return. */
-    cmd = get_typed_command();
+    cmd = line;
     while (' ' == *cmd) { cmd++; }
     if ('\0' == *cmd) { return 0; }
 
@@ -537,20 +1112,23 @@ static int32_t handle_typing() {
         }
 
         /* Handle command result and return. */
+        /*
+         * The line was taken from the typed command when entered.  Moved
+         * objects(TC_REDRAW_ROOM) change the room's generation, so the
+         * display thread redraws them.
+         */
         if (TC_CHANGE_ROOM == result) {
             return 1;
         }
-        if (TC_ALLOW_EDIT != result) {
-            reset_typed_command();
-            if (TC_REDRAW_ROOM == result) {
-                redraw_room();
-            }
+        if (TC_ALLOW_EDIT == result) {
+            restore_typed_command(line);
         }
         return 0;
     }
 
-    /* The command was not recognized. */
+    /* The command was not recognized; let the player edit it. */
     show_status("What are you babbling about?");
+    restore_typed_command(line);
     return 0;
 }
 
@@ -570,6 +1148,8 @@ static void init_game() {
     game_info.map_y = 0;
     game_info.x_speed = MOTION_SPEED;
     game_info.y_speed = MOTION_SPEED;
+    game_info.x_vel = game_info.y_vel = 0;
+    game_info.x_frac = game_info.y_frac = 0;
 }
 
 
@@ -581,23 +1161,16 @@ static void init_game() {
  *   INPUTS: none
  *   OUTPUTS: none
  *   RETURN VALUE: none
- *   SIDE EFFECTS: shifts view window
+ *   SIDE EFFECTS: shifts view window(drawn by the display thread)
  */
 static void move_photo_down() {
     int32_t delta; /* Number of pixels by which to move. */
-    int32_t idx;   /* Index over rows to redraw.         */
 
     /* Calculate the number of pixels by which to move. */
     delta = (game_info.y_speed > game_info.map_y ? game_info.map_y : game_info.y_speed);
 
     /* Shift the logical view upward. */
     game_info.map_y -= delta;
-    set_view_window(game_info.map_x, game_info.map_y);
-
-    /* Draw the newly exposed lines. */
-    for (idx = 0; delta > idx; idx++) {
-        (void)draw_horiz_line(idx);
-    }
 }
 
 
@@ -609,11 +1182,10 @@ static void move_photo_down() {
  *   INPUTS: none
  *   OUTPUTS: none
  *   RETURN VALUE: none
- *   SIDE EFFECTS: shifts view window
+ *   SIDE EFFECTS: shifts view window(drawn by the display thread)
  */
 static void move_photo_left() {
     int32_t delta; /* Number of pixels by which to move. */
-    int32_t idx;   /* Index over columns to redraw.      */
 
     /* Calculate the number of pixels by which to move. */
     delta = room_photo_width(game_info.where) - SCROLL_X_DIM - game_info.map_x;
@@ -621,12 +1193,6 @@ static void move_photo_left() {
 
     /* Shift the logical view to the right. */
     game_info.map_x += delta;
-    set_view_window(game_info.map_x, game_info.map_y);
-
-    /* Draw the newly exposed lines. */
-    for (idx = 1; delta >= idx; idx++) {
-        (void)draw_vert_line(SCROLL_X_DIM - idx);
-    }
 }
 
 
@@ -638,23 +1204,16 @@ static void move_photo_left() {
  *   INPUTS: none
  *   OUTPUTS: none
  *   RETURN VALUE: none
- *   SIDE EFFECTS: shifts view window
+ *   SIDE EFFECTS: shifts view window(drawn by the display thread)
  */
 static void move_photo_right() {
     int32_t delta; /* Number of pixels by which to move. */
-    int32_t idx;   /* Index over columns to redraw.      */
 
     /* Calculate the number of pixels by which to move. */
     delta = (game_info.x_speed > game_info.map_x ? game_info.map_x : game_info.x_speed);
 
     /* Shift the logical view to the left. */
     game_info.map_x -= delta;
-    set_view_window(game_info.map_x, game_info.map_y);
-
-    /* Draw the newly exposed lines. */
-    for (idx = 0; delta > idx; idx++) {
-        (void)draw_vert_line(idx);
-    }
 }
 
 
@@ -666,11 +1225,10 @@ static void move_photo_right() {
  *   INPUTS: none
  *   OUTPUTS: none
  *   RETURN VALUE: none
- *   SIDE EFFECTS: shifts view window
+ *   SIDE EFFECTS: shifts view window(drawn by the display thread)
  */
 static void move_photo_up() {
     int32_t delta; /* Number of pixels by which to move. */
-    int32_t idx;   /* Index over rows to redraw.         */
 
     /* Calculate the number of pixels by which to move. */
     delta = room_photo_height(game_info.where) - SCROLL_Y_DIM - game_info.map_y;
@@ -678,12 +1236,306 @@ static void move_photo_up() {
 
     /* Shift the logical view upward. */
     game_info.map_y += delta;
-    set_view_window(game_info.map_x, game_info.map_y);
+}
+
+
+/*
+ * load_precomposed_room
+ *   DESCRIPTION: Draw the shown room from a pre-composed frame if one is
+ *                up to date, then ask the precompose thread to prepare
+ *                the rooms next to it.  The view must be at(0,0).  Called
+ *                by the display thread.
+ *   INPUTS: gen -- generation of the room's contents to be shown
+ *   OUTPUTS: none
+ *   RETURN VALUE: 1 if the room was drawn, or 0 if it must be drawn
+ *   SIDE EFFECTS: may draw into the build buffer; wakes precompose thread
+ */
+static int32_t load_precomposed_room(uint32_t gen) {
+    int32_t slot; /* slot holding the room */
+
+    (void)pthread_mutex_lock(&precomp_lock);
+    slot = precomp_find(shown_room, gen);
+    if (0 <= slot) {
+        invalidate_build_buffer();
+        load_frame(precomp[slot].frame);
+        precomp_hits++;
+    }
+    precomp_room = shown_room;
+    (void)pthread_cond_signal(&precomp_cv);
+    (void)pthread_mutex_unlock(&precomp_lock);
+
+    return (0 <= slot);
+}
+
 
-    /* Draw the newly exposed lines. */
-    for (idx = 1; delta >= idx; idx++) {
+/*
+ * preview_room
+ *   DESCRIPTION: Show the shown room at quarter resolution, as a
+ *                quick first frame when full draws are slow.  The caller
+ *                must then redraw the view's rows at full resolution.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: draws into the build buffer
+ */
+static void preview_room() {
+    invalidate_build_buffer();
+    draw_preview(fill_preview_buffer);
+    preview_count++;
+}
+
+
+/*
+ * note_full_draw
+ *   DESCRIPTION: Add the time taken to draw an entered room's view at
+ *                full resolution to the running average that decides
+ *                whether rooms are entered via a preview.  Called by the
+ *                display thread.
+ *   INPUTS: usec -- time taken in microseconds
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void note_full_draw(long usec) {
+    if (0 == full_draw_count++) {
+        full_draw_usec = usec;
+    }
+    else {
+        full_draw_usec = (3 * full_draw_usec + usec) / 4;
+    }
+}
+
+
+/*
+ * record_entry
+ *   DESCRIPTION: Add the time taken to show a room after the player
+ *                entered it to the totals for all rooms and for the room.
+ *   INPUTS: r -- the room entered
+ *           usec -- time from entry to first frame in microseconds
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: changes entry statistics
+ */
+static void record_entry(const room_t* r, long usec) {
+    entry_stat_t* stat[2]; /* totals and the room's statistics */
+    int32_t i;             /* index over rooms/statistics      */
+
+    /*
+     * Find the room's statistics, or unused ones.  Rooms past the first
+     * MAX_ENTRY_ROOMS are counted only in the totals.
+     */
+    stat[0] = &entry_total;
+    stat[1] = NULL;
+    for (i = 0; MAX_ENTRY_ROOMS > i && NULL == stat[1]; i++) {
+        if (r == entry_room[i].room || NULL == entry_room[i].room) {
+            stat[1] = &entry_room[i];
+            stat[1]->room = r;
+        }
+    }
+
+    for (i = 0; 2 > i && NULL != stat[i]; i++) {
+        stat[i]->count++;
+        stat[i]->usec += usec;
+        if (usec > stat[i]->usec_max) {
+            stat[i]->usec_max = usec;
+        }
+    }
+}
+
+
+/*
+ * move_view
+ *   DESCRIPTION: Move the logical view window drawn by the display thread,
+ *                drawing the rows and columns exposed by the move(the
+ *                whole view if it moved that far).  Called by the display
+ *                thread.
+ *   INPUTS:(x,y) -- new upper left pixel of the view
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: shifts view window; draws into the build buffer
+ */
+static void move_view(int32_t x, int32_t y) {
+    int32_t dx, dy; /* distance moved        */
+    int32_t idx;    /* index over lines      */
+
+    dx = x - shown_x;
+    dy = y - shown_y;
+    if (0 == dx && 0 == dy) {
+        return;
+    }
+    shown_x = x;
+    shown_y = y;
+    set_view_window(shown_x, shown_y);
+
+    /* Draw the newly exposed rows, then columns. */
+    for (idx = 0; -dy > idx && SCROLL_Y_DIM > idx; idx++) {
+        (void)draw_horiz_line(idx);
+    }
+    for (idx = 1; dy >= idx && SCROLL_Y_DIM >= idx; idx++) {
         (void)draw_horiz_line(SCROLL_Y_DIM - idx);
     }
+    for (idx = 0; -dx > idx && SCROLL_X_DIM > idx; idx++) {
+        (void)draw_vert_line(idx);
+    }
+    for (idx = 1; dx >= idx && SCROLL_X_DIM >= idx; idx++) {
+        (void)draw_vert_line(SCROLL_X_DIM - idx);
+    }
+}
+
+
+/*
+ * note_room_entry
+ *   DESCRIPTION: If the player has just changed rooms, reset the view to
+ *                the upper left of the new room, discard any partially-
+ *                typed command, and count and time the entry for the
+ *                display thread.  Called while holding world_lock.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: changes game_info and the typed command; clears
+ *                 enter_room
+ */
+static void note_room_entry() {
+    if (enter_room) {
+        game_info.map_x = game_info.map_y = 0;
+        reset_typed_command();
+        view_entry++;
+        (void)gettimeofday(&view_entry_time, NULL);
+        enter_room = 0;
+    }
+}
+
+
+/*
+ * precomp_find
+ *   DESCRIPTION: Find a pre-composed frame of a room's contents as of a
+ *                given generation.  The caller must hold precomp_lock.
+ *   INPUTS: r -- the room
+ *           gen -- the generation of its contents
+ *   OUTPUTS: none
+ *   RETURN VALUE: index of the slot holding the frame, or -1 if none
+ *   SIDE EFFECTS: none
+ */
+static int32_t precomp_find(const room_t* r, uint32_t gen) {
+    int32_t i; /* index over slots */
+
+    for (i = 0; NUM_ROOM_NEIGHBORS > i; i++) {
+        if (r == precomp[i].room && gen == precomp[i].gen) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * precomp_wanted
+ *   DESCRIPTION: Check whether a room is next to the player's room.  The
+ *                caller must hold precomp_lock.
+ *   INPUTS: r -- the room
+ *   OUTPUTS: none
+ *   RETURN VALUE: 1 if a frame of the room is wanted, or 0 if not
+ *   SIDE EFFECTS: none
+ */
+static int32_t precomp_wanted(const room_t* r) {
+    int32_t i; /* index over neighbors */
+
+    if (NULL == precomp_room || NULL == r) {
+        return 0;
+    }
+    for (i = 0; NUM_ROOM_NEIGHBORS > i; i++) {
+        if (r == room_neighbor(precomp_room, i)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * precomp_next
+ *   DESCRIPTION: Choose the next room to pre-compose.  The caller must
+ *                hold precomp_lock and world_lock.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: a room next to the player's room without an up-to-date
+ *                 frame, or NULL if there is none
+ *   SIDE EFFECTS: none
+ */
+static room_t* precomp_next() {
+    room_t* r; /* neighboring room     */
+    int32_t i; /* index over neighbors */
+
+    if (NULL == precomp_room) {
+        return NULL;
+    }
+    for (i = 0; NUM_ROOM_NEIGHBORS > i; i++) {
+        r = room_neighbor(precomp_room, i);
+        if (NULL != r && 0 > precomp_find(r, room_generation(r))) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * precomp_victim
+ *   DESCRIPTION: Choose a slot for a new frame: one that does not hold an
+ *                up-to-date frame of a room next to the player's room.
+ *                The caller must hold precomp_lock and world_lock, and
+ *                must want a frame that no slot holds, so such a slot
+ *                always exists.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: index of the slot
+ *   SIDE EFFECTS: none
+ */
+static int32_t precomp_victim() {
+    int32_t i; /* index over slots */
+
+    for (i = 0; NUM_ROOM_NEIGHBORS > i; i++) {
+        if (NULL == precomp[i].room || !precomp_wanted(precomp[i].room) ||
+            room_generation(precomp[i].room) != precomp[i].gen) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * redraw_changes
+ *   DESCRIPTION: Redraw the parts of the shown room changed by a typed
+ *                command(objects appearing or vanishing), or the whole
+ *                room if the room's photo changed, and record the time
+ *                taken.  Called by the display thread.
+ *   INPUTS: n -- number of changed rectangles, or -1 if all changed
+ *           rects -- the changed rectangles, in photo pixels
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: draws into the build buffer
+ */
+static void redraw_changes(int32_t n, const rect_t* rects) {
+    int32_t i;             /* index over changed rectangles */
+    struct timeval start;  /* time before redraw            */
+    long usec;             /* time taken in microseconds    */
+
+    (void)gettimeofday(&start, NULL);
+
+    if (0 > n) {
+        redraw_room();
+    }
+    for (i = 0; n > i; i++) {
+        redraw_rect(rects[i].x, rects[i].y, rects[i].w, rects[i].h);
+    }
+
+    usec = usec_since(&start);
+    redraw_count++;
+    redraw_usec += usec;
+    if (usec > redraw_usec_max) {
+        redraw_usec_max = usec;
+    }
 }
 
 
@@ -696,73 +1548,75 @@ static void move_photo_up() {
  *   SIDE EFFECTS: Draws the entire screen(but not the status bar).
  */
 static void redraw_room() {
-    int32_t i; /* index over rows */
+    /* Nothing pre-rendered for the old contents can be reused. */
+    invalidate_build_buffer();
 
-    /* Draw all lines in the scroll region. */
-    for (i = 0; i < SCROLL_Y_DIM; i++) {
-        (void)draw_horiz_line(i);
-    }
+    /* Draw all lines in the scroll region(in parallel bands). */
+    redraw_view();
 }
 
 
 /*
- * status_thread
- *   DESCRIPTION: Function executed by status message helper thread.
- *                Waits for a message to be displayed, then shows the
- *                message for 1.5 seconds before deleting it.  If a
- *                new message has appeared in the meantime, restarts the
- *                clock and tries again.
+ * precompose_thread
+ *   DESCRIPTION: Function executed by the frame pre-composition thread.
+ *                Composes the first frame of each room next to the
+ *                player's room that lacks an up-to-date one, then waits
+ *                for the player to move.  Each frame is composed from a
+ *                copy of its room's image, holding no lock, and is
+ *                abandoned if the room changes meanwhile.
  *   INPUTS: none(ignored)
  *   OUTPUTS: none
  *   RETURN VALUE: NULL
- *   SIDE EFFECTS: Changes the status message to an empty string.
+ *   SIDE EFFECTS: fills the slots of pre-composed frames
  */
-static void* status_thread(void* ignore) {
-    struct timespec ts; /* absolute wake-up time */
+static void* precompose_thread(void* ignore) {
+    unsigned char buf[SCROLL_X_DIM]; /* graphical image of a line */
+    unsigned char* tmp;              /* frame swapped into a slot */
+    room_t* r;                       /* room being composed       */
+    uint32_t gen;                    /* its generation            */
+    int32_t slot;                    /* slot receiving the frame  */
+    int32_t y;                       /* index over rows           */
+
+    (void)pthread_mutex_lock(&precomp_lock);
+    for (slot = 0; NUM_ROOM_NEIGHBORS > slot; slot++) {
+        precomp[slot].frame = precomp_frames[slot];
+    }
+    precomp_scratch = precomp_frames[NUM_ROOM_NEIGHBORS];
 
     while (1) {
-        /*
-         * Wait for a message to appear.  Note that we must check the
-         * condition after acquiring the lock, and that pthread_cond_wait
-         * yields the lock, then reacquires the lock before returning.
-         */
-        (void)pthread_mutex_lock(&msg_lock);
-        while ('\0' == status_msg[0]) {
-            pthread_cond_wait(&msg_cv, &msg_lock);
-        }
-
-        /*
-         * A message is present: if we stop before the timeout
-         * passes, assume that a new one has been posted; if the
-         * timeout passes, clear the message and wait for a new one.
-         */
-        do {
-            /* Get the current time. */
-            clock_gettime(CLOCK_REALTIME, &ts);
-
-            /* Add 1.5 seconds to it. */
-            if (500000000 <= ts.tv_nsec) {
-                ts.tv_sec += 2;
-                ts.tv_nsec -= 500000000;
-            }
-			else {
-                ts.tv_sec += 1;
-                ts.tv_nsec += 500000000;
+        /* Wait for a room to compose, and copy its image. */
+        while (1) {
+            (void)pthread_mutex_lock(&world_lock);
+            if (NULL != (r = precomp_next())) {
+                break;
             }
+            (void)pthread_mutex_unlock(&world_lock);
+            pthread_cond_wait(&precomp_cv, &precomp_lock);
+        }
+        copy_room_image(r, &precomp_image);
+        gen = room_generation(r);
+        (void)pthread_mutex_unlock(&world_lock);
+        (void)pthread_mutex_unlock(&precomp_lock);
+
+        /* Compose from the copy while commands run and frames are used. */
+        for (y = 0; SCROLL_Y_DIM > y; y++) {
+            fill_image_horiz_buffer(&precomp_image, 0, y, buf);
+            frame_store_line(precomp_scratch, y, buf);
+        }
 
-            /*
-             * And go to sleep.  If we wake up due to anything but a
-             * timeout, we assume(possibly incorrectly) that a new
-             * message has appeared and try to wait 1.5 seconds again.
-             */
-        } while (ETIMEDOUT != pthread_cond_timedwait(&msg_cv, &msg_lock, &ts));
-
-        /*
-         * Clear the message, then release the lock(remember that
-         * pthread_cond_timedwait reacquires the lock before returning).
-         */
-        status_msg[0] = '\0';
-        (void)pthread_mutex_unlock(&msg_lock);
+        /* Keep the frame only if it is still up to date and wanted. */
+        (void)pthread_mutex_lock(&precomp_lock);
+        (void)pthread_mutex_lock(&world_lock);
+        if (gen == room_generation(r) && precomp_wanted(r) &&
+            0 > precomp_find(r, gen)) {
+            slot = precomp_victim();
+            tmp = precomp[slot].frame;
+            precomp[slot].frame = precomp_scratch;
+            precomp[slot].room = r;
+            precomp[slot].gen = gen;
+            precomp_scratch = tmp;
+        }
+        (void)pthread_mutex_unlock(&world_lock);
     }
 
     /* This code never executes--the thread should always be cancelled. */
@@ -770,112 +1624,151 @@ static void* status_thread(void* ignore) {
 }
 
 
+/*
+ * publish_view_state
+ *   DESCRIPTION: Publish a snapshot of the view state(the player's room,
+ *                a copy of its image and its changes, the view position,
+ *                and the status bar) for the display thread, replacing
+ *                any snapshot it has not yet taken.  Nothing is published
+ *                unless the view has changed since the last snapshot.
+ *                Called while holding world_lock.
+ *   INPUTS: force -- 1 to publish even if nothing seems to have changed
+ *                    (e.g., because a status message has expired)
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: swaps the back and middle snapshots; wakes the display
+ *                 thread
+ */
+static void publish_view_state(int32_t force) {
+    view_state_t* s;   /* snapshot being filled      */
+    view_state_t* old; /* snapshot it may replace    */
+    int32_t i;         /* index over changes         */
+    int32_t tmp;       /* for swapping snapshots     */
+    uint32_t gen;      /* generation of room         */
+    uint32_t seq;      /* status message generation  */
+    char status[STATUS_MSG_LEN + 1]; /* status bar text */
 
+    /*
+     * Skip the copy of the room's image unless the room, its contents,
+     * the view position, or the status bar has changed.  Object moves
+     * and photo swaps change the generation, so no damage is left behind.
+     */
+    gen = room_generation(game_info.where);
+    seq = __atomic_load_n(&status_seq, __ATOMIC_ACQUIRE);
+    compose_status_bar(status);
+    if (!force && published_where == game_info.where &&
+        published_entry == view_entry && published_gen == gen &&
+        published_x == game_info.map_x && published_y == game_info.map_y &&
+        published_status_seq == seq &&
+        0 == strcmp(published_status, status))
+        return;
+    published_where = game_info.where;
+    published_entry = view_entry;
+    published_gen = gen;
+    published_x = game_info.map_x;
+    published_y = game_info.map_y;
+    published_status_seq = seq;
+    strcpy(published_status, status);
+
+    s = &view_state[view_back];
+    s->where = game_info.where;
+    s->entry = view_entry;
+    s->entry_time = view_entry_time;
+    s->gen = gen;
+    copy_room_image(game_info.where, &s->image);
+    s->n_damage = take_room_damage(game_info.where, s->damage);
+    s->map_x = game_info.map_x;
+    s->map_y = game_info.map_y;
+    strcpy(s->status, status);
+
+    (void)pthread_mutex_lock(&view_lock);
+    old = &view_state[view_middle];
+    if (view_fresh && old->entry == s->entry && 0 <= s->n_damage) {
+        /* Pass on the changes of the snapshot being replaced. */
+        if (0 > old->n_damage ||
+            MAX_ROOM_DAMAGE < s->n_damage + old->n_damage) {
+            s->n_damage = -1;
+        } else {
+            for (i = 0; old->n_damage > i; i++) {
+                s->damage[s->n_damage++] = old->damage[i];
+            }
+        }
+    }
+    tmp = view_back;
+    view_back = view_middle;
+    view_middle = tmp;
+    view_fresh = 1;
+    (void)pthread_cond_signal(&view_cv);
+    (void)pthread_mutex_unlock(&view_lock);
+}
 
 
+/*
+ * advance_tick
+ *   DESCRIPTION: Add one tick to a time.
+ *   INPUTS: t -- the time
+ *   OUTPUTS: t -- the time one tick later
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void advance_tick(struct timespec* t) {
+    if ((t->tv_nsec += TICK_USEC * 1000L) >= 1000000000L) {
+        t->tv_sec++;
+        t->tv_nsec -= 1000000000L;
+    }
+}
+
 
 /*
- * tux_thread
- *   DESCRIPTION: Function executed by status message helper thread.
- *                Waits for a message to be displayed, then shows the
- *                message for 1.5 seconds before deleting it.  If a
- *                new message has appeared in the meantime, restarts the
- *                clock and tries again.
- *   INPUTS: none(ignored)
+ * usec_since
+ *   DESCRIPTION: Measure the time elapsed since a given time.
+ *   INPUTS: start -- the earlier time
  *   OUTPUTS: none
- *   RETURN VALUE: NULL
- *   SIDE EFFECTS: Changes the status message to an empty string.
- */
-static void* tux_thread(void* ignore){
-	
-	while(1){
-		(void)pthread_mutex_lock(&tux_lock);
-		
-		pthread_cond_wait(&tux_cv, &tux_lock);
-		
-		tux_cmd = get_tux_command();
-		
-		switch(tux_cmd){
-			case CMD_UP:
-				move_photo_down();	//if up button is pressed on tux, photo should move down
-				break;
-			case CMD_RIGHT:
-				move_photo_left();	//if right button is pressed on tux, photo should move left
-				break;
-			case CMD_DOWN:
-				move_photo_up();	//if down button is pressed on tux, photo should move up
-				break;
-			case CMD_LEFT:
-				move_photo_right();	//if left button is pressed on tux, photo should move right
-				break;
-				
-				
-			case CMD_MOVE_LEFT:
-				enter_room = (TC_CHANGE_ROOM == try_to_move_left(&game_info.where));
-				break;
-			case CMD_ENTER:
-				enter_room = (TC_CHANGE_ROOM == try_to_enter(&game_info.where));
-				break;
-			case CMD_MOVE_RIGHT:
-				enter_room = (TC_CHANGE_ROOM == try_to_move_right(&game_info.where));
-				break;
-
-			default: break;
-		}
-		
-		(void)pthread_mutex_unlock(&tux_lock);
-	}
-	return NULL; 
-}
-
-
-
-
-
-/*
- * time_is_after
- *   DESCRIPTION: Check whether one time is at or after a second time.
- *   INPUTS: t1 -- the first time
- *           t2 -- the second time
- *   OUTPUTS: none
- *   RETURN VALUE: 1 if t1 >= t2
- *                 0 if t1 < t2
+ *   RETURN VALUE: microseconds from start to now
  *   SIDE EFFECTS: none
  */
-static int time_is_after(struct timeval* t1, struct timeval* t2) {
-    if (t1->tv_sec == t2->tv_sec)
-        return (t1->tv_usec >= t2->tv_usec);
-    if (t1->tv_sec > t2->tv_sec)
-        return 1;
-    return 0;
+static long usec_since(const struct timeval* start) {
+    struct timeval now; /* current time */
+
+    (void)gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_usec - start->tv_usec);
 }
 
 
 /*
  * show_status(interface function; declared in world.h)
  *   DESCRIPTION: Show a specific status message of up to STATUS_MSG_LEN
- *                characters.
+ *                characters for 1.5 seconds.  Waits only for another
+ *                thread posting a message at the same moment.
  *   INPUTS: s -- the string used for the status message
  *   OUTPUTS: none
  *   RETURN VALUE: none
  *   SIDE EFFECTS: Overwrites any previous message.
  */
 void show_status(const char* s) {
-    /* msg_lock critical section starts here. */
-    (void)pthread_mutex_lock(&msg_lock);
-
-    /* Copy the new message under the protection of msg_lock. */
-    strncpy(status_msg, s, STATUS_MSG_LEN);
-    status_msg[STATUS_MSG_LEN] = '\0';
-
-    /*
-     * Wake up the status message helper thread.  Note that we still hold
-     * the msg_lock, so the thread can't wake up until we release it.
-     */
-    (void)pthread_cond_signal(&msg_cv);
+    uint32_t seq; /* sequence number(even) before writing */
+
+    /* Claim the message by making the sequence number odd. */
+    seq = __atomic_load_n(&status_seq, __ATOMIC_RELAXED);
+    do {
+        seq &= ~1U;
+    } while (!__atomic_compare_exchange_n(&status_seq, &seq, seq + 1, 0,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    /* Copy the new message and its expiry time. */
+    strncpy(status_msg.text, s, STATUS_MSG_LEN);
+    status_msg.text[STATUS_MSG_LEN] = '\0';
+    (void)clock_gettime(CLOCK_MONOTONIC, &status_msg.expires);
+    status_msg.expires.tv_sec += STATUS_MSG_NSEC / 1000000000L;
+    status_msg.expires.tv_nsec += STATUS_MSG_NSEC % 1000000000L;
+    if (1000000000L <= status_msg.expires.tv_nsec) {
+        status_msg.expires.tv_sec++;
+        status_msg.expires.tv_nsec -= 1000000000L;
+    }
 
-    /* msg_lock critical section ends here. */
-    (void)pthread_mutex_unlock(&msg_lock);
+    /* Publish the message. */
+    __atomic_store_n(&status_seq, seq + 2, __ATOMIC_RELEASE);
 }
 
 
@@ -888,6 +1781,7 @@ void show_status(const char* s) {
  */
 int main() {
     game_condition_t game;  /* outcome of playing */
+    int32_t i;              /* index over rooms entered */
 
     /* Randomize for more fun(remove for deterministic layout). */
     srand(time(NULL));
@@ -903,23 +1797,11 @@ int main() {
         PANIC("failed sanity checks");
     }
 
-    /* Create status message thread. */
-    if (0 != pthread_create(&status_thread_id, NULL, status_thread, NULL)) {
-        PANIC("failed to create status thread");
+    /* Create thread to pre-compose the rooms next to the player's. */
+    if (0 != pthread_create(&precomp_thread_id, NULL, precompose_thread, NULL)) {
+        PANIC("failed to create pre-composition thread");
     }
-    push_cleanup(cancel_status_thread, NULL);
-	
-	
-	/* Create tux message thread. */
-	if(0 != pthread_create(&tux_thread_id, NULL, tux_thread, NULL)){
-		PANIC("failed to create tux thread");
-	}
-	push_cleanup(cancel_tux_thread, NULL);
-	
-	
-	
-	
-
+    push_cleanup(cancel_precompose_thread, NULL);
 
     /* Start mode X. */
     if (0 != set_mode_X(fill_horiz_buffer, fill_vert_buffer)) {
@@ -927,24 +1809,70 @@ int main() {
     }
     push_cleanup((cleanup_fn_t)clear_mode_X, NULL);
 
+    /* Create the thread that draws and shows the game. */
+    if (0 != pthread_create(&display_thread_id, NULL, display_thread, NULL)) {
+        PANIC("failed to create display thread");
+    }
+    push_cleanup(stop_display_thread, NULL);
+
     /* Initialize the keyboard and/or Tux controller. */
     if (0 != init_input()) {
         PANIC("cannot initialize input");
     }
     push_cleanup((cleanup_fn_t)shutdown_input, NULL);
 
+    /* Create the event loop's epoll instance and timers. */
+    if (0 != open_event_fds()) {
+        PANIC("cannot create event loop");
+    }
+    push_cleanup(close_event_fds, NULL);
+
     game = game_loop();
 
     pop_cleanup(1);
     pop_cleanup(1);
     pop_cleanup(1);
-	pop_cleanup(1);
+    pop_cleanup(1);
+    pop_cleanup(1);
 
     /* Print a message about the outcome. */
     switch (game) {
         case GAME_WON: printf("You win the game! CONGRATULATIONS!\n"); break;
         case GAME_QUIT: printf("Quitter!\n"); break;
     }
+    report_render_stats();
+    report_command_stats();
+    if (0 < tick_count) {
+        printf("Ticks: %ld run, %ld missed; wake-up average %ld us late, worst %ld us\n",
+               tick_count, tick_missed, tick_late_usec / tick_count, tick_late_max);
+    }
+    if (0 < loop_time) {
+        printf("Event loop processor time: %.2f s of %.1f s(%.1f%%)\n",
+               loop_cpu, loop_time, 100 * loop_cpu / loop_time);
+    }
+    if (0 < entry_total.count) {
+        printf("Room entries: %ld, average %ld us, worst %ld us\n",
+               entry_total.count, entry_total.usec / entry_total.count,
+               entry_total.usec_max);
+        printf("Room entries from pre-composed frames: %ld of %ld\n",
+               precomp_hits, entry_total.count);
+        printf("Room entries shown first as previews: %ld of %ld\n",
+               preview_count, entry_total.count);
+        if (0 < full_draw_count) {
+            printf("Full draws of entered rooms: %ld, recent average %ld us"
+                   "(previews above %d us)\n", full_draw_count,
+                   full_draw_usec, PREVIEW_DRAW_USEC);
+        }
+        for (i = 0; MAX_ENTRY_ROOMS > i && NULL != entry_room[i].room; i++) {
+            printf("  %-24s %ld entries, average %ld us, worst %ld us\n",
+                   room_name(entry_room[i].room), entry_room[i].count,
+                   entry_room[i].usec / entry_room[i].count, entry_room[i].usec_max);
+        }
+    }
+    if (0 < redraw_count) {
+        printf("Redraws after typed commands: %ld, average %ld us, worst %ld us\n",
+               redraw_count, redraw_usec / redraw_count, redraw_usec_max);
+    }
 
     /* Return success. */
     return 0;
@@ -50,8 +50,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/io.h>
+#include <sys/mman.h>
 #include <termio.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "assert.h"
@@ -62,8 +64,21 @@
 
 /* set to 1 and compile this file by itself to test functionality */
 #define TEST_INPUT_DRIVER 0
+/* set to 1 and compile this file by itself to fuzz and time the key decoder */
+#ifndef TEST_KEY_DECODER
+#define TEST_KEY_DECODER 0
+#endif
+/* set to 1 and compile this file by itself(with -pthread) to pass commands
+ * through the command ring from a second thread */
+#ifndef TEST_CMD_RING
+#define TEST_CMD_RING 0
+#endif
 /* set to 1 to use tux controller; otherwise, uses keyboard input */
 #define USE_TUX_CONTROLLER 1
+/* set to 0 to show elapsed time with TUX_SET_LED rather than the Tux clock */
+#ifndef USE_TUX_CLOCK
+#define USE_TUX_CLOCK 1
+#endif
 
 
 #define RIGHT	0x7F
@@ -86,10 +101,89 @@
 #define TWO_BYTE	8
 #define THREE_BYTE	12
 
-/* stores original terminal settings */
+/*
+ * reads of the Tux state page tried(while the driver is changing it)
+ * before get_tux_buttons asks the driver with TUX_BUTTONS instead
+ */
+#define STATE_PAGE_TRIES 64
+
+/* stores original terminal settings(once tio_saved is set) */
 static struct termios tio_orig;
+static int tio_saved;
 static int fd;
-uint8_t curr_button;	//current state of the button
+static int tux_clock_on;      /* the Tux controller counts the time */
+static int tux_shown_seconds = -1; /* elapsed time on the LEDs */
+uint8_t curr_button = 0xFF;	//current state of the button(active low)
+
+/*
+ * The driver's button state page(see TUX_STATE_DEV), mapped read-only so
+ * that get_tux_command can read the buttons without a system call; NULL
+ * if it could not be mapped, in which case TUX_BUTTONS is used.
+ */
+static const volatile struct tux_state* tux_state;
+
+/*
+ * Commands read from the keyboard and the Tux controller wait in a ring
+ * until the game loop runs them.  The game loop now both reads input and
+ * runs commands, so the ring is filled and drained by that one thread,
+ * and it simply decouples reading a batch of input from running it.  The
+ * ring is nonetheless safe for one producer and one consumer in separate
+ * threads(as TEST_CMD_RING checks): the producer alone advances cmd_head
+ * after filling a slot, the consumer alone advances cmd_tail after
+ * emptying one, and each publishes its index with release ordering, so
+ * no lock is needed.  Both indices count without wrapping(the slot is
+ * the index modulo CMD_QUEUE_SIZE).
+ */
+#define CMD_QUEUE_SIZE 64   /* must be a power of two */
+static cmd_event_t cmd_queue[CMD_QUEUE_SIZE];
+static uint32_t cmd_head;   /* next slot to fill      */
+static uint32_t cmd_tail;   /* next slot to empty     */
+
+/* command queue statistics, printed by report_command_stats */
+static unsigned long cmd_count;     /* commands taken              */
+static unsigned long cmd_dropped;   /* commands lost to a full ring */
+static unsigned long cmd_depth;     /* total depth when taken      */
+static uint32_t cmd_depth_max;      /* deepest ring seen           */
+static double cmd_latency;          /* total seconds in the ring   */
+static double cmd_latency_max;      /* longest seconds in the ring */
+
+/*
+ * Directions held down, as bits(1 << cmd) of the direction commands.  The
+ * keyboard sends no releases, so a key counts as held once the terminal
+ * starts repeating it: a second press of a key within KEY_REPEAT_DELAY of
+ * the first, then further presses within KEY_REPEAT_GAP of each other.
+ * The key is released when the repeats stop.  Only the first press of a
+ * key is queued as a command; the repeats just extend the hold.  The Tux
+ * controller driver queues a report of its buttons' state whenever they
+ * change, so its presses and releases are the changes between reports.
+ * A direction button's press is queued as a command too, so like a key
+ * it counts as held only from the tick after the press.  All of these
+ * are used only by the event loop thread.
+ */
+#define KEY_REPEAT_DELAY  600000000L /* longest delay before repeat(ns) */
+#define KEY_REPEAT_GAP    120000000L /* longest gap between repeats(ns) */
+#define DIRECTION_BITS    ((1 << CMD_RIGHT) | (1 << CMD_LEFT) | \
+                           (1 << CMD_UP) | (1 << CMD_DOWN))
+static struct timespec key_hold_until[NUM_COMMANDS]; /* end of repeat window */
+static uint32_t key_held;  /* keyboard directions held       */
+static uint32_t tux_held;  /* Tux controller directions held */
+static uint32_t tux_fresh; /* ...of which pressed this tick   */
+
+/* Tux controller buttons(bits of the button byte, low if pressed) */
+static const struct {
+    uint8_t bit;
+    cmd_t   cmd;
+} tux_button[8] = {
+    {0x80, CMD_RIGHT},      {0x40, CMD_DOWN},  {0x20, CMD_LEFT},
+    {0x10, CMD_UP},         {0x08, CMD_MOVE_RIGHT},
+    {0x04, CMD_ENTER},      {0x02, CMD_MOVE_LEFT}, {0x01, CMD_QUIT}
+};
+
+static void enqueue_command(cmd_t cmd, const struct timespec* time,
+                            const char* typed);
+static void tux_report(uint8_t buttons, const struct timespec* time);
+static void press_key(cmd_t cmd, const struct timespec* now);
+static void map_tux_state();
 
 
 
@@ -111,6 +205,7 @@ int init_input() {
 		int ldisc_num = N_MOUSE;
 		ioctl(fd, TIOCSETD, &ldisc_num);
 		ioctl(fd, TUX_INIT);
+		map_tux_state();
 
 	
     /*
@@ -129,6 +224,7 @@ int init_input() {
         perror("tcgetattr to read stdin terminal settings");
         return -1;
     }
+    tio_saved = 1;
 
     /*
      * Turn off canonical(line-buffered) mode and echoing of keystrokes
@@ -158,12 +254,29 @@ void reset_typed_command() {
     typing[0] = '\0';
 }
 
-static int32_t valid_typing(char c) {
+/*
+ * restore_typed_command
+ *   DESCRIPTION: Put a line entered(and taken from the typed command when
+ *                it was entered) back for editing, as it was not carried
+ *                out.  Nothing is restored if more has been typed since.
+ *   INPUTS: line -- the line entered
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: changes the typed command
+ */
+void restore_typed_command(const char* line) {
+    if ('\0' == typing[0]) {
+        strncpy(typing, line, MAX_TYPED_LEN);
+        typing[MAX_TYPED_LEN] = '\0';
+    }
+}
+
+static int32_t valid_typing(unsigned char c) {
     /* Valid typing include letters, numbers, space, and backspace/delete. */
     return (isalpha(c) || isdigit(c) || ' ' == c || 8 == c || 127 == c);
 }
 
-static void typed_a_char(char c) {
+static void typed_a_char(unsigned char c) {
     int32_t len = strlen(typing);
 
     if (8 == c || 127 == c) {
@@ -178,137 +291,414 @@ static void typed_a_char(char c) {
 }
 
 /*
- * get_command
- *   DESCRIPTION: Reads a command from the input controller.  As some
- *                controllers provide only absolute input(e.g., go
- *                right), the current direction is needed as an input
- *                to this routine.
- *   INPUTS: cur_dir -- current direction of motion
- *   OUTPUTS: none
- *   RETURN VALUE: command issued by the input controller
- *   SIDE EFFECTS: drains any keyboard input
+ * take_typed_line
+ *   DESCRIPTION: Take the line typed so far, when it is entered, so that
+ *                typing can go on before the line is carried out.
+ *   INPUTS: none
+ *   OUTPUTS: line -- the line, unless NULL
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: empties the typed command
  */
-cmd_t get_command() {
+static void take_typed_line(char* line) {
+    if (NULL != line)
+        strcpy(line, typing);
+    typing[0] = '\0';
+}
+
+/*
+ * Keystrokes are decoded by a table-driven parser for the VT100/xterm
+ * escape sequences.  Each byte is first sorted into a class by key_class;
+ * key_trans then gives, for the parser state and the class, the next state
+ * and the action to take.  Control sequences(ESC [ parameters intermediates
+ * final) and single shifts(ESC O final) are always consumed whole, so keys
+ * that we do not use never leak their bytes into the typed command.  The
+ * parser state is kept between calls, as a sequence may be split across
+ * two reads.
+ */
+#define KEY_BUF_SIZE   256  /* bytes read from stdin at a time       */
+#define KEY_MAX_PARAM  1000 /* larger CSI parameters are clamped     */
+
+typedef enum {
+    KS_GROUND, KS_ESC, KS_CSI_PARAM, KS_CSI_INTER, KS_CSI_IGNORE, KS_SS3,
+    NUM_KEY_STATES
+} key_state_t;
+
+typedef enum {
+    KC_CTRL,     /* C0 controls not listed below                 */
+    KC_ERASE,    /* backspace and delete                         */
+    KC_NEWLINE,  /* line feed and carriage return                */
+    KC_ESC,      /* escape                                       */
+    KC_CANCEL,   /* CAN and SUB abort a sequence                 */
+    KC_INTER,    /* space through '/': CSI intermediates         */
+    KC_PARAM,    /* '0' through '?': CSI parameters              */
+    KC_CSI,      /* '[' after ESC                                */
+    KC_SS3,      /* 'O' after ESC                                */
+    KC_QUIT,     /* backquote                                    */
+    KC_FINAL,    /* the rest of '@' through '~'                  */
+    KC_HIGH,     /* bytes with the high bit set                  */
+    NUM_KEY_CLASSES
+} key_class_t;
+
+typedef enum {
+    KA_NONE,     /* ignore the byte                              */
+    KA_TYPE,     /* add the byte to the typed command            */
+    KA_TYPED,    /* finish the typed command                     */
+    KA_QUIT,     /* quit the game                                */
+    KA_START,    /* begin a control sequence                     */
+    KA_PARAM,    /* collect a control sequence parameter byte    */
+    KA_CSI,      /* dispatch a control sequence on its final     */
+    KA_SS3       /* dispatch a single shift on its final         */
+} key_action_t;
+
+static const uint8_t key_class[256] = {
+    [0x00 ... 0x1F] = KC_CTRL,
+    [0x08] = KC_ERASE, [0x7F] = KC_ERASE,
+    [0x0A] = KC_NEWLINE, [0x0D] = KC_NEWLINE,
+    [0x1B] = KC_ESC,
+    [0x18] = KC_CANCEL, [0x1A] = KC_CANCEL,
+    [0x20 ... 0x2F] = KC_INTER,
+    [0x30 ... 0x3F] = KC_PARAM,
+    [0x40 ... 0x7E] = KC_FINAL,
+    ['['] = KC_CSI, ['O'] = KC_SS3, ['`'] = KC_QUIT,
+    [0x80 ... 0xFF] = KC_HIGH
+};
+
+/* next state in the high nibble, action in the low nibble */
+#define KT(state, action) ((uint8_t)(((state) << 4) | (action)))
+
+static const uint8_t key_trans[NUM_KEY_STATES][NUM_KEY_CLASSES] = {
+    [KS_GROUND] = {
+        [KC_CTRL]    = KT(KS_GROUND, KA_NONE),
+        [KC_ERASE]   = KT(KS_GROUND, KA_TYPE),
+        [KC_NEWLINE] = KT(KS_GROUND, KA_TYPED),
+        [KC_ESC]     = KT(KS_ESC, KA_NONE),
+        [KC_CANCEL]  = KT(KS_GROUND, KA_NONE),
+        [KC_INTER]   = KT(KS_GROUND, KA_TYPE),
+        [KC_PARAM]   = KT(KS_GROUND, KA_TYPE),
+        [KC_CSI]     = KT(KS_GROUND, KA_TYPE),
+        [KC_SS3]     = KT(KS_GROUND, KA_TYPE),
+        [KC_QUIT]    = KT(KS_GROUND, KA_QUIT),
+        [KC_FINAL]   = KT(KS_GROUND, KA_TYPE),
+        [KC_HIGH]    = KT(KS_GROUND, KA_NONE)
+    },
+    /* ESC and a printable character(Alt-key) types the character */
+    [KS_ESC] = {
+        [KC_CTRL]    = KT(KS_GROUND, KA_NONE),
+        [KC_ERASE]   = KT(KS_GROUND, KA_TYPE),
+        [KC_NEWLINE] = KT(KS_GROUND, KA_TYPED),
+        [KC_ESC]     = KT(KS_ESC, KA_NONE),
+        [KC_CANCEL]  = KT(KS_GROUND, KA_NONE),
+        [KC_INTER]   = KT(KS_GROUND, KA_TYPE),
+        [KC_PARAM]   = KT(KS_GROUND, KA_TYPE),
+        [KC_CSI]     = KT(KS_CSI_PARAM, KA_START),
+        [KC_SS3]     = KT(KS_SS3, KA_START),
+        [KC_QUIT]    = KT(KS_GROUND, KA_QUIT),
+        [KC_FINAL]   = KT(KS_GROUND, KA_TYPE),
+        [KC_HIGH]    = KT(KS_GROUND, KA_NONE)
+    },
+    /*
+     * A newline abandons a broken sequence rather than being lost.  The
+     * Linux console sends F1 to F5 as ESC [ [ A to ESC [ [ E, so '['
+     * skips to the next final byte.
+     */
+    [KS_CSI_PARAM] = {
+        [KC_CTRL]    = KT(KS_CSI_PARAM, KA_NONE),
+        [KC_ERASE]   = KT(KS_CSI_PARAM, KA_NONE),
+        [KC_NEWLINE] = KT(KS_GROUND, KA_TYPED),
+        [KC_ESC]     = KT(KS_ESC, KA_NONE),
+        [KC_CANCEL]  = KT(KS_GROUND, KA_NONE),
+        [KC_INTER]   = KT(KS_CSI_INTER, KA_NONE),
+        [KC_PARAM]   = KT(KS_CSI_PARAM, KA_PARAM),
+        [KC_CSI]     = KT(KS_CSI_IGNORE, KA_NONE),
+        [KC_SS3]     = KT(KS_GROUND, KA_CSI),
+        [KC_QUIT]    = KT(KS_GROUND, KA_CSI),
+        [KC_FINAL]   = KT(KS_GROUND, KA_CSI),
+        [KC_HIGH]    = KT(KS_CSI_IGNORE, KA_NONE)
+    },
+    [KS_CSI_INTER] = {
+        [KC_CTRL]    = KT(KS_CSI_INTER, KA_NONE),
+        [KC_ERASE]   = KT(KS_CSI_INTER, KA_NONE),
+        [KC_NEWLINE] = KT(KS_GROUND, KA_TYPED),
+        [KC_ESC]     = KT(KS_ESC, KA_NONE),
+        [KC_CANCEL]  = KT(KS_GROUND, KA_NONE),
+        [KC_INTER]   = KT(KS_CSI_INTER, KA_NONE),
+        [KC_PARAM]   = KT(KS_CSI_IGNORE, KA_NONE),
+        [KC_CSI]     = KT(KS_GROUND, KA_CSI),
+        [KC_SS3]     = KT(KS_GROUND, KA_CSI),
+        [KC_QUIT]    = KT(KS_GROUND, KA_CSI),
+        [KC_FINAL]   = KT(KS_GROUND, KA_CSI),
+        [KC_HIGH]    = KT(KS_CSI_IGNORE, KA_NONE)
+    },
+    /* a malformed control sequence is skipped through its final byte */
+    [KS_CSI_IGNORE] = {
+        [KC_CTRL]    = KT(KS_CSI_IGNORE, KA_NONE),
+        [KC_ERASE]   = KT(KS_CSI_IGNORE, KA_NONE),
+        [KC_NEWLINE] = KT(KS_GROUND, KA_TYPED),
+        [KC_ESC]     = KT(KS_ESC, KA_NONE),
+        [KC_CANCEL]  = KT(KS_GROUND, KA_NONE),
+        [KC_INTER]   = KT(KS_CSI_IGNORE, KA_NONE),
+        [KC_PARAM]   = KT(KS_CSI_IGNORE, KA_NONE),
+        [KC_CSI]     = KT(KS_GROUND, KA_NONE),
+        [KC_SS3]     = KT(KS_GROUND, KA_NONE),
+        [KC_QUIT]    = KT(KS_GROUND, KA_NONE),
+        [KC_FINAL]   = KT(KS_GROUND, KA_NONE),
+        [KC_HIGH]    = KT(KS_CSI_IGNORE, KA_NONE)
+    },
+    /* old xterms send modifiers as parameters, e.g., ESC O 5 A */
+    [KS_SS3] = {
+        [KC_CTRL]    = KT(KS_GROUND, KA_NONE),
+        [KC_ERASE]   = KT(KS_GROUND, KA_NONE),
+        [KC_NEWLINE] = KT(KS_GROUND, KA_TYPED),
+        [KC_ESC]     = KT(KS_ESC, KA_NONE),
+        [KC_CANCEL]  = KT(KS_GROUND, KA_NONE),
+        [KC_INTER]   = KT(KS_SS3, KA_NONE),
+        [KC_PARAM]   = KT(KS_SS3, KA_NONE),
+        [KC_CSI]     = KT(KS_GROUND, KA_SS3),
+        [KC_SS3]     = KT(KS_GROUND, KA_SS3),
+        [KC_QUIT]    = KT(KS_GROUND, KA_SS3),
+        [KC_FINAL]   = KT(KS_GROUND, KA_SS3),
+        [KC_HIGH]    = KT(KS_GROUND, KA_NONE)
+    }
+};
 
 #if (USE_TUX_CONTROLLER == 1) /* use keyboard control with arrow keys */
-    static int state = 0;                 /* small FSM for arrow keys */
-#endif
-    static cmd_t command = CMD_NONE;
-    cmd_t pushed = CMD_NONE;
-    int ch;
+/*
+ * Commands for the final byte('@' to '~') of a control sequence or single
+ * shift: the arrow keys, and Home as sent by xterm(ESC [ H or ESC O H).
+ * Keypad Enter in application mode(ESC O M) is handled separately.
+ */
+static const cmd_t key_final_cmd[64] = {
+    ['A' - '@'] = CMD_UP,    ['B' - '@'] = CMD_DOWN,
+    ['C' - '@'] = CMD_RIGHT, ['D' - '@'] = CMD_LEFT,
+    ['H' - '@'] = CMD_ENTER
+};
 
-    /* Read all characters from stdin. */
-    while ((ch = getc(stdin)) != EOF) {
+/*
+ * Commands for the editing keys, sent as ESC [ n ~: Home(1, or 7 from
+ * rxvt), Insert(2), and Page Up(5).
+ */
+static const cmd_t key_tilde_cmd[35] = {
+    [1] = CMD_ENTER, [2] = CMD_MOVE_LEFT, [5] = CMD_MOVE_RIGHT,
+    [7] = CMD_ENTER
+};
+#endif /* USE_TUX_CONTROLLER */
 
-        /* Backquote is used to quit the game. */
-        if (ch == '`')
-            return CMD_QUIT;
+static uint8_t key_state = KS_GROUND; /* parser state between calls      */
+static int32_t key_param;             /* first CSI parameter              */
+static int32_t key_nparam;            /* parameter separators seen so far */
 
+#if (TEST_KEY_DECODER == 1)
+/*
+ * reset_key_decoder
+ *   DESCRIPTION: Return the keystroke parser to its initial state,
+ *                discarding any partial escape sequence.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void reset_key_decoder() {
+    key_state = KS_GROUND;
+    key_param = 0;
+    key_nparam = 0;
+}
+#endif /* TEST_KEY_DECODER */
+
+/*
+ * dispatch_key_sequence
+ *   DESCRIPTION: Find the command for a complete escape sequence.
+ *   INPUTS: action -- KA_CSI for a control sequence, or KA_SS3 for a
+ *                     single shift
+ *           final -- final byte of the sequence
+ *   OUTPUTS: none
+ *   RETURN VALUE: the command, or CMD_NONE for keys that we do not use
+ *   SIDE EFFECTS: none
+ */
+static cmd_t dispatch_key_sequence(int32_t action, unsigned char final) {
+    if (KA_SS3 == action && 'M' == final)
+        return CMD_TYPED;
 #if (USE_TUX_CONTROLLER == 1) /* use keyboard control with arrow keys */
+    if (KA_CSI == action && '~' == final) {
+        if (0 == key_nparam || 1 == key_nparam) {
+            if (key_param < sizeof(key_tilde_cmd) / sizeof(key_tilde_cmd[0]))
+                return key_tilde_cmd[key_param];
+        }
+        return CMD_NONE;
+    }
+    return key_final_cmd[final - '@'];
+#else /* USE_TUX_CONTROLLER */
+    /* Tux controller mode; directions come from the controller. */
+    return CMD_NONE;
+#endif /* USE_TUX_CONTROLLER */
+}
 
-        /*
-         * Arrow keys deliver the byte sequence 27, 91, and 'A' to 'D';
-         * we use a small finite state machine to identify them.
-         *
-         * Insert, home, and page up keys deliver 27, 91, '2'/'1'/'5' and
-         * then a tilde.  We recognize the digits and don't check for the
-         * tilde.
-         */
-        switch (state) {
-            case 0:
-                if (27 == ch) {
-                    state = 1;
-                }
-                else if (valid_typing(ch)) {
+/*
+ * decode_keys
+ *   DESCRIPTION: Decode a block of keystroke bytes, adding typed
+ *                characters to the typed command and producing a command
+ *                for each key that issues one.  Each CMD_TYPED takes the
+ *                line typed so far, and typing goes on into a new line.
+ *                A sequence left incomplete at the end of the block is
+ *                finished by the next call.
+ *   INPUTS: buf -- bytes read from the keyboard
+ *           len -- number of bytes in buf
+ *   OUTPUTS: cmds -- commands issued, in order; must have room for len
+ *            lines -- the line taken by each CMD_TYPED, in order; must
+ *                     have room for len, or be NULL to discard them
+ *   RETURN VALUE: number of commands written to cmds
+ *   SIDE EFFECTS: changes the typed command and the parser state
+ */
+static int32_t decode_keys(const unsigned char* buf, int32_t len, cmd_t* cmds,
+                           char (*lines)[MAX_TYPED_LEN + 1]) {
+    int32_t state = key_state; /* parser state            */
+    int32_t n_cmds = 0;        /* commands written so far */
+    int32_t n_lines = 0;       /* lines written so far    */
+    int32_t i;                 /* index into buf          */
+    uint8_t trans;             /* next state and action   */
+    unsigned char ch;          /* byte being decoded      */
+    cmd_t cmd;                 /* command from a sequence */
+
+    for (i = 0; i < len; i++) {
+        ch = buf[i];
+        trans = key_trans[state][key_class[ch]];
+        state = trans >> 4;
+        switch (trans & 0x0F) {
+            case KA_NONE:
+                break;
+            case KA_TYPE:
+                if (valid_typing(ch))
                     typed_a_char(ch);
-                }
-                else if (10 == ch || 13 == ch) {
-                    pushed = CMD_TYPED;
-                }
                 break;
-            case 1:
-                if (91 == ch) {
-                    state = 2;
-                }
-                else {
-                    state = 0;
-                    if (valid_typing(ch)) {
-                        /*
-                         * Note that we may be discarding an ESC(27), but
-                         * we don't use that as typed input anyway.
-                         */
-                        typed_a_char(ch);
-                    }
-                    else if (10 == ch || 13 == ch) {
-                        pushed = CMD_TYPED;
-                    }
-                }
+            case KA_QUIT:
+                cmds[n_cmds++] = CMD_QUIT;
                 break;
-            case 2:
-                if (ch >= 'A' && ch <= 'D') {
-                    switch (ch) {
-                        case 'A': pushed = CMD_UP;    break;
-                        case 'B': pushed = CMD_DOWN;  break;
-                        case 'C': pushed = CMD_RIGHT; break;
-                        case 'D': pushed = CMD_LEFT;  break;
-                    }
-                    state = 0;
-                }
-                else if (ch == '1' || ch == '2' || ch == '5') {
-                    switch (ch) {
-                        case '2': pushed = CMD_MOVE_LEFT;  break;
-                        case '1': pushed = CMD_ENTER;      break;
-                        case '5': pushed = CMD_MOVE_RIGHT; break;
-                    }
-                    state = 3; /* Consume a '~'. */
-                }
-                else {
-                    state = 0;
-                    if (valid_typing(ch)) {
-                        /*
-                         * Note that we may be discarding an ESC(27) and
-                         * a bracket(91), but we don't use either as
-                         * typed input anyway.
-                         */
-                        typed_a_char(ch);
-                    }
-                    else if (10 == ch || 13 == ch) {
-                        pushed = CMD_TYPED;
-                    }
-                }
+            case KA_START:
+                key_param = 0;
+                key_nparam = 0;
                 break;
-            case 3:
-                state = 0;
-                if ('~' == ch) {
-                    /* Consume it silently. */
-                }
-                else if (valid_typing(ch)) {
-                    typed_a_char(ch);
-                }
-                else if (10 == ch || 13 == ch) {
-                    pushed = CMD_TYPED;
+            case KA_PARAM:
+                if (';' == ch || ':' == ch)
+                    key_nparam++;
+                else if (0 == key_nparam && isdigit(ch) &&
+                         KEY_MAX_PARAM > key_param)
+                    key_param = key_param * 10 + (ch - '0');
+                break;
+            case KA_CSI:
+            case KA_SS3:
+                cmd = dispatch_key_sequence(trans & 0x0F, ch);
+                if (CMD_TYPED != cmd) {
+                    if (CMD_NONE != cmd)
+                        cmds[n_cmds++] = cmd;
+                    break;
                 }
+                /* keypad Enter; fall through */
+            case KA_TYPED:
+                cmds[n_cmds++] = CMD_TYPED;
+                take_typed_line(NULL == lines ? NULL : lines[n_lines++]);
                 break;
         }
-#else /* USE_TUX_CONTROLLER */
-        /* Tux controller mode; still need to support typed commands. */
-        if (valid_typing(ch)) {
-            typed_a_char(ch);
-        }
-        else if (10 == ch || 13 == ch) {
-            pushed = CMD_TYPED;
+    }
+    key_state = state;
+    return n_cmds;
+}
+
+/*
+ * read_keyboard
+ *   DESCRIPTION: Reads all pending keystrokes from the keyboard, queueing
+ *                each command issued(in order) for dequeue_command.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: drains any keyboard input
+ */
+void read_keyboard() {
+    unsigned char buf[KEY_BUF_SIZE]; /* bytes read from stdin   */
+    cmd_t cmds[KEY_BUF_SIZE];        /* commands decoded        */
+    char lines[KEY_BUF_SIZE][MAX_TYPED_LEN + 1]; /* lines entered */
+    struct timespec now;             /* time of the read        */
+    ssize_t len;                     /* bytes in buf            */
+    int32_t n_cmds;                  /* commands in cmds        */
+    int32_t n_lines;                 /* lines enqueued          */
+    int32_t i;                       /* index into cmds         */
+
+    /* A short read means that stdin has been drained. */
+    do {
+        if (0 >= (len = read(fileno(stdin), buf, sizeof(buf))))
+            return;
+        (void)clock_gettime(CLOCK_MONOTONIC, &now);
+        n_cmds = decode_keys(buf, len, cmds, lines);
+        for (n_lines = i = 0; i < n_cmds; i++) {
+            if (DIRECTION_BITS & (1 << cmds[i]))
+                press_key(cmds[i], &now);
+            else if (CMD_TYPED == cmds[i])
+                enqueue_command(CMD_TYPED, &now, lines[n_lines++]);
+            else
+                enqueue_command(cmds[i], &now, NULL);
         }
-#endif /* USE_TUX_CONTROLLER */
+    } while (sizeof(buf) == len);
+}
+
+
+/*
+ * press_key
+ *   DESCRIPTION: Handle a press of a direction key, which is either a new
+ *                press(queued as a command) or a repeat of a held key.
+ *   INPUTS: cmd -- the direction command
+ *           now -- time at which the press was read
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: changes the keyboard directions held
+ */
+static void press_key(cmd_t cmd, const struct timespec* now) {
+    struct timespec* until = &key_hold_until[cmd]; /* end of repeat window */
+    long wait;                                     /* window length(ns)   */
+
+    if (now->tv_sec < until->tv_sec ||
+        (now->tv_sec == until->tv_sec && now->tv_nsec < until->tv_nsec)) {
+        key_held |= (1 << cmd);
+        wait = KEY_REPEAT_GAP;
     }
+    else {
+        key_held &= ~(1 << cmd);
+        enqueue_command(cmd, now, NULL);
+        wait = KEY_REPEAT_DELAY;
+    }
+    until->tv_sec = now->tv_sec;
+    if (1000000000L <= (until->tv_nsec = now->tv_nsec + wait)) {
+        until->tv_sec++;
+        until->tv_nsec -= 1000000000L;
+    }
+}
 
-    /*
-     * Once a direction is pushed, that command remains active
-     * until a turn is taken.
-     */
-    if (pushed == CMD_NONE) {
-        command = CMD_NONE;
+
+/*
+ * get_held_directions
+ *   DESCRIPTION: Get the directions held down on the keyboard or the Tux
+ *                controller.  Keys whose repeats have stopped are released.
+ *                Tux buttons pressed since the last call are left out, as
+ *                their presses were queued as commands.  Called once per
+ *                tick.
+ *   INPUTS: now -- the current time(on CLOCK_MONOTONIC)
+ *   OUTPUTS: none
+ *   RETURN VALUE: bit(1 << cmd) set for each direction command held
+ *   SIDE EFFECTS: changes the keyboard directions held; starts a new tick
+ *                 for the Tux buttons
+ */
+uint32_t get_held_directions(const struct timespec* now) {
+    const struct timespec* until; /* end of a key's repeat window */
+    uint32_t fresh;               /* Tux directions pressed       */
+    int32_t cmd;                  /* direction command            */
+
+    for (cmd = 0; NUM_COMMANDS > cmd; cmd++) {
+        until = &key_hold_until[cmd];
+        if ((key_held & (1 << cmd)) &&
+            (now->tv_sec > until->tv_sec ||
+             (now->tv_sec == until->tv_sec && now->tv_nsec >= until->tv_nsec)))
+            key_held &= ~(1 << cmd);
     }
-    return pushed;
+    fresh = tux_fresh;
+    tux_fresh = 0;
+    return key_held | (tux_held & ~fresh);
 }
 
 
@@ -327,7 +717,7 @@ cmd_t get_tux_command(){
 	
 	
 	cmd_t pushed = CMD_NONE;
-	ioctl(fd, TUX_BUTTONS, &curr_button);
+	curr_button = get_tux_buttons();
 	
 	switch(curr_button){
 		case(RIGHT):	//if right button is pressed
@@ -364,6 +754,242 @@ cmd_t get_tux_command(){
 
 
 
+/*
+ * map_tux_state
+ *   DESCRIPTION: Map the Tux controller driver's button state page, if
+ *                it is not already mapped.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: leaves tux_state NULL on failure
+ */
+static void map_tux_state() {
+    void* page;    /* the mapping */
+    int state_fd;  /* TUX_STATE_DEV */
+
+    if (NULL != tux_state || 0 > (state_fd = open(TUX_STATE_DEV, O_RDONLY)))
+        return;
+    page = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, state_fd, 0);
+    close(state_fd);
+    if (MAP_FAILED != page)
+        tux_state = page;
+}
+
+
+/*
+ * get_tux_buttons(interface function; declared in input.h)
+ *   DESCRIPTION: Read the Tux controller's buttons.  From the state page,
+ *                the fields are copied between two reads of an even(not
+ *                changing) sequence count, and copied again if the count
+ *                has changed meanwhile.  Each retry pauses the processor;
+ *                after STATE_PAGE_TRIES, the driver is asked instead.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: button bitmap(a bit is clear while pressed)
+ *   SIDE EFFECTS: none
+ */
+uint8_t get_tux_buttons() {
+    uint8_t buttons = curr_button; /* kept if the ioctl fails */
+    uint32_t seq;                  /* sequence count of the page */
+    int tries;                     /* reads of the page          */
+
+    for (tries = 0; NULL != tux_state && STATE_PAGE_TRIES > tries; tries++) {
+        seq = __atomic_load_n(&tux_state->seq, __ATOMIC_ACQUIRE);
+        if (0 == (1 & seq)) {
+            buttons = tux_state->buttons;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (seq == __atomic_load_n(&tux_state->seq, __ATOMIC_RELAXED))
+                return buttons;
+        }
+#if defined(__i386__) || defined(__x86_64__)
+        __builtin_ia32_pause();
+#endif
+    }
+    buttons = curr_button;
+    ioctl(fd, TUX_BUTTONS, &buttons);
+    return buttons;
+}
+
+
+/*
+ * read_tux_buttons
+ *   DESCRIPTION: Takes the Tux controller's waiting button reports,
+ *                queueing the command for each button pressed(in order)
+ *                for dequeue_command.  A direction button issues its
+ *                command only when pressed; while it is held,
+ *                get_held_directions reports it instead.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: drains the controller's reports; changes the Tux
+ *                 controller directions held
+ */
+void read_tux_buttons() {
+    struct tux_events evs;   /* reports taken from the driver */
+    struct timespec time;    /* time at which a report arrived */
+    uint32_t i;              /* index over reports            */
+
+    do {
+        if (0 != ioctl(fd, TUX_GET_EVENTS, &evs))
+            return;
+        for (i = 0; evs.count > i; i++) {
+            time.tv_sec = evs.event[i].time / 1000000000ULL;
+            time.tv_nsec = evs.event[i].time % 1000000000ULL;
+            tux_report(evs.event[i].buttons, &time);
+        }
+    } while (TUX_MAX_EVENTS == evs.count);
+}
+
+
+/*
+ * tux_report
+ *   DESCRIPTION: Queue the commands for the buttons newly pressed in a
+ *                report of the Tux controller's buttons, and record the
+ *                directions held.
+ *   INPUTS: buttons -- button bitmap(a bit is clear while pressed)
+ *           time -- time at which the report arrived
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: changes the Tux controller directions held(and those
+ *                 pressed this tick)
+ */
+static void tux_report(uint8_t buttons, const struct timespec* time) {
+    uint8_t pressed; /* buttons newly pressed     */
+    uint32_t held;   /* directions held down      */
+    int32_t i;       /* index over buttons        */
+
+    pressed = curr_button & ~buttons;
+    curr_button = buttons;
+    for (held = 0, i = 0; 8 > i; i++) {
+        if (pressed & tux_button[i].bit) {
+            enqueue_command(tux_button[i].cmd, time, NULL);
+            tux_fresh |= (1 << tux_button[i].cmd);
+        }
+        if (!(buttons & tux_button[i].bit))
+            held |= (1 << tux_button[i].cmd);
+    }
+    tux_held = held & DIRECTION_BITS;
+    tux_fresh &= tux_held;
+}
+
+
+/*
+ * enqueue_command
+ *   DESCRIPTION: Add a command, stamped with the time at which it was
+ *                read, to the command ring.  Called only by the code
+ *                reading input(the producer).  The command is dropped(and
+ *                counted) if the ring is full.
+ *   INPUTS: cmd -- the command
+ *           time -- time at which the command was read(CLOCK_MONOTONIC)
+ *           typed -- line entered, for CMD_TYPED; NULL otherwise
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void enqueue_command(cmd_t cmd, const struct timespec* time,
+                            const char* typed) {
+    cmd_event_t* ev; /* slot being filled */
+    uint32_t head;   /* index of the slot */
+
+    head = __atomic_load_n(&cmd_head, __ATOMIC_RELAXED);
+    if (CMD_QUEUE_SIZE == head - __atomic_load_n(&cmd_tail, __ATOMIC_ACQUIRE)) {
+        cmd_dropped++;
+        return;
+    }
+    ev = &cmd_queue[head & (CMD_QUEUE_SIZE - 1)];
+    ev->cmd = cmd;
+    ev->time = *time;
+    if (NULL != typed)
+        strcpy(ev->typed, typed);
+    else
+        ev->typed[0] = '\0';
+    __atomic_store_n(&cmd_head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * dequeue_command
+ *   DESCRIPTION: Take the oldest command from the command ring.  Called
+ *                only by the game loop(the consumer).
+ *   INPUTS: none
+ *   OUTPUTS: ev -- the command and the time at which it was read
+ *   RETURN VALUE: 1 if a command was taken, 0 if the ring was empty
+ *   SIDE EFFECTS: updates the command queue statistics
+ */
+int32_t dequeue_command(cmd_event_t* ev) {
+    struct timespec now; /* current time                  */
+    uint32_t tail;       /* index of the slot             */
+    uint32_t depth;      /* commands waiting, including ev */
+    double latency;      /* seconds spent in the ring     */
+
+    tail = __atomic_load_n(&cmd_tail, __ATOMIC_RELAXED);
+    depth = __atomic_load_n(&cmd_head, __ATOMIC_ACQUIRE) - tail;
+    if (0 == depth)
+        return 0;
+    *ev = cmd_queue[tail & (CMD_QUEUE_SIZE - 1)];
+    __atomic_store_n(&cmd_tail, tail + 1, __ATOMIC_RELEASE);
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    latency = (now.tv_sec - ev->time.tv_sec) + (now.tv_nsec - ev->time.tv_nsec) / 1e9;
+    cmd_count++;
+    cmd_depth += depth;
+    if (cmd_depth_max < depth)
+        cmd_depth_max = depth;
+    cmd_latency += latency;
+    if (cmd_latency_max < latency)
+        cmd_latency_max = latency;
+    return 1;
+}
+
+
+/*
+ * report_command_stats
+ *   DESCRIPTION: Print the depth of the command ring and the time that
+ *                commands waited in it.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: prints to stdout
+ */
+void report_command_stats() {
+    if (0 == cmd_count)
+        return;
+    printf("Commands: %lu(%lu dropped); queue depth average %.2f, worst %u; "
+           "latency average %.0f us, worst %.0f us\n",
+           cmd_count, cmd_dropped, (double)cmd_depth / cmd_count, cmd_depth_max,
+           1e6 * cmd_latency / cmd_count, 1e6 * cmd_latency_max);
+}
+
+
+/*
+ * get_keyboard_fd
+ *   DESCRIPTION: Get the file descriptor from which keystrokes are read,
+ *                so that the caller can wait for them.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: the file descriptor
+ *   SIDE EFFECTS: none
+ */
+int get_keyboard_fd() {
+    return fileno(stdin);
+}
+
+
+/*
+ * get_tux_fd
+ *   DESCRIPTION: Get the file descriptor of the Tux controller, so that
+ *                the caller can wait for input from it.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: the file descriptor, or -1 if the controller could
+ *                 not be opened
+ *   SIDE EFFECTS: none
+ */
+int get_tux_fd() {
+    return fd;
+}
+
+
 /*
  * shutdown_input
  *   DESCRIPTION: Cleans up state associated with input control.  Restores
@@ -374,14 +1000,43 @@ cmd_t get_tux_command(){
  *   SIDE EFFECTS: restores original terminal settings
  */
 void shutdown_input() {
-    (void)tcsetattr(fileno(stdin), TCSANOW, &tio_orig);
+    if (tio_saved)
+        (void)tcsetattr(fileno(stdin), TCSANOW, &tio_orig);
+    if (NULL != tux_state) {
+        (void)munmap((void*)tux_state, getpagesize());
+        tux_state = NULL;
+    }
+}
+
+
+/*
+ * start_clock_on_tux
+ *   DESCRIPTION: Have the Tux controller count the elapsed time on its own
+ *                clock, starting from num_seconds, and show it on the
+ *                7-segment displays.  display_time_on_tux then does
+ *                nothing, so that no LED updates cross the serial line.
+ *   INPUTS: num_seconds -- total seconds elapsed so far
+ *   OUTPUTS: none
+ *   RETURN VALUE: 0 if the controller's clock was started, -1 if not
+ *                 (display_time_on_tux must then show the time)
+ *   SIDE EFFECTS: changes state of controller's display
+ */
+int start_clock_on_tux(int num_seconds) {
+#if (USE_TUX_CLOCK == 1)
+    if (0 == ioctl(fd, TUX_SET_CLOCK, (unsigned long)num_seconds)) {
+        tux_clock_on = 1;
+        return 0;
+    }
+#endif
+    return -1;
 }
 
 
 /*
  * display_time_on_tux
  *   DESCRIPTION: Show number of elapsed seconds as minutes:seconds
- *                on the Tux controller's 7-segment displays.
+ *                on the Tux controller's 7-segment displays, unless
+ *                the controller's clock shows it or it is already shown.
  *   INPUTS: num_seconds -- total seconds elapsed so far
  *   OUTPUTS: none
  *   RETURN VALUE: none
@@ -397,6 +1052,9 @@ void display_time_on_tux(int num_seconds) {
 	int second_temp, second_temp1, second_temp2;
 	int second;
 	uint32_t time_displayed;
+	if(tux_clock_on || num_seconds == tux_shown_seconds){	//nothing to send
+		return;
+	}
 	minute_temp = num_seconds / ONE_MINUTE;
 	second_temp = num_seconds - (minute_temp*ONE_MINUTE);
 	if(minute_temp<TEN_SECONDS){
@@ -416,7 +1074,9 @@ void display_time_on_tux(int num_seconds) {
 		second = (((second_temp1 << ONE_BYTE) & BIT_MASK_SEC1) | ((second_temp2) & BIT_MASK_SEC));
 	}
 	time_displayed = ((minute | second) & TIME_MASK1) | TIME_MASK2;
-	ioctl(fd, TUX_SET_LED, time_displayed);
+	if(0 == ioctl(fd, TUX_SET_LED, time_displayed)){	//retry next tick on failure
+		tux_shown_seconds = num_seconds;
+	}
 	return;
 
 }
@@ -439,6 +1099,7 @@ void tuxcontro_int()
 		int ldisc_num = N_MOUSE;
 		ioctl(fd, TIOCSETD, &ldisc_num);
 		ioctl(fd, TUX_INIT);
+		map_tux_state();
 }
 
 
@@ -473,3 +1134,232 @@ int main() {
 }
 
 #endif
+
+
+#if (TEST_KEY_DECODER == 1)
+/*
+ * recorded keystrokes, with the typed command(or, for CMD_TYPED, the line
+ * entered, after which nothing is typed) and command that they give
+ */
+static const struct {
+    const char* keys;
+    const char* typed;
+    cmd_t cmd;
+} key_sample[] = {
+    {"\033[A", "", CMD_UP},          {"\033[B", "", CMD_DOWN},
+    {"\033[C", "", CMD_RIGHT},       {"\033[D", "", CMD_LEFT},
+    {"\033OA", "", CMD_UP},          {"\033OD", "", CMD_LEFT},
+    {"\033[1;5C", "", CMD_RIGHT},    {"\033O5B", "", CMD_DOWN},
+    {"\033[1~", "", CMD_ENTER},      {"\033[7~", "", CMD_ENTER},
+    {"\033[H", "", CMD_ENTER},       {"\033OH", "", CMD_ENTER},
+    {"\033[2~", "", CMD_MOVE_LEFT},  {"\033[5~", "", CMD_MOVE_RIGHT},
+    {"\033[5;2~", "", CMD_MOVE_RIGHT},
+    {"\033[3~", "", CMD_NONE},       {"\033[6~", "", CMD_NONE},
+    {"\033[F", "", CMD_NONE},        {"\033[15~", "", CMD_NONE},
+    {"\033[24;3~", "", CMD_NONE},    {"\033OP", "", CMD_NONE},
+    {"\033[[A", "", CMD_NONE},       {"\033[?1;2c", "", CMD_NONE},
+    {"\033[200~go 2\033[201~", "go 2", CMD_NONE},
+    {"look\r", "look", CMD_TYPED},   {"get\n", "get", CMD_TYPED},
+    {"\033OM", "", CMD_TYPED},       {"\033x", "x", CMD_NONE},
+    {"ab\bc", "ac", CMD_NONE},       {"a\033[3;5~b", "ab", CMD_NONE},
+    {"\033[1\030x", "x", CMD_NONE},  {"\033[A\033", "", CMD_UP},
+    {"`", "", CMD_QUIT}
+};
+#define NUM_KEY_SAMPLES ((int32_t)(sizeof(key_sample) / sizeof(key_sample[0])))
+
+#define STREAM_SIZE (4 * 1024 * 1024)
+
+/*
+ * decode a stream from the initial state, in blocks of random sizes up to
+ * max_block(or in one block if max_block is 0); returns the command count
+ */
+static int32_t decode_stream(const unsigned char* buf, int32_t len,
+                             cmd_t* cmds, int32_t max_block) {
+    int32_t n_cmds = 0, done, block;
+
+    reset_key_decoder();
+    reset_typed_command();
+    for (done = 0; done < len; done += block) {
+        block = (0 == max_block ? len : 1 + rand() % max_block);
+        if (block > len - done)
+            block = len - done;
+        n_cmds += decode_keys(buf + done, block, cmds + n_cmds, NULL);
+    }
+    return n_cmds;
+}
+
+/* decode a stream in reads of KEY_BUF_SIZE; returns megabytes per second */
+static double time_stream(const unsigned char* buf, int32_t len, cmd_t* cmds) {
+    struct timespec t0, t1;
+    int32_t done;
+
+    reset_key_decoder();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (done = 0; done < len; done += KEY_BUF_SIZE)
+        (void)decode_keys(buf + done, len - done < KEY_BUF_SIZE ?
+                          len - done : KEY_BUF_SIZE, cmds, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return len / ((t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3);
+}
+
+/* check that a stream decodes the same whether or not it is split */
+static int32_t check_splits(const unsigned char* buf, int32_t len,
+                            cmd_t* whole, cmd_t* split, const char* name) {
+    char typed[MAX_TYPED_LEN + 1];
+    int32_t n_whole, n_split, i;
+
+    n_whole = decode_stream(buf, len, whole, 0);
+    strcpy(typed, get_typed_command());
+    for (i = 0; i < n_whole; i++) {
+        if (CMD_NONE == whole[i] || NUM_COMMANDS <= whole[i]) {
+            printf("%s: bad command %d\n", name, whole[i]);
+            return 1;
+        }
+    }
+    n_split = decode_stream(buf, len, split, 2 * KEY_BUF_SIZE);
+    if (n_split != n_whole || 0 != memcmp(whole, split, n_whole * sizeof(cmd_t)) ||
+        0 != strcmp(typed, get_typed_command())) {
+        printf("%s: split decode differs\n", name);
+        return 1;
+    }
+    return 0;
+}
+
+int main() {
+    static unsigned char recorded[STREAM_SIZE + 64];
+    static unsigned char random_keys[STREAM_SIZE];
+    static cmd_t expected[STREAM_SIZE], whole[STREAM_SIZE], split[STREAM_SIZE];
+    static const char fuzz_bytes[] = "\033\033\033[[O0123456789;?~ABCDHM`\r\b\030";
+    char lines[2][MAX_TYPED_LEN + 1];
+    const char* typed;
+    int32_t len, n_expected, n_cmds, i, j, k;
+
+    /* Each sample alone, and split into two reads at every point. */
+    for (i = 0; i < NUM_KEY_SAMPLES; i++) {
+        len = strlen(key_sample[i].keys);
+        for (j = 0; j <= len; j++) {
+            reset_key_decoder();
+            reset_typed_command();
+            lines[0][0] = '\0';
+            n_cmds = decode_keys((const unsigned char*)key_sample[i].keys, j,
+                                 whole, lines);
+            n_cmds += decode_keys((const unsigned char*)key_sample[i].keys + j,
+                                  len - j, whole + n_cmds, lines + n_cmds);
+            typed = (CMD_TYPED == key_sample[i].cmd ? lines[0] :
+                     get_typed_command());
+            if (n_cmds != (CMD_NONE != key_sample[i].cmd) ||
+                (0 < n_cmds && whole[0] != key_sample[i].cmd) ||
+                0 != strcmp(key_sample[i].typed, typed) ||
+                (CMD_TYPED == key_sample[i].cmd && '\0' != get_typed_command()[0])) {
+                printf("sample %d split at %d: %d commands, typed \"%s\"\n",
+                       i, j, n_cmds, typed);
+                return 1;
+            }
+        }
+    }
+
+    /* A line entered is taken before typing goes on. */
+    reset_key_decoder();
+    reset_typed_command();
+    n_cmds = decode_keys((const unsigned char*)"look\nget", 8, whole, lines);
+    if (1 != n_cmds || CMD_TYPED != whole[0] || 0 != strcmp("look", lines[0]) ||
+        0 != strcmp("get", get_typed_command())) {
+        printf("typing after a line entered: %d commands, typed \"%s\"\n",
+               n_cmds, get_typed_command());
+        return 1;
+    }
+
+    /* A long session of recorded keys, with the commands that it gives. */
+    srand(1);
+    for (len = n_expected = 0; STREAM_SIZE > len; ) {
+        i = rand() % (NUM_KEY_SAMPLES - 1); /* leave out quit */
+        if (0 == key_sample[i].typed[0]) {
+            strcpy((char*)recorded + len, key_sample[i].keys);
+            len += strlen(key_sample[i].keys);
+            if (CMD_NONE != key_sample[i].cmd)
+                expected[n_expected++] = key_sample[i].cmd;
+        }
+    }
+    if (0 != check_splits(recorded, len, whole, split, "recorded"))
+        return 1;
+    n_cmds = decode_stream(recorded, len, whole, 0);
+    if (n_cmds != n_expected || 0 != memcmp(whole, expected, n_cmds * sizeof(cmd_t))) {
+        printf("recorded: wrong commands\n");
+        return 1;
+    }
+
+    /* Random bytes, and random bytes weighted toward escape sequences. */
+    for (k = 0; 2 > k; k++) {
+        for (j = 0; STREAM_SIZE > j; j++) {
+            if (0 == k || 0 == rand() % 2)
+                random_keys[j] = rand();
+            else
+                random_keys[j] = fuzz_bytes[rand() % (sizeof(fuzz_bytes) - 1)];
+        }
+        if (0 != check_splits(random_keys, STREAM_SIZE, whole, split,
+                              0 == k ? "random" : "weighted"))
+            return 1;
+    }
+
+    printf("decoded %d MB of recorded and random keys; MB/s:\n", 3 * STREAM_SIZE >> 20);
+    printf("  recorded: %7.1f\n", time_stream(recorded, len, whole));
+    printf("  random:   %7.1f\n", time_stream(random_keys, STREAM_SIZE, whole));
+    return 0;
+}
+#endif
+
+
+#if (TEST_CMD_RING == 1)
+#include <pthread.h>
+#include <sched.h>
+
+#define RING_COMMANDS 1000000
+
+/* enqueue numbered commands, waiting(rather than dropping) when full */
+static void* ring_producer(void* arg) {
+    struct timespec now;
+    char typed[MAX_TYPED_LEN + 1];
+    int32_t i;
+
+    for (i = 0; RING_COMMANDS > i; i++) {
+        while (CMD_QUEUE_SIZE == __atomic_load_n(&cmd_head, __ATOMIC_RELAXED) -
+                                 __atomic_load_n(&cmd_tail, __ATOMIC_ACQUIRE))
+            sched_yield();
+        (void)clock_gettime(CLOCK_MONOTONIC, &now);
+        sprintf(typed, "%d", i);
+        enqueue_command(1 + i % (NUM_COMMANDS - 1), &now, typed);
+    }
+    return NULL;
+}
+
+int main() {
+    pthread_t producer;
+    cmd_event_t ev;
+    int32_t i;
+
+    if (0 != pthread_create(&producer, NULL, ring_producer, NULL)) {
+        perror("pthread_create");
+        return 3;
+    }
+    for (i = 0; RING_COMMANDS > i; ) {
+        if (!dequeue_command(&ev)) {
+            sched_yield();
+            continue;
+        }
+        if (ev.cmd != 1 + i % (NUM_COMMANDS - 1) || atoi(ev.typed) != i) {
+            printf("command %d came out as %d(\"%s\")\n", i, ev.cmd, ev.typed);
+            return 1;
+        }
+        i++;
+    }
+    pthread_join(producer, NULL);
+    if (dequeue_command(&ev) || 0 != cmd_dropped) {
+        printf("ring not empty, or %lu dropped\n", cmd_dropped);
+        return 1;
+    }
+    printf("%d commands passed between two threads in order\n", RING_COMMANDS);
+    report_command_stats();
+    return 0;
+}
+#endif
+
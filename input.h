@@ -38,6 +38,9 @@
 #ifndef INPUT_H
 #define INPUT_H
 
+#include <stdint.h>
+#include <time.h>
+
 /* possible commands from input device, whether keyboard or game controller */
 typedef enum {
     CMD_NONE, CMD_RIGHT, CMD_LEFT, CMD_UP, CMD_DOWN,
@@ -49,11 +52,37 @@ typedef enum {
 
 #define MAX_TYPED_LEN 20
 
+/*
+ * a command and the time(on CLOCK_MONOTONIC) at which it was read; a
+ * CMD_TYPED carries the line entered, as typing goes on into a new line
+ */
+typedef struct cmd_event_t cmd_event_t;
+struct cmd_event_t {
+    cmd_t           cmd;
+    struct timespec time;
+    char            typed[MAX_TYPED_LEN + 1];
+};
+
 /* Initialize the input device. */
 extern int init_input();
 
-/* Read a command from the input device. */
-extern cmd_t get_command();
+/* Read keystrokes, queueing each command issued. */
+extern void read_keyboard();
+
+/* Read the Tux controller's buttons, queueing the command issued. */
+extern void read_tux_buttons();
+
+/* Get the Tux controller's buttons(a bit is clear while pressed). */
+extern uint8_t get_tux_buttons();
+
+/* Get the directions held down, as bits(1 << cmd) of their commands. */
+extern uint32_t get_held_directions(const struct timespec* now);
+
+/* Take the oldest queued command; returns 0 if there is none. */
+extern int32_t dequeue_command(cmd_event_t* ev);
+
+/* Print command queue depth and latency statistics. */
+extern void report_command_stats();
 
 /* Get currently typed command string. */
 extern const char* get_typed_command();
@@ -61,6 +90,9 @@ extern const char* get_typed_command();
 /* Reset typed command. */
 extern void reset_typed_command();
 
+/* Give a line entered back for editing, unless more has been typed. */
+extern void restore_typed_command(const char* line);
+
 /* Shut down the input device. */
 extern void shutdown_input();
 
@@ -71,11 +103,21 @@ extern void shutdown_input();
  */
 extern void display_time_on_tux(int num_seconds);
 
+/*
+ * Have the Tux controller count and show the elapsed time itself; returns
+ * 0 on success, after which display_time_on_tux has no effect.
+ */
+extern int start_clock_on_tux(int num_seconds);
+
 /*Get currently typed command string. */
 extern cmd_t get_tux_command();
 
 /* Initialize the input device. */
 extern void tuxcontro_int();
 
+/* Get the file descriptors to wait on for keystrokes and Tux input. */
+extern int get_keyboard_fd();
+extern int get_tux_fd();
+
 
 #endif /* INPUT_H */
@@ -41,38 +41,151 @@
  */
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/io.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "modex.h"
 #include "text.h"
 int STATUS_BAR_HEIGHT = 18;
 
 /*
- * Calculate the image build buffer parameters. SCROLL_SIZE is the space
- * needed for one plane of an image. SCREEN_SIZE is the space needed for
- * all four planes. The extra +1 supports logical view x coordinates that
- * are not multiples of four. In these cases, some plane addresses are
- * shifted by 1 byte forward. The planes are stored in the build buffer
- * in reverse order to allow those planes that shift forward to do so
- * without running into planes that aren't shifted. For example, when
- * the leftmost x pixel in the logical view is 3 mod 4, planes 2, 1, and 0
- * are shifted forward, while plane 3 is not, so there is one unused byte
- * between the image of plane 3 and that of plane 2. BUILD_BUF_SIZE is
- * the size of the space allocated for building images. We add 20000 bytes
- * to reduce the number of memory copies required during scrolling.
- * Strictly speaking(try it), no extra space is necessary, but the minimum
- * means an extra 64kB memory copy with every scroll pixel. Finally,
- * BUILD_BASE_INIT places initial(or transferred) logical view in the
- * middle of the available buffer area.
- */
-#define SCROLL_SIZE        (SCROLL_X_WIDTH * SCROLL_Y_DIM)
-#define SCREEN_SIZE        (SCROLL_SIZE * 4 + 1)
-#define BUILD_BUF_SIZE     (SCREEN_SIZE + 20000)
-#define BUILD_BASE_INIT    ((BUILD_BUF_SIZE - SCREEN_SIZE) / 2)
+ * Calculate the image build buffer parameters. The build buffer holds
+ * each of the four planes as a separate ring that wraps in both axes:
+ * the logical pixel (x,y) lives in plane (x & 3), at column (x >> 2)
+ * modulo BUILD_X_WIDTH and row y modulo BUILD_Y_DIM. Moving the logical
+ * view therefore never moves pixels already in the buffer; only lines
+ * newly exposed by the move must be drawn. A ring needs at least
+ * SCROLL_X_WIDTH + 1 columns (the view spans one extra address when its
+ * x coordinate is not a multiple of four) and SCROLL_Y_DIM rows; both
+ * dimensions are rounded up to powers of two so that wrapping is a mask,
+ * and the extra space is left for drawing beyond the edges of the view.
+ */
+#define BUILD_X_WIDTH      128
+#define BUILD_Y_DIM        256
+#define BUILD_X_MASK       (BUILD_X_WIDTH - 1)
+#define BUILD_Y_MASK       (BUILD_Y_DIM - 1)
+#define BUILD_PLANE_SIZE   (BUILD_X_WIDTH * BUILD_Y_DIM)
+#define BUILD_BUF_SIZE     (BUILD_PLANE_SIZE * 4)
+
+/*
+ * address of the byte holding plane p, column col, and row row of the
+ * build buffer rings(col and row are wrapped here)
+ */
+#define BUILD_ADDR(p, col, row)                                         \
+    (build + MEM_FENCE_WIDTH + (p) * BUILD_PLANE_SIZE +                 \
+     ((row) & BUILD_Y_MASK) * BUILD_X_WIDTH + ((col) & BUILD_X_MASK))
+
+/*
+ * Number of moves at the most recent speed that the pre-rendered margin
+ * tries to cover ahead of the view(see margin_target).
+ */
+#define PRERENDER_LOOKAHEAD 16
+
+/*
+ * Maximum number of threads(including the caller) that draw bands of
+ * the view in redraw_view; fewer are used if fewer processors are
+ * online. Override with -DNUM_RENDER_THREADS=n; 1 disables the pool.
+ */
+#ifndef NUM_RENDER_THREADS
+#define NUM_RENDER_THREADS 4
+#endif
+
+/*
+ * set to 1 and compile this file by itself(with text.o and -pthread) to
+ * time redraw_view with 1, 2, 4 and 8 threads(up to NUM_RENDER_THREADS),
+ * however many processors are online, and to stop the pool while another
+ * thread redraws
+ */
+#ifndef TEST_RENDER_POOL
+#define TEST_RENDER_POOL 0
+#endif
+
+/*
+ * Display pages follow the status bar(which the split screen always shows
+ * from video memory address 0) at intervals of 0x4000. With two pages, a
+ * frame is copied to the page that was on display before the latest flip,
+ * so show_screen must wait for that flip to take effect at a vertical
+ * retrace. With three(-DNUM_DISPLAY_PAGES=3), the frame goes to the page
+ * hidden longest, and show_screen waits only when frames come faster than
+ * the display refreshes(REFRESH_NSEC, at 70 Hz).
+ */
+#ifndef NUM_DISPLAY_PAGES
+#define NUM_DISPLAY_PAGES  2
+#endif
+#define REFRESH_NSEC       14285714
+
+/*
+ * With -DPANNED_SCROLLING=1, each display page is instead a canvas of
+ * VRAM_PITCH bytes(512 pixels) by CANVAS_Y_DIM rows in each plane, and
+ * the CRTC offset register is set to match. The view is shown from
+ * anywhere within a canvas by setting the start address(to the nearest
+ * four pixels) and the horizontal PEL panning register(for the rest),
+ * so a pan copies only the lines newly exposed. The status bar at
+ * address 0 then also has VRAM_PITCH bytes per row; the split screen is
+ * kept from panning by bit 5 of the attribute mode control register.
+ * When the view leaves its canvas, the view is copied in full to the
+ * other canvas, centered. Video plane p then holds the logical pixels
+ * in build buffer plane p, as the view's offset is left to the CRTC.
+ */
+#ifndef PANNED_SCROLLING
+#define PANNED_SCROLLING   0
+#endif
+
+/*
+ * set to 1(with PANNED_SCROLLING) and compile this file by itself(with
+ * text.o and -pthread) to check panned scrolling against an emulated VGA:
+ * video memory and the registers used to show a frame are emulated, and
+ * the screen seen through the CRTC start address and PEL panning register
+ * is compared with the logical view after each of many random moves
+ */
+#ifndef TEST_PANNED_SCROLLING
+#define TEST_PANNED_SCROLLING 0
+#endif
+#if (TEST_PANNED_SCROLLING == 1 && PANNED_SCROLLING != 1)
+#error "TEST_PANNED_SCROLLING needs PANNED_SCROLLING"
+#endif
+
+/*
+ * set to 1 and compile this file by itself(with text.o and -pthread) to
+ * check deinterleave_line, both with SSE2(if available) and without, and
+ * store_horiz_pixels against storing each pixel of a line in turn, for
+ * every phase of x within a group of four pixels
+ */
+#ifndef TEST_DEINTERLEAVE
+#define TEST_DEINTERLEAVE 0
+#endif
+#if (TEST_PANNED_SCROLLING + TEST_RENDER_POOL + TEST_DEINTERLEAVE > 1)
+#error "build one test at a time"
+#endif
+/* the tests run against an emulated VGA(see the end of this file) */
+#define EMULATED_VGA (TEST_PANNED_SCROLLING == 1 || TEST_RENDER_POOL == 1 || \
+                      TEST_DEINTERLEAVE == 1)
+#define STATUS_Y_DIM       (1440 / SCROLL_X_WIDTH)
+#if (PANNED_SCROLLING == 1)
+#if (NUM_DISPLAY_PAGES != 2)
+#error "panned scrolling uses exactly two canvases"
+#endif
+#define VRAM_PITCH         128
+#define CANVAS_Y_DIM       240
+#define PAGE_ADDR(page)    (STATUS_Y_DIM * VRAM_PITCH + (page) * CANVAS_Y_DIM * VRAM_PITCH)
+#define MODE_X_ATTR_MODE   0x61
+#else
+#define VRAM_PITCH         SCROLL_X_WIDTH
+#define PAGE_ADDR(page)    (0x05A0 + ((page) << 14))
+#define MODE_X_ATTR_MODE   0x41
+#endif
+
+/* Each screen row of each video plane gets one bit in a dirty row map. */
+#define DIRTY_WORDS        ((SCROLL_Y_DIM + 31) / 32)
 
 /* Mode X and general VGA parameters */
 #define VID_MEM_SIZE        131072
@@ -89,7 +202,7 @@ static unsigned short mode_X_seq[NUM_SEQUENCER_REGS] = {
 static unsigned short mode_X_CRTC[NUM_CRTC_REGS] = {
     0x5F00, 0x4F01, 0x5002, 0x8203, 0x5404, 0x8005, 0xBF06, 0x1F07,
     0x0008, 0x0109, 0x000A, 0x000B, 0x000C, 0x000D, 0x000E, 0x000F,
-    0x9C10, 0x8E11, 0x8F12, 0x2813, 0x0014, 0x9615, 0xB916, 0xE317,
+    0x9C10, 0x8E11, 0x8F12, ((VRAM_PITCH / 2) << 8) | 0x13, 0x0014, 0x9615, 0xB916, 0xE317,
     0x6C18
 };
 static unsigned char mode_X_attr[NUM_ATTR_REGS * 2] = {
@@ -97,7 +210,7 @@ static unsigned char mode_X_attr[NUM_ATTR_REGS * 2] = {
     0x04, 0x04, 0x05, 0x05, 0x06, 0x06, 0x07, 0x07,
     0x08, 0x08, 0x09, 0x09, 0x0A, 0x0A, 0x0B, 0x0B,
     0x0C, 0x0C, 0x0D, 0x0D, 0x0E, 0x0E, 0x0F, 0x0F,
-    0x10, 0x41, 0x11, 0x00, 0x12, 0x0F, 0x13, 0x00,
+    0x10, MODE_X_ATTR_MODE, 0x11, 0x00, 0x12, 0x0F, 0x13, 0x00,
     0x14, 0x00, 0x15, 0x00
 };
 static unsigned short mode_X_graphics[NUM_GRAPHICS_REGS] = {
@@ -140,8 +253,53 @@ static void fill_palette_mode_x();
 static void fill_palette_text();
 static void write_font_data();
 static void set_text_mode_3(int clear_scr);
-static void copy_image(unsigned char* img, unsigned short scr_addr);
+#if (PANNED_SCROLLING == 0)
+static int copy_image(int plane, int col, int row, unsigned short scr_addr,
+                      const unsigned int dirty[DIRTY_WORDS]);
+#endif
+static int page_is_current(int page);
+static int choose_target_page(const struct timespec* now);
+static void wait_for_retrace();
+static void write_status_bar();
+#if (PANNED_SCROLLING == 1)
+static void pan_to_view(const struct timespec* now);
+static int copy_to_canvas(int page, int p);
+static int copy_canvas_run(int page, int p, int c0, int c1, int y);
+#endif
+#if (PANNED_SCROLLING == 0)
 static void copy_status_bar(unsigned char* img, unsigned short scr_addr);
+#endif
+static int rect_is_valid(int x, int y, int w, int h);
+static void collapse_valid_rect();
+#ifndef TEXT_RESTORE_PROGRAM
+static void copy_to_ring_row(int plane, int col, int row,
+                             const unsigned char* src, int len);
+static void put_horiz_pixels(int x, int y, const unsigned char buf[SCROLL_X_DIM], int n);
+static void store_horiz_pixels(int x, int y, const unsigned char buf[SCROLL_X_DIM], int n);
+static void put_vert_pixels(int x, int y, const unsigned char buf[SCROLL_Y_DIM], int n);
+static void deinterleave_line(const unsigned char buf[SCROLL_X_DIM],
+                              unsigned char runs[4][SCROLL_X_WIDTH]);
+#if defined(__SSE2__)
+static void deinterleave_line_sse2(const unsigned char buf[SCROLL_X_DIM],
+                                   unsigned char runs[4][SCROLL_X_WIDTH]);
+#endif
+#if !defined(__SSE2__) || (TEST_DEINTERLEAVE == 1)
+static void deinterleave_line_scalar(const unsigned char buf[SCROLL_X_DIM],
+                                     unsigned char runs[4][SCROLL_X_WIDTH]);
+#endif
+static void margin_target(int pos, int view, int ring, int limit, int dir,
+                          int* lo, int* hi);
+static int extend_valid_rect(int tx0, int ty0, int tx1, int ty1);
+static void fill_row(int x0, int x1, int y);
+static void fill_column(int x, int y0, int y1);
+static void mark_dirty(int x, int y, int w, int h);
+static void draw_band(int band, int n_bands);
+#if (NUM_RENDER_THREADS > 1)
+static void start_render_threads();
+static void stop_render_threads();
+static void* render_thread(void* arg);
+#endif
+#endif
 
 
 /*
@@ -153,15 +311,10 @@ static void copy_status_bar(unsigned char* img, unsigned short scr_addr);
  * the number of video memory writes; unfortunately, these techniques
  * are slower in emulation...).
  *
- * The size allows the four plane images to move within an area of
- * about twice the size necessary(to reduce the need to deal with
- * the boundary conditions by moving the data within the buffer).
- *
- * Plane 3 is first, followed by 2, 1, and 0. The reverse ordering
- * is used because the logical address of 0 increases first; if plane
- * 0 were first, we would need a buffer byte to keep it from colliding
- * with plane 1 when plane 0 was offset by 1 from plane 1, i.e., when
- * displaying a one-pixel left shift.
+ * Planes 0 through 3 are stored in order, each as a ring of
+ * BUILD_Y_DIM rows of BUILD_X_WIDTH bytes(see BUILD_ADDR above). The
+ * logical view can sit anywhere in the rings, so it never has to be
+ * recentered.
  *
  * The memory fence(included when NDEBUG is not defined) allocates
  * the build buffer with extra space on each side. The extra space
@@ -177,13 +330,85 @@ static void copy_status_bar(unsigned char* img, unsigned short scr_addr);
 #endif
 #define MEM_FENCE_MAGIC 0xF3
 static unsigned char build[BUILD_BUF_SIZE + 2 * MEM_FENCE_WIDTH];
-static int img3_off;            /* offset of upper left pixel  */
-static unsigned char* img3;     /* pointer to upper left pixel */
 static int show_x, show_y;      /* logical view coordinates    */
 
+/*
+ * The rings are larger than the view, so idle time is used to draw a
+ * margin of lines around the view(see prerender_view_margins). The
+ * logical rectangle [valid_x0,valid_x1) x [valid_y0,valid_y1) holds the
+ * pixels known to be correct in the build buffer; it always contains
+ * the view once the lines exposed by the last move have been drawn, and
+ * never exceeds the size of a ring, so no two of its pixels share a
+ * location. Line draws that fall entirely inside it are skipped.
+ *
+ * When the view moves outside of the rectangle, the lines drawn to fill
+ * the view may overwrite parts of the margin, so view_missed is set and
+ * the rectangle shrinks to the view before it is next used. last_dx and
+ * last_dy hold the most recent motion along each axis and bias the
+ * margin toward the direction of scrolling.
+ */
+static int valid_x0, valid_y0;  /* upper left of valid rectangle       */
+static int valid_x1, valid_y1;  /* lower right(exclusive) of rectangle */
+static int view_missed = 1;     /* rectangle must shrink to the view   */
+static int last_dx, last_dy;    /* most recent view motion             */
+
+#if !defined(TEXT_RESTORE_PROGRAM)
+/* pre-rendering statistics, printed by report_render_stats */
+static unsigned long prerender_hits;    /* line draws skipped        */
+static unsigned long prerender_misses;  /* line draws performed      */
+static unsigned long prerender_lines;   /* margin lines pre-rendered */
+#endif
+
 /* displayed video memory variables */
 static unsigned char* mem_image;    /* pointer to start of video memory */
-static unsigned short target_img;   /* offset of displayed screen image */
+static int shown_page;              /* index of page on the display     */
+
+/*
+ * Each display page remembers the logical view that it shows and, for
+ * each video plane, which screen rows of that view have been changed in
+ * the build buffer since the page was last filled. A page that shows
+ * the current view only needs its dirty rows copied; if the page on
+ * display is current, show_screen has nothing to do. page_hidden records
+ * when each page was last flipped away from; the page may still be on
+ * display until the next vertical retrace after that time.
+ */
+static int page_valid[NUM_DISPLAY_PAGES];            /* page holds a view  */
+static int page_x[NUM_DISPLAY_PAGES];                /* view shown by page */
+static int page_y[NUM_DISPLAY_PAGES];
+static unsigned int page_dirty[NUM_DISPLAY_PAGES][4][DIRTY_WORDS]; /* rows to recopy */
+static struct timespec page_hidden[NUM_DISPLAY_PAGES]; /* time of flip away */
+static struct timespec last_retrace;                 /* seen by show_screen */
+#if (PANNED_SCROLLING == 1)
+static int page_cx[NUM_DISPLAY_PAGES];  /* logical column at canvas left */
+static int page_cy[NUM_DISPLAY_PAGES];  /* logical row at canvas top     */
+static int shown_pel;                   /* horizontal PEL panning value  */
+#endif
+
+/*
+ * The status bar text staged by show_status_bar, and whether its image
+ * in temp_buffer still has to be written to video memory. The status bar
+ * is shared by all pages, so it is written during a vertical retrace.
+ */
+static char status_text[SCROLL_X_DIM / 8 + 1];
+static int status_valid;            /* status_text matches the staged image */
+static int status_dirty;            /* staged image not yet written         */
+
+/* page flip statistics, printed by report_render_stats */
+static unsigned long page_flips;      /* start address changes         */
+static unsigned long retrace_waits;   /* waits for vertical retrace    */
+static double retrace_time;           /* seconds spent waiting         */
+
+/*
+ * Video memory write statistics, printed by report_render_stats. Each
+ * frame is counted as scrolling if the view moved since the previous
+ * call to show_screen, or as idle otherwise, and is charged with the
+ * time since that call.
+ */
+static unsigned long vram_bytes[2];   /* bytes written(idle, scrolling) */
+static double vram_time[2];           /* seconds spent(idle, scrolling) */
+static int frame_scrolling;           /* category of the latest frame   */
+static int frame_x, frame_y;          /* view at previous show_screen   */
+static struct timespec frame_stamp;   /* time of previous show_screen   */
 
 
 /*
@@ -225,6 +450,20 @@ do {                                                    \
     );                                                  \
 } while (0)
 
+/* macro used to read a byte from a port; evaluates to the byte */
+#define INB(port)                                       \
+({                                                      \
+    unsigned char _val;                                 \
+    asm volatile("                                    \n\
+        inb (%w1), %b0                                \n\
+        "                                               \
+        : "=a"(_val)                                    \
+        : "d"((port))                                   \
+        : "memory"                                      \
+    );                                                  \
+    _val;                                               \
+})
+
 /* macro used to write two bytes to two consecutive ports */
 #define OUTW(port, val)                                 \
 do {                                                    \
@@ -273,6 +512,39 @@ do {                                                    \
     );                                                  \
 } while (0)
 
+#if (EMULATED_VGA)
+/*
+ * The emulated VGA(see the end of this file) takes the place of the
+ * ports; the write mask points mem_image at one emulated plane.
+ */
+static void emu_set_write_mask(int mask_hi_bits);
+static void emu_outb(int port, int val);
+static void emu_outw(int port, int val);
+static unsigned char emu_inb(int port);
+#undef SET_WRITE_MASK
+#define SET_WRITE_MASK(mask_hi_bits) emu_set_write_mask(mask_hi_bits)
+#undef OUTB
+#define OUTB(port, val) emu_outb((port), (val))
+#undef INB
+#define INB(port) emu_inb(port)
+#undef OUTW
+#define OUTW(port, val) emu_outw((port), (val))
+#undef REP_OUTSW
+#define REP_OUTSW(port, source, count)                  \
+do {                                                    \
+    int _i;                                             \
+    for (_i = 0; _i < (count); _i++)                    \
+        emu_outw((port), ((const unsigned short*)(source))[_i]); \
+} while (0)
+#undef REP_OUTSB
+#define REP_OUTSB(port, source, count)                  \
+do {                                                    \
+    int _i;                                             \
+    for (_i = 0; _i < (count); _i++)                    \
+        emu_outb((port), ((const unsigned char*)(source))[_i]); \
+} while (0)
+#endif
+
 
 /*
  * set_mode_X
@@ -305,8 +577,7 @@ int set_mode_X(void(*horiz_fill_fn)(int, int, unsigned char[SCROLL_X_DIM]),
 
     /* Initialize the logical view window to position(0,0). */
     show_x = show_y = 0;
-    img3_off = BUILD_BASE_INIT;
-    img3 = build + img3_off + MEM_FENCE_WIDTH;
+    invalidate_build_buffer();
 
     /* Set up the memory fence on the build buffer. */
     for (i = 0; i < MEM_FENCE_WIDTH; i++) {
@@ -314,9 +585,6 @@ int set_mode_X(void(*horiz_fill_fn)(int, int, unsigned char[SCROLL_X_DIM]),
         build[BUILD_BUF_SIZE + MEM_FENCE_WIDTH + i] = MEM_FENCE_MAGIC;
     }
 
-    /* One display page goes at the start of video memory. */
-    target_img = 0x05A0;
-
     /* Map video memory and obtain permission for VGA port access. */
     if (open_memory_and_ports() == -1)
         return -1;
@@ -353,12 +621,18 @@ int set_mode_X(void(*horiz_fill_fn)(int, int, unsigned char[SCROLL_X_DIM]),
  *     INPUTS: none
  *     OUTPUTS: none
  *     RETURN VALUE: none
- *     SIDE EFFECTS: restores font data to video memory; clears screens;
- *                   unmaps video memory; checks memory fence integrity
+ *     SIDE EFFECTS: stops the redraw_view worker pool; restores font data
+ *                   to video memory; clears screens; unmaps video memory;
+ *                   checks memory fence integrity
  */
 void clear_mode_X() {
     int i;     /* loop index for checking memory fence */
 
+#if !defined(TEXT_RESTORE_PROGRAM) && (NUM_RENDER_THREADS > 1)
+    /* No redraw_view can be under way; let the workers go. */
+    stop_render_threads();
+#endif
+
     /* Put VGA into text mode, restore font data, and clear screens. */
     set_text_mode_3(1);
 
@@ -381,165 +655,426 @@ void clear_mode_X() {
 }
 
 
+/*
+ * rect_is_valid
+ *     DESCRIPTION: Check whether a logical rectangle lies entirely within
+ *                  the rectangle of valid build buffer pixels.
+ *     INPUTS:(x,y) -- upper left pixel of the rectangle
+ *            w, h -- width and height of the rectangle in pixels
+ *     OUTPUTS: none
+ *     RETURN VALUE: 1 if every pixel of the rectangle is valid, else 0
+ *     SIDE EFFECTS: none
+ */
+static int rect_is_valid(int x, int y, int w, int h) {
+    return (valid_x0 <= x && valid_x1 >= x + w &&
+            valid_y0 <= y && valid_y1 >= y + h);
+}
+
+
+/*
+ * collapse_valid_rect
+ *     DESCRIPTION: Shrink the rectangle of valid pixels to the view after
+ *                  the view has moved outside of it and been filled.
+ *     INPUTS: none
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: discards the pre-rendered margin
+ */
+static void collapse_valid_rect() {
+    valid_x0 = show_x;
+    valid_x1 = show_x + SCROLL_X_DIM;
+    valid_y0 = show_y;
+    valid_y1 = show_y + SCROLL_Y_DIM;
+    view_missed = 0;
+}
+
+
 /*
  * set_view_window
- *     DESCRIPTION: Set the logical view window, moving its location within
- *                  the build buffer if necessary to keep all on-screen data
- *                  in the build buffer. If the location within the build
- *                  buffer moves, this function copies all data from the old
- *                  window that are within the new screen to the appropriate
- *                  new location, so only data not previously on the screen
- *                  must be drawn before calling show_screen.
+ *     DESCRIPTION: Set the logical view window. The build buffer rings are
+ *                  addressed by logical coordinates, so data from the old
+ *                  window that are within the new screen are already in
+ *                  place, and only data not previously on the screen must
+ *                  be drawn before calling show_screen. Lines in the
+ *                  pre-rendered margin are skipped when drawn.
  *     INPUTS:(scr_x,scr_y) -- new upper left pixel of logical view window
  *     OUTPUTS: none
  *     RETURN VALUE: none
- *     SIDE EFFECTS: may shift position of logical view window within build
- *                   buffer
+ *     SIDE EFFECTS: none
  */
 void set_view_window(int scr_x, int scr_y) {
-    int old_x, old_y;       /* old position of logical view window                              */
-    int start_x, start_y;   /* starting position for copying from old to new                    */
-    int end_x, end_y;       /* ending position for copying from old to new                      */
-    int start_off;          /* offset of copy start relative to old build buffer start position */
-    int length;             /* amount of data to be copied                                      */
-    int i;                  /* copy loop index                                                  */
-    unsigned char* start_addr;      /* starting memory address of copy                          */
-    unsigned char* target_addr;     /* destination memory address for copy                      */
-
-    /* Record the old position. */
-    old_x = show_x;
-    old_y = show_y;
-
-    /* Keep track of the new view window. */
+    /*
+     * The lines exposed by the previous move have been drawn by now(but
+     * after invalidate_build_buffer, the view may not have been redrawn).
+     */
+    if (view_missed && valid_x0 < valid_x1)
+        collapse_valid_rect();
+
+    /* Remember the direction and speed of motion along each axis. */
+    if (scr_x != show_x)
+        last_dx = scr_x - show_x;
+    if (scr_y != show_y)
+        last_dy = scr_y - show_y;
+
     show_x = scr_x;
     show_y = scr_y;
 
-    /*
-     * If the new view window fits within the boundaries of the build
-     * buffer, we need move nothing around.
-     */
-    if (img3_off + (scr_x >> 2) + scr_y * SCROLL_X_WIDTH >= 0 &&
-        img3_off + 3 * SCROLL_SIZE + ((scr_x + SCROLL_X_DIM - 1) >> 2) +
-        (scr_y + SCROLL_Y_DIM - 1) * SCROLL_X_WIDTH < BUILD_BUF_SIZE)
-        return;
+    /* Anything drawn to fill a view outside the margin may overwrite it. */
+    if (!rect_is_valid(show_x, show_y, SCROLL_X_DIM, SCROLL_Y_DIM))
+        view_missed = 1;
+}
 
-    /*
-     * If the new screen does not overlap at all with the old screen, none
-     * of the old data need to be saved, and we can simply reposition the
-     * valid window of the build buffer in the middle of that buffer.
-     */
-    if (scr_x <= old_x - SCROLL_X_DIM || scr_x >= old_x + SCROLL_X_DIM ||
-        scr_y <= old_y - SCROLL_Y_DIM || scr_y >= old_y + SCROLL_Y_DIM) {
-        img3_off = BUILD_BASE_INIT -(scr_x >> 2) - scr_y * SCROLL_X_WIDTH;
-        img3 = build + img3_off + MEM_FENCE_WIDTH;
+
+/*
+ * invalidate_build_buffer
+ *     DESCRIPTION: Forget all pre-rendered pixels in the build buffer. Must
+ *                  be called before redrawing the view whenever the photo
+ *                  or the objects drawn over it change.
+ *     INPUTS: none
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: line draws until the next move are no longer skipped
+ */
+void invalidate_build_buffer() {
+    valid_x0 = valid_x1 = show_x;
+    valid_y0 = valid_y1 = show_y;
+    view_missed = 1;
+    last_dx = last_dy = 0;
+}
+
+
+/*
+ * show_screen
+ *     DESCRIPTION: Show the logical view window and the status bar on the
+ *                  video display. The view is copied to an off-screen
+ *                  page: only rows changed since that page was last
+ *                  filled(all rows if the page showed a different view).
+ *                  The display is then flipped to the page with a single
+ *                  start address change, and a status bar staged by
+ *                  show_status_bar is written during the next vertical
+ *                  retrace. If the page on display already shows the
+ *                  current view, nothing is copied and the display is
+ *                  not flipped.
+ *     INPUTS: none
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: copies from the build buffer to video memory;
+ *                   shifts the VGA display source to point to the new image
+ */
+void show_screen() {
+    struct timespec now; /* time of this frame                      */
+#if (PANNED_SCROLLING != 1)
+    int page;            /* index of target page                    */
+    int x;               /* logical x of leftmost pixel in a plane  */
+    int i;               /* loop index over video planes            */
+#endif
+
+    /* Charge the time since the last frame to idle or scrolling. */
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    frame_scrolling = (show_x != frame_x || show_y != frame_y);
+    if (0 != frame_stamp.tv_sec || 0 != frame_stamp.tv_nsec) {
+        vram_time[frame_scrolling] += (now.tv_sec - frame_stamp.tv_sec) +
+                                      (now.tv_nsec - frame_stamp.tv_nsec) / 1e9;
+    }
+    frame_stamp = now;
+    frame_x = show_x;
+    frame_y = show_y;
+
+    /* Leave the display alone if it already shows the view. */
+    if (page_is_current(shown_page)) {
+        if (status_dirty) {
+            wait_for_retrace();
+            write_status_bar();
+        }
         return;
     }
 
+#if (PANNED_SCROLLING == 1)
+    pan_to_view(&now);
+#else
     /*
-     * Any still-visible portion of the old screen should be retained.
-     * Rather than clipping exactly, we copy all contiguous data between
-     * a clipped starting point to a clipped ending point(which may
-     * include non-visible data).
-     *
-     * The starting point is the maximum(x,y) coordinates between the
-     * new and old screens.    The ending point is the minimum(x,y)
-     * coordinates between the old and new screens(offset by the screen
-     * size).
+     * Pick an off-screen page, waiting for the flip away from it to take
+     * effect if need be.
      */
-    if (scr_x > old_x) {
-        start_x = scr_x;
-        end_x = old_x;
-    }
-    else {
-        start_x = old_x;
-        end_x = scr_x;
+    page = choose_target_page(&now);
+
+    /* A page that showed some other view must be copied in full. */
+    if (!page_valid[page] || show_x != page_x[page] || show_y != page_y[page]) {
+        memset(page_dirty[page], 0xFF, sizeof(page_dirty[page]));
+        page_valid[page] = 1;
+        page_x[page] = show_x;
+        page_y[page] = show_y;
     }
-    end_x += SCROLL_X_DIM - 1;
-    if (scr_y > old_y) {
-        start_y = scr_y;
-        end_y = old_y;
-    }
-    else {
-        start_y = old_y;
-        end_y = scr_y;
-    }
-    end_y += SCROLL_Y_DIM - 1;
 
     /*
-     * We now calculate the starting and ending addresses for the copy
-     * as well as the new offsets for use with the build buffer.    The
-     * length to be copied is basically the ending offset minus the starting
-     * offset plus one(plus the three screens in between planes 3 and 0).
+     * Video plane i shows logical pixels show_x + i, show_x + i + 4, and
+     * so forth, which sit in build plane((show_x + i) & 3) starting at
+     * column((show_x + i) >> 2).
      */
-    start_off = (start_x >> 2) + start_y * SCROLL_X_WIDTH;
-    start_addr = img3 + start_off;
-    length = (end_x >> 2) + end_y * SCROLL_X_WIDTH + 1 - start_off + 3 * SCROLL_SIZE;
-    img3_off = BUILD_BASE_INIT -(show_x >> 2) - show_y * SCROLL_X_WIDTH;
-    img3 = build + img3_off + MEM_FENCE_WIDTH;
-    target_addr = img3 + start_off;
+    for (i = 0; i < 4; i++) {
+        x = show_x + i;
+        SET_WRITE_MASK(1 << (i + 8));
+        vram_bytes[frame_scrolling] +=
+            copy_image(x & 3, x >> 2, show_y, PAGE_ADDR(page), page_dirty[page][i]);
+    }
+    memset(page_dirty[page], 0, sizeof(page_dirty[page]));
 
     /*
-     * Copy the relevant portion of the screen from the old location to the
-     * new one.    The areas may overlap, so copy direction is important.
-     *(You should be able to explain why!)
+     * Change the VGA registers to point the top left of the screen
+     * to the video memory that we just filled. The CRTC latches the
+     * start address at the next vertical retrace; writing both bytes
+     * while the display is active keeps them from being split by it.
      */
-    if (start_addr < target_addr) {
-        for (i = length; i-- > 0; ) {
-            target_addr[i] = start_addr[i];
-        }
-    }
-    else {
-        for (i = 0; i < length; i++) {
-            target_addr[i] = start_addr[i];
-        }
+    while (0 != (INB(0x03DA) & 0x01));
+    OUTW(0x03D4, (PAGE_ADDR(page) & 0xFF00) | 0x0C);
+    OUTW(0x03D4, ((PAGE_ADDR(page) & 0x00FF) << 8) | 0x0D);
+    (void)clock_gettime(CLOCK_MONOTONIC, &page_hidden[shown_page]);
+    shown_page = page;
+    page_flips++;
+#endif
+
+    /* The status bar is not paged; change it during the retrace. */
+    if (status_dirty) {
+        wait_for_retrace();
+        write_status_bar();
     }
 }
 
 
 /*
- * show_screen
- *     DESCRIPTION: Show the logical view window on the video display.
- *     INPUTS: none
+ * choose_target_page
+ *     DESCRIPTION: Choose the page to receive the next frame: the one
+ *                  hidden longest(of those not on display). If the flip
+ *                  away from it may not have taken effect yet, wait for
+ *                  a vertical retrace first.
+ *     INPUTS: now -- the current time
  *     OUTPUTS: none
- *     RETURN VALUE: none
- *     SIDE EFFECTS: copies from the build buffer to video memory;
- *                   shifts the VGA display source to point to the new image
+ *     RETURN VALUE: index of the page
+ *     SIDE EFFECTS: may wait for a vertical retrace
  */
-void show_screen() {
-    unsigned char* addr;    /* source address for copy             */
-    int p_off;              /* plane offset of first display plane */
-    int i;                  /* loop index over video planes        */
+static int choose_target_page(const struct timespec* now) {
+    int page; /* page chosen             */
+    int i;    /* loop index over pages   */
+    long ns;  /* time since page hidden  */
+
+    page = -1;
+    for (i = 0; i < NUM_DISPLAY_PAGES; i++) {
+        if (i == shown_page)
+            continue;
+        if (-1 == page ||
+            page_hidden[i].tv_sec < page_hidden[page].tv_sec ||
+            (page_hidden[i].tv_sec == page_hidden[page].tv_sec &&
+             page_hidden[i].tv_nsec < page_hidden[page].tv_nsec))
+            page = i;
+    }
 
     /*
-     * Calculate offset of build buffer plane to be mapped into plane 0
-     * of display.
+     * A retrace seen since the page was hidden, or a full refresh period
+     * since then, means that the page is no longer on display.
      */
-    p_off = (3 - (show_x & 3));
+    if (page_hidden[page].tv_sec < last_retrace.tv_sec ||
+        (page_hidden[page].tv_sec == last_retrace.tv_sec &&
+         page_hidden[page].tv_nsec < last_retrace.tv_nsec))
+        return page;
+    ns = (now->tv_sec - page_hidden[page].tv_sec) * 1000000000L +
+         (now->tv_nsec - page_hidden[page].tv_nsec);
+    if (REFRESH_NSEC > ns)
+        wait_for_retrace();
+    return page;
+}
+
+
+/*
+ * wait_for_retrace
+ *     DESCRIPTION: Wait for the start of the next vertical retrace by
+ *                  polling bit 3 of the VGA input status register(first
+ *                  for the end of any retrace already under way, whose
+ *                  start may have come before the latest flip).
+ *     INPUTS: none
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: records the time of the retrace
+ */
+static void wait_for_retrace() {
+    struct timespec start; /* time the wait began */
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    while (0 != (INB(0x03DA) & 0x08));
+    while (0 == (INB(0x03DA) & 0x08));
+    (void)clock_gettime(CLOCK_MONOTONIC, &last_retrace);
+    retrace_waits++;
+    retrace_time += (last_retrace.tv_sec - start.tv_sec) +
+                    (last_retrace.tv_nsec - start.tv_nsec) / 1e9;
+}
 
-    /* Switch to the other target screen in video memory. */
-    target_img ^= 0x4000;
 
-    /* Calculate the source address. */
-    addr = img3 + (show_x >> 2) + show_y * SCROLL_X_WIDTH;
+#if (PANNED_SCROLLING == 1)
+/*
+ * pan_to_view
+ *     DESCRIPTION: Show the view from a canvas by setting the CRTC start
+ *                  address and the horizontal PEL panning register. The
+ *                  canvas on display is used if the view(plus the extra
+ *                  address it spans when not aligned) lies within it;
+ *                  otherwise the other canvas is centered on the view.
+ *                  Only lines outside the view last copied to the canvas
+ *                  and rows dirtied since then are copied.
+ *     INPUTS: now -- the current time
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: copies from the build buffer to video memory;
+ *                   may wait for a vertical retrace
+ */
+static void pan_to_view(const struct timespec* now) {
+    int page;             /* index of canvas to show                  */
+    int col;              /* logical column at the left of the screen */
+    int pel;              /* horizontal PEL panning value             */
+    unsigned short addr;  /* start address of the view                */
+    int p;                /* loop index over video planes             */
+
+    page = shown_page;
+    col = show_x >> 2;
+    if (col < page_cx[page] ||
+        col + SCROLL_X_WIDTH + 1 > page_cx[page] + VRAM_PITCH ||
+        show_y < page_cy[page] ||
+        show_y + SCROLL_Y_DIM > page_cy[page] + CANVAS_Y_DIM) {
+        page = choose_target_page(now);
+        page_cx[page] = col - (VRAM_PITCH - SCROLL_X_WIDTH - 1) / 2;
+        page_cy[page] = show_y - (CANVAS_Y_DIM - SCROLL_Y_DIM) / 2;
+        page_valid[page] = 0;
+    }
 
-    /* Draw to each plane in the video memory. */
-    for (i = 0; i < 4; i++) {
-        SET_WRITE_MASK(1 << (i + 8));
-        copy_image(addr + ((p_off - i + 4) & 3) * SCROLL_SIZE + (p_off < i), target_img);
+    for (p = 0; p < 4; p++) {
+        SET_WRITE_MASK(1 << (p + 8));
+        vram_bytes[frame_scrolling] += copy_to_canvas(page, p);
     }
+    page_valid[page] = 1;
+    page_x[page] = show_x;
+    page_y[page] = show_y;
+    memset(page_dirty[page], 0, sizeof(page_dirty[page]));
 
     /*
-     * Change the VGA registers to point the top left of the screen
-     * to the video memory that we just filled.
+     * The start address is latched at the next vertical retrace, but
+     * the PEL panning register takes effect at once, so the latter is
+     * changed only after the retrace has begun.
      */
-    OUTW(0x03D4, (target_img & 0xFF00) | 0x0C);
-    OUTW(0x03D4, ((target_img & 0x00FF) << 8) | 0x0D);
+    addr = PAGE_ADDR(page) + (show_y - page_cy[page]) * VRAM_PITCH +
+           (col - page_cx[page]);
+    while (0 != (INB(0x03DA) & 0x01));
+    OUTW(0x03D4, (addr & 0xFF00) | 0x0C);
+    OUTW(0x03D4, ((addr & 0x00FF) << 8) | 0x0D);
+    if (page != shown_page) {
+        page_hidden[shown_page] = *now;
+        shown_page = page;
+    }
+    page_flips++;
+
+    pel = (show_x & 3) << 1;
+    if (pel != shown_pel) {
+        wait_for_retrace();
+        (void)INB(0x03DA);            /* reset attribute flip-flop */
+        OUTB(0x03C0, 0x33);           /* PEL panning, video on     */
+        OUTB(0x03C0, pel);
+        shown_pel = pel;
+    }
 }
 
 
+/*
+ * copy_to_canvas
+ *     DESCRIPTION: Copy one plane of the view to a canvas. A row of the
+ *                  view that was also in the view last copied to the
+ *                  canvas is copied only where it was not, unless the
+ *                  row has been dirtied since.
+ *     INPUTS: page -- the canvas
+ *             p -- the video plane(and build buffer plane)
+ *     OUTPUTS: none
+ *     RETURN VALUE: number of bytes written to video memory
+ *     SIDE EFFECTS: copies from the build buffer to video memory
+ */
+static int copy_to_canvas(int page, int p) {
+    int c0, c1;          /* logical columns of the view in plane p     */
+    int o0, o1;          /* columns of the view last copied            */
+    const unsigned int* dirty; /* dirty rows of the view last copied   */
+    int copied;          /* bytes written to video memory              */
+    int y;               /* loop index over logical rows               */
+
+    c0 = (show_x + ((p - show_x) & 3)) >> 2;
+    c1 = c0 + SCROLL_X_WIDTH;
+    o0 = (page_x[page] + ((p - page_x[page]) & 3)) >> 2;
+    o1 = o0 + SCROLL_X_WIDTH;
+    dirty = page_dirty[page][(p - page_x[page]) & 3];
+
+    copied = 0;
+    for (y = show_y; y < show_y + SCROLL_Y_DIM; y++) {
+        if (!page_valid[page] || y < page_y[page] ||
+            y >= page_y[page] + SCROLL_Y_DIM || o0 >= c1 || o1 <= c0 ||
+            0 != (dirty[(y - page_y[page]) >> 5] & (1U << ((y - page_y[page]) & 31)))) {
+            copied += copy_canvas_run(page, p, c0, c1, y);
+            continue;
+        }
+        if (c0 < o0)
+            copied += copy_canvas_run(page, p, c0, o0, y);
+        if (o1 < c1)
+            copied += copy_canvas_run(page, p, o1, c1, y);
+    }
+    return copied;
+}
+
 
+/*
+ * copy_canvas_run
+ *     DESCRIPTION: Copy a run of one row of one plane from the build
+ *                  buffer to a canvas(in at most two pieces, as the
+ *                  build buffer rows wrap).
+ *     INPUTS: page -- the canvas
+ *             p -- the video plane(and build buffer plane)
+ *             c0, c1 -- first and last(exclusive) logical columns
+ *             y -- the logical row
+ *     OUTPUTS: none
+ *     RETURN VALUE: number of bytes written to video memory
+ *     SIDE EFFECTS: copies from the build buffer to video memory
+ */
+static int copy_canvas_run(int page, int p, int c0, int c1, int y) {
+    unsigned char* dst; /* destination of the run in video memory */
+    int copied;         /* bytes written to video memory          */
+    int n;              /* bytes in each piece                    */
+
+    copied = c1 - c0;
+    dst = mem_image + PAGE_ADDR(page) + (y - page_cy[page]) * VRAM_PITCH +
+          (c0 - page_cx[page]);
+    while (c0 < c1) {
+        n = BUILD_X_WIDTH - (c0 & BUILD_X_MASK);
+        if (n > c1 - c0)
+            n = c1 - c0;
+        memcpy(dst, BUILD_ADDR(p, c0, y), n);
+        dst += n;
+        c0 += n;
+    }
+    return copied;
+}
+#endif /* PANNED_SCROLLING == 1 */
 
 
+/*
+ * page_is_current
+ *     DESCRIPTION: Check whether a display page shows the current logical
+ *                  view with no rows changed since it was filled.
+ *     INPUTS: page -- index of the page(0 or 1)
+ *     OUTPUTS: none
+ *     RETURN VALUE: 1 if the page is current, else 0
+ *     SIDE EFFECTS: none
+ */
+static int page_is_current(int page) {
+    int i; /* loop index over planes and words of the dirty row map */
+
+    if (!page_valid[page] || show_x != page_x[page] || show_y != page_y[page])
+        return 0;
+    for (i = 0; i < 4 * DIRTY_WORDS; i++) {
+        if (0 != page_dirty[page][i / DIRTY_WORDS][i % DIRTY_WORDS])
+            return 0;
+    }
+    return 1;
+}
 
 
 /*
@@ -556,6 +1091,10 @@ void clear_screens() {
 
     /* Set 64kB to zero(times four planes = 256kB). */
     memset(mem_image, 0, MODE_X_MEM_SIZE);
+
+    /* No display page holds a view, nor the status bar its text. */
+    memset(page_valid, 0, sizeof(page_valid));
+    status_valid = 0;
 }
 
 
@@ -564,38 +1103,57 @@ void clear_screens() {
 
 /*
  * show_status_bar
- *     DESCRIPTION: Show the status bar on the video display.
- *     INPUTS: none
+ *     DESCRIPTION: Stage the status bar text for display. The image of
+ *                  the bar is rendered only if the text has changed, and
+ *                  is written to video memory by the next show_screen.
+ *     INPUTS: combined_string -- the text of the status bar
  *     OUTPUTS: none
  *     RETURN VALUE: none
- *     SIDE EFFECTS: copies from the build buffer to video memory;
- *                   shifts the VGA display source to point to the new image
+ *     SIDE EFFECTS: may render into temp_buffer
  */
 void show_status_bar(char * combined_string) {
+    if (status_valid &&
+        0 == strncmp(status_text, combined_string, sizeof(status_text) - 1))
+        return;
+
+    (void)strncpy(status_text, combined_string, sizeof(status_text) - 1);
+    status_text[sizeof(status_text) - 1] = '\0';
+    status_valid = 1;
 
-	//unsigned char* addr;    /* source address for copy             */
-    int p_off;              /* plane offset of first display plane */
-    int i;                  /* loop index over video planes        */
-	
 	text_to_graphics(combined_string);
-	
-    /*
-     * Calculate offset of build buffer plane to be mapped into plane 0
-     * of display.
-     */
-    p_off = (3 - (show_x & 3));
+    status_dirty = 1;
+}
 
-    /* Switch to the other target screen in video memory. */
-    target_img ^= 0x4000;
+
+/*
+ * write_status_bar
+ *     DESCRIPTION: Write the staged status bar image to video memory.
+ *     INPUTS: none
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: copies from temp_buffer to video memory
+ */
+static void write_status_bar() {
+    int i;                  /* loop index over video planes        */
+#if (PANNED_SCROLLING == 1)
+    int r;                  /* loop index over status bar rows     */
+#endif
 
     /* Draw to each plane in the video memory. */
     for (i = 0; i < 4; i++) {
         SET_WRITE_MASK(1 << (i + 8));
+#if (PANNED_SCROLLING == 1)
+        /* The split screen shares the canvas pitch. */
+        for (r = 0; r < STATUS_Y_DIM; r++) {
+            memcpy(mem_image + r * VRAM_PITCH,
+                   temp_buffer + i * 1440 + r * SCROLL_X_WIDTH, SCROLL_X_WIDTH);
+        }
+#else
         copy_status_bar(temp_buffer +i*1440 , 0x0000); //copy from the build buffer to the video memory.
+#endif
     }
-//((p_off - i + 4) & 3) * 1440 + (p_off < i)
-
-	return;
+    vram_bytes[frame_scrolling] += 4 * 1440;
+    status_dirty = 0;
 }
 
 /*
@@ -622,35 +1180,27 @@ void show_status_bar(char * combined_string) {
  *     SIDE EFFECTS: draws into the build buffer
  */
 int draw_vert_line(int x) {
-    /* to be written... */
-	unsigned char buf[SCROLL_Y_DIM]; 
-	unsigned char* addr;
-	int p_off;
-	int i;
- 
-	/* Check whether requested line falls in the logical view window. */
-	if(x < 0 || x >= SCROLL_X_DIM)
-	return -1;
- 
-	/* Adjust y to the logical row value. */
-	x +=show_x;
- 
-	/* Get the image of the line. */
-	(*vert_line_fn)(x, show_y, buf);
- 
-	/* Calculate starting address in build buffer. */
-	addr = img3 + (x >> 2) + show_y * SCROLL_X_WIDTH;
- 
-	/* Calculate plane offset of first pixel. */
-	p_off = (3 - (x & 3));
- 
-	/* Copy image data into appropriate planes in build buffer. */
-	for (i = 0; i < SCROLL_Y_DIM; i++) {
-		addr[p_off * SCROLL_SIZE] = buf[i];
-		addr += SCROLL_X_WIDTH;
-	}
-	
-	/* Return success. */
+    unsigned char buf[SCROLL_Y_DIM]; /* buffer for graphical image of line */
+
+    /* Check whether requested line falls in the logical view window. */
+    if (x < 0 || x >= SCROLL_X_DIM)
+        return -1;
+
+    /* Adjust x to the logical column value. */
+    x += show_x;
+
+    /* Skip the line if it was already drawn as part of the margin. */
+    if (rect_is_valid(x, show_y, 1, SCROLL_Y_DIM)) {
+        prerender_hits++;
+        return 0;
+    }
+    prerender_misses++;
+
+    /* Get the image of the line and copy it into the build buffer. */
+    (*vert_line_fn)(x, show_y, buf);
+    put_vert_pixels(x, show_y, buf, SCROLL_Y_DIM);
+
+    /* Return success. */
     return 0;
 }
 
@@ -669,10 +1219,7 @@ int draw_vert_line(int x) {
  *     SIDE EFFECTS: draws into the build buffer
  */
 int draw_horiz_line(int y) {
-    unsigned char buf[SCROLL_X_DIM]; /* buffer for graphical image of line                            */
-    unsigned char* addr;             /* address of first pixel in build buffer (without plane offset) */
-    int p_off;                       /* offset of plane of first pixel                                */
-    int i;                           /* loop index over pixels                                        */
+    unsigned char buf[SCROLL_X_DIM]; /* buffer for graphical image of line */
 
     /* Check whether requested line falls in the logical view window. */
     if (y < 0 || y >= SCROLL_Y_DIM)
@@ -681,53 +1228,836 @@ int draw_horiz_line(int y) {
     /* Adjust y to the logical row value. */
     y += show_y;
 
-    /* Get the image of the line. */
-    (*horiz_line_fn)(show_x, y, buf);
-
-    /* Calculate starting address in build buffer. */
-    addr = img3 + (show_x >> 2) + y * SCROLL_X_WIDTH;
-
-    /* Calculate plane offset of first pixel. */
-    p_off = (3 - (show_x & 3));
-
-    /* Copy image data into appropriate planes in build buffer. */
-    for (i = 0; i < SCROLL_X_DIM; i++) {
-        addr[p_off * SCROLL_SIZE] = buf[i];
-        if (--p_off < 0) {
-            p_off = 3;
-            addr++;
-        }
+    /* Skip the line if it was already drawn as part of the margin. */
+    if (rect_is_valid(show_x, y, SCROLL_X_DIM, 1)) {
+        prerender_hits++;
+        return 0;
     }
+    prerender_misses++;
+
+    /* Get the image of the line and copy it into the build buffer. */
+    (*horiz_line_fn)(show_x, y, buf);
+    put_horiz_pixels(show_x, y, buf, SCROLL_X_DIM);
 
     /* Return success. */
     return 0;
 }
 
-#endif /* !defined(TEXT_RESTORE_PROGRAM) */
-
 
 /*
- * open_memory_and_ports
- *     DESCRIPTION: Map video memory into our address space; obtain permission
- *                  to access VGA ports.
- *     INPUTS: none
+ * prerender_view_margins
+ *     DESCRIPTION: Use idle time to draw lines around the logical view
+ *                  window into the unused part of the build buffer rings,
+ *                  so that later moves find their lines already drawn.
+ *                  The margin fills the rings as far as the edges of the
+ *                  photo allow. Most of it is placed ahead of the most
+ *                  recent motion along each axis(more so for faster
+ *                  motion), and the side ahead is drawn first. Lines
+ *                  that no longer fit the margin after a change of
+ *                  direction are simply dropped.
+ *     INPUTS: max_x, max_y -- width and height of the photo in pixels
+ *             budget -- maximum number of lines to draw
  *     OUTPUTS: none
- *     RETURN VALUE: 0 on success, -1 on failure
- *     SIDE EFFECTS: prints an error message to stdout on failure
+ *     RETURN VALUE: number of lines drawn; 0 once the margin is complete
+ *     SIDE EFFECTS: draws into the build buffer
  */
-static int open_memory_and_ports() {
-    int mem_fd;    /* file descriptor for physical memory image */
+int prerender_view_margins(int max_x, int max_y, int budget) {
+    int tx0, ty0, tx1, ty1; /* target rectangle for the margin */
+    int drawn;              /* number of lines drawn           */
 
-    /* Obtain permission to access ports 0x03C0 through 0x03DA. */
-    if (ioperm(0x03C0, 0x03DA - 0x03C0 + 1, 1) == -1) {
-        perror("set port permissions");
-        return -1;
-    }
+    /* Start from the view if it moved outside of the margin. */
+    if (view_missed)
+        collapse_valid_rect();
 
-    /* Open file to access physical memory. */
-    if ((mem_fd = open("/dev/mem", O_RDWR)) == -1) {
-        perror("open /dev/mem");
-        return -1;
+    /* Find the rectangle that the margin should cover. */
+    margin_target(show_x, SCROLL_X_DIM, BUILD_X_WIDTH * 4, max_x, last_dx, &tx0, &tx1);
+    margin_target(show_y, SCROLL_Y_DIM, BUILD_Y_DIM, max_y, last_dy, &ty0, &ty1);
+
+    /*
+     * Drop any part of the margin outside of the target; its lines are
+     * still correct, but keeping them would let new lines overwrite them.
+     */
+    if (valid_x0 < tx0)
+        valid_x0 = tx0;
+    if (valid_x1 > tx1)
+        valid_x1 = tx1;
+    if (valid_y0 < ty0)
+        valid_y0 = ty0;
+    if (valid_y1 > ty1)
+        valid_y1 = ty1;
+
+    /* Grow the margin one line at a time. */
+    for (drawn = 0; drawn < budget; drawn++) {
+        if (!extend_valid_rect(tx0, ty0, tx1, ty1))
+            break;
+    }
+    prerender_lines += drawn;
+    return drawn;
+}
+
+
+/*
+ * redraw_rect
+ *     DESCRIPTION: Redraw a rectangle of the logical photo space after
+ *                  the pixels in it have changed(for example, when an
+ *                  object appears or vanishes). Only the part of the
+ *                  rectangle in the view and the pre-rendered margin is
+ *                  drawn; the rest is drawn when it is exposed. The
+ *                  rectangle is filled by rows or by columns, whichever
+ *                  takes fewer calls to the line image functions.
+ *     INPUTS:(x,y) -- upper left pixel of the rectangle
+ *            w, h -- width and height of the rectangle in pixels
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: draws into the build buffer
+ */
+void redraw_rect(int x, int y, int w, int h) {
+    int x0, y0, x1, y1; /* rectangle clipped to the valid pixels */
+    int i;              /* loop index over rows or columns       */
+
+    /* The view has been drawn in full by now. */
+    if (view_missed)
+        collapse_valid_rect();
+
+    /* Clip the rectangle; nothing outside of it has been drawn. */
+    x0 = (x > valid_x0 ? x : valid_x0);
+    x1 = (x + w < valid_x1 ? x + w : valid_x1);
+    y0 = (y > valid_y0 ? y : valid_y0);
+    y1 = (y + h < valid_y1 ? y + h : valid_y1);
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    if ((y1 - y0) * ((x1 - x0 + SCROLL_X_DIM - 1) / SCROLL_X_DIM) <=
+        (x1 - x0) * ((y1 - y0 + SCROLL_Y_DIM - 1) / SCROLL_Y_DIM)) {
+        for (i = y0; i < y1; i++)
+            fill_row(x0, x1, i);
+    }
+    else {
+        for (i = x0; i < x1; i++)
+            fill_column(i, y0, y1);
+    }
+}
+
+
+/*
+ * The worker pool used by redraw_view. Each worker waits for render_gen
+ * to change, draws its band of the view, and decrements render_pending;
+ * the caller of redraw_view draws band 0 itself and waits for the count
+ * to reach zero. The pool is started on first use, and render_workers
+ * records how many threads were actually created. clear_mode_X stops
+ * the pool(see stop_render_threads): it waits for any redraw under way
+ * to finish(render_busy), sets render_stop, and joins the workers. A
+ * redraw that starts while the pool is stopping draws the whole view
+ * itself, so no job is ever handed to a worker that is exiting.
+ */
+#if (NUM_RENDER_THREADS > 1)
+static pthread_t render_thread_id[NUM_RENDER_THREADS - 1];
+static pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t render_start_cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t render_done_cv = PTHREAD_COND_INITIALIZER;
+static int render_limit = NUM_RENDER_THREADS; /* most threads to use */
+static int render_started;          /* pool has been started      */
+static int render_stop;             /* workers must exit          */
+static int render_busy;             /* a redraw is under way      */
+static int render_workers;          /* number of worker threads   */
+static unsigned int render_gen;     /* incremented for each job   */
+static int render_pending;          /* workers still drawing      */
+#endif
+
+
+/*
+ * redraw_view
+ *     DESCRIPTION: Draw every line of the logical view window. The view
+ *                  is split into horizontal bands that are drawn at the
+ *                  same time by up to NUM_RENDER_THREADS threads(the caller
+ *                  and a pool of workers) into disjoint rows of the build
+ *                  buffer; the call returns once all bands are done.
+ *                  The line image function must be safe to call from
+ *                  several threads at once.
+ *     INPUTS: none
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: draws into the build buffer; starts the worker pool
+ *                   on first use
+ */
+void redraw_view() {
+#if (NUM_RENDER_THREADS > 1)
+    int workers; /* workers drawing bands of this view */
+
+    /*
+     * Hand out bands 1 and up to the workers, then draw band 0. While
+     * the pool is stopping, this thread draws the whole view.
+     */
+    (void)pthread_mutex_lock(&render_lock);
+    if (!render_started)
+        start_render_threads();
+    workers = (render_stop ? 0 : render_workers);
+    if (0 < workers) {
+        render_busy = 1;
+        render_pending = workers;
+        render_gen++;
+        (void)pthread_cond_broadcast(&render_start_cv);
+    }
+    (void)pthread_mutex_unlock(&render_lock);
+
+    draw_band(0, workers + 1);
+
+    if (0 < workers) {
+        (void)pthread_mutex_lock(&render_lock);
+        while (0 < render_pending)
+            (void)pthread_cond_wait(&render_done_cv, &render_lock);
+        render_busy = 0;
+        (void)pthread_cond_broadcast(&render_done_cv);
+        (void)pthread_mutex_unlock(&render_lock);
+    }
+#else
+    draw_band(0, 1);
+#endif
+
+    /* The bands leave the shared bookkeeping to this thread. */
+    mark_dirty(show_x, show_y, SCROLL_X_DIM, SCROLL_Y_DIM);
+    prerender_misses += SCROLL_Y_DIM;
+}
+
+
+/*
+ * draw_band
+ *     DESCRIPTION: Draw one of several equal horizontal bands of the
+ *                  logical view window into the build buffer.
+ *     INPUTS: band -- index of the band to draw
+ *             n_bands -- number of bands in the view
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: draws into the build buffer
+ */
+static void draw_band(int band, int n_bands) {
+    unsigned char buf[SCROLL_X_DIM]; /* buffer for graphical image of line */
+    int y;                           /* index over rows of the view        */
+
+    for (y = (band * SCROLL_Y_DIM) / n_bands;
+         y < ((band + 1) * SCROLL_Y_DIM) / n_bands; y++) {
+        (*horiz_line_fn)(show_x, show_y + y, buf);
+        store_horiz_pixels(show_x, show_y + y, buf, SCROLL_X_DIM);
+    }
+}
+
+
+#if (NUM_RENDER_THREADS > 1)
+/*
+ * start_render_threads
+ *     DESCRIPTION: Start the worker pool for redraw_view, with no more
+ *                  threads(counting the caller) than there are
+ *                  processors online. If a thread cannot be created,
+ *                  the pool runs with those already started(possibly
+ *                  none). Called with render_lock held(the workers
+ *                  wait for it before looking for work).
+ *     INPUTS: none
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: creates threads
+ */
+static void start_render_threads() {
+    long n_cpus; /* number of processors online */
+
+    /*
+     * More threads than processors only adds switching overhead(but the
+     * test times each number of threads).
+     */
+    n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (1 > n_cpus || render_limit < n_cpus || 1 == TEST_RENDER_POOL)
+        n_cpus = render_limit;
+
+    /* No workers are left from an earlier pool to see these change. */
+    render_started = 1;
+    render_gen = 0;
+    for (render_workers = 0; render_workers < n_cpus - 1; render_workers++) {
+        if (0 != pthread_create(&render_thread_id[render_workers], NULL, render_thread,
+                                (void*)(long)(render_workers + 1)))
+            break;
+    }
+}
+
+
+/*
+ * stop_render_threads
+ *     DESCRIPTION: Stop the worker pool for redraw_view and wait for the
+ *                  workers to exit; the next redraw_view starts it again.
+ *                  A redraw under way in another thread is finished
+ *                  first, and one started meanwhile is drawn without the
+ *                  workers, so the workers never exit with a band left
+ *                  undrawn. The thread calling redraw_view must not be
+ *                  cancelled, or it may die holding render_lock.
+ *     INPUTS: none
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: joins threads
+ */
+static void stop_render_threads() {
+    int i; /* loop index over workers */
+
+    (void)pthread_mutex_lock(&render_lock);
+    if (!render_started || render_stop) {
+        (void)pthread_mutex_unlock(&render_lock);
+        return;
+    }
+    while (render_busy)
+        (void)pthread_cond_wait(&render_done_cv, &render_lock);
+    render_stop = 1;
+    (void)pthread_cond_broadcast(&render_start_cv);
+    (void)pthread_mutex_unlock(&render_lock);
+
+    for (i = 0; i < render_workers; i++)
+        (void)pthread_join(render_thread_id[i], NULL);
+
+    (void)pthread_mutex_lock(&render_lock);
+    render_workers = 0;
+    render_started = 0;
+    render_stop = 0;
+    (void)pthread_mutex_unlock(&render_lock);
+}
+
+
+/*
+ * render_thread
+ *     DESCRIPTION: Function executed by redraw_view worker threads. Draws
+ *                  one band of the view each time a job is handed out,
+ *                  until told to stop.
+ *     INPUTS: arg -- the band drawn by this thread(1 and up)
+ *     OUTPUTS: none
+ *     RETURN VALUE: NULL
+ *     SIDE EFFECTS: draws into the build buffer
+ */
+static void* render_thread(void* arg) {
+    int band;            /* band drawn by this thread */
+    unsigned int gen;    /* last job seen             */
+
+    band = (int)(long)arg;
+    gen = 0;
+
+    (void)pthread_mutex_lock(&render_lock);
+    while (1) {
+        while (gen == render_gen && !render_stop)
+            (void)pthread_cond_wait(&render_start_cv, &render_lock);
+        if (render_stop)
+            break;
+        gen = render_gen;
+        (void)pthread_mutex_unlock(&render_lock);
+
+        /* render_workers does not change once jobs are handed out. */
+        draw_band(band, render_workers + 1);
+
+        (void)pthread_mutex_lock(&render_lock);
+        if (0 == --render_pending)
+            (void)pthread_cond_broadcast(&render_done_cv);
+    }
+    (void)pthread_mutex_unlock(&render_lock);
+    return NULL;
+}
+#endif
+
+
+/*
+ * report_render_stats
+ *     DESCRIPTION: Print the pre-rendering and video memory write
+ *                  statistics collected since mode X was started.
+ *     INPUTS: none
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: prints to stdout
+ */
+void report_render_stats() {
+    unsigned long total; /* total line draws requested          */
+    int i;               /* loop index over idle and scrolling */
+
+    total = prerender_hits + prerender_misses;
+    printf("Line draws: %lu skipped(pre-rendered), %lu drawn", prerender_hits, prerender_misses);
+    if (0 != total)
+        printf(", %lu%% hit rate", (100 * prerender_hits) / total);
+    printf("\nMargin lines pre-rendered: %lu\n", prerender_lines);
+
+    /* Video memory writes per second while idle and while scrolling. */
+    for (i = 0; i < 2; i++) {
+        printf("VRAM writes while %s: %lu bytes in %.1f s", (i ? "scrolling" : "idle"),
+               vram_bytes[i], vram_time[i]);
+        if (vram_time[i] > 0)
+            printf(" (%.0f bytes/s)", vram_bytes[i] / vram_time[i]);
+        printf("\n");
+    }
+    printf("Page flips: %lu, retrace waits: %lu(%.1f ms)\n",
+           page_flips, retrace_waits, 1000 * retrace_time);
+}
+
+
+/*
+ * margin_target
+ *     DESCRIPTION: Choose the range covered by the margin along one axis.
+ *                  The range is as large as a ring and contains the view.
+ *                  Half of the slack goes ahead of the view, plus
+ *                  PRERENDER_LOOKAHEAD moves at the most recent speed, up
+ *                  to 7/8 of the slack. Slack that would fall outside of
+ *                  the photo is given to the other side.
+ *     INPUTS: pos -- logical coordinate of the view
+ *             view -- size of the view in pixels
+ *             ring -- size of the ring in pixels
+ *             limit -- size of the photo in pixels
+ *             dir -- most recent motion(positive for increasing pos)
+ *     OUTPUTS: lo -- first pixel of the range
+ *              hi -- pixel after the last pixel of the range
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: none
+ */
+static void margin_target(int pos, int view, int ring, int limit, int dir,
+                          int* lo, int* hi) {
+    int slack; /* pixels available for the margin */
+    int ahead; /* pixels placed ahead of the view */
+
+    slack = ring - view;
+    ahead = slack / 2 + (dir < 0 ? -dir : dir) * PRERENDER_LOOKAHEAD;
+    if (ahead > (slack * 7) / 8)
+        ahead = (slack * 7) / 8;
+
+    /* Place the range, then slide it back inside the photo. */
+    *lo = pos - (dir > 0 ? slack - ahead : (dir < 0 ? ahead : slack / 2));
+    if (*lo < 0)
+        *lo = 0;
+    *hi = *lo + ring;
+    if (*hi > limit) {
+        *hi = limit;
+        *lo = (limit > ring ? limit - ring : 0);
+    }
+
+    /* The view itself is always covered(even if larger than the photo). */
+    if (*lo > pos)
+        *lo = pos;
+    if (*hi < pos + view)
+        *hi = pos + view;
+    if (*hi - *lo > ring)
+        *lo = *hi - ring;
+}
+
+
+/*
+ * extend_valid_rect
+ *     DESCRIPTION: Draw one line just outside of the rectangle of valid
+ *                  pixels and add it to the rectangle. Sides ahead of the
+ *                  most recent motion are extended first.
+ *     INPUTS:(tx0,ty0) -- upper left pixel of the target rectangle
+ *            (tx1,ty1) -- lower right(exclusive) of the target rectangle
+ *     OUTPUTS: none
+ *     RETURN VALUE: 1 if a line was drawn, or 0 if the rectangle already
+ *                   covers the target
+ *     SIDE EFFECTS: draws into the build buffer
+ */
+static int extend_valid_rect(int tx0, int ty0, int tx1, int ty1) {
+    int pass; /* 0 for sides ahead of motion, 1 for all sides */
+
+    for (pass = 0; pass < 2; pass++) {
+        if ((pass || last_dx > 0) && valid_x1 < tx1) {
+            fill_column(valid_x1, valid_y0, valid_y1);
+            valid_x1++;
+            return 1;
+        }
+        if ((pass || last_dx < 0) && valid_x0 > tx0) {
+            fill_column(valid_x0 - 1, valid_y0, valid_y1);
+            valid_x0--;
+            return 1;
+        }
+        if ((pass || last_dy > 0) && valid_y1 < ty1) {
+            fill_row(valid_x0, valid_x1, valid_y1);
+            valid_y1++;
+            return 1;
+        }
+        if ((pass || last_dy < 0) && valid_y0 > ty0) {
+            fill_row(valid_x0, valid_x1, valid_y0 - 1);
+            valid_y0--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * fill_row
+ *     DESCRIPTION: Draw part of a logical row into the build buffer, one
+ *                  view-width piece at a time.
+ *     INPUTS: x0 -- logical x of the first pixel to draw
+ *             x1 -- logical x after the last pixel(at most a ring width
+ *                   beyond x0)
+ *             y -- logical row to draw
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: draws into the build buffer
+ */
+static void fill_row(int x0, int x1, int y) {
+    unsigned char buf[SCROLL_X_DIM]; /* graphical image of a piece */
+    int x;                           /* logical x of the piece     */
+    int n;                           /* pixels used from the piece */
+
+    for (x = x0; x < x1; x += SCROLL_X_DIM) {
+        n = x1 - x;
+        if (n > SCROLL_X_DIM)
+            n = SCROLL_X_DIM;
+        (*horiz_line_fn)(x, y, buf);
+        put_horiz_pixels(x, y, buf, n);
+    }
+}
+
+
+/*
+ * fill_column
+ *     DESCRIPTION: Draw part of a logical column into the build buffer,
+ *                  one view-height piece at a time.
+ *     INPUTS: x -- logical column to draw
+ *             y0 -- logical y of the first pixel to draw
+ *             y1 -- logical y after the last pixel(at most a ring height
+ *                   beyond y0)
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: draws into the build buffer
+ */
+static void fill_column(int x, int y0, int y1) {
+    unsigned char buf[SCROLL_Y_DIM]; /* graphical image of a piece */
+    int y;                           /* logical y of the piece     */
+    int n;                           /* pixels used from the piece */
+
+    for (y = y0; y < y1; y += SCROLL_Y_DIM) {
+        n = y1 - y;
+        if (n > SCROLL_Y_DIM)
+            n = SCROLL_Y_DIM;
+        (*vert_line_fn)(x, y, buf);
+        put_vert_pixels(x, y, buf, n);
+    }
+}
+
+
+/*
+ * put_vert_pixels
+ *     DESCRIPTION: Copy part of the image of a vertical line into the
+ *                  build buffer.
+ *     INPUTS:(x,y) -- logical position of the top pixel of the line
+ *            buf -- graphical image of the line
+ *            n -- number of pixels to copy from the top of the image
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: draws into the build buffer
+ */
+static void put_vert_pixels(int x, int y, const unsigned char buf[SCROLL_Y_DIM], int n) {
+    unsigned char* plane; /* build buffer plane holding the line    */
+    int col;              /* wrapped column of the line             */
+    int row;              /* wrapped build buffer row of each pixel */
+    int i;                /* loop index over pixels                 */
+
+    /* Find the plane and column holding the line. */
+    plane = BUILD_ADDR(x & 3, 0, 0);
+    col = (x >> 2) & BUILD_X_MASK;
+
+    /* Copy image data into the plane, wrapping at the bottom of the ring. */
+    row = y & BUILD_Y_MASK;
+    for (i = 0; i < n; i++) {
+        plane[row * BUILD_X_WIDTH + col] = buf[i];
+        row = (row + 1) & BUILD_Y_MASK;
+    }
+
+    mark_dirty(x, y, 1, n);
+}
+
+
+/*
+ * put_horiz_pixels
+ *     DESCRIPTION: Copy part of the image of a horizontal line into the
+ *                  build buffer and mark the rows it changes on the
+ *                  display pages.
+ *     INPUTS:(x,y) -- logical position of the leftmost pixel of the line
+ *            buf -- graphical image of the line
+ *            n -- number of pixels to copy from the left of the image
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: draws into the build buffer
+ */
+static void put_horiz_pixels(int x, int y, const unsigned char buf[SCROLL_X_DIM], int n) {
+    store_horiz_pixels(x, y, buf, n);
+    mark_dirty(x, y, n, 1);
+}
+
+
+/*
+ * store_horiz_pixels
+ *     DESCRIPTION: Copy part of the image of a horizontal line into the
+ *                  build buffer without marking any display page rows
+ *                  as dirty. Touches no other shared state, so threads
+ *                  may store disjoint lines concurrently.
+ *     INPUTS:(x,y) -- logical position of the leftmost pixel of the line
+ *            buf -- graphical image of the line
+ *            n -- number of pixels to copy from the left of the image
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: draws into the build buffer
+ */
+static void store_horiz_pixels(int x, int y, const unsigned char buf[SCROLL_X_DIM], int n) {
+    unsigned char runs[4][SCROLL_X_WIDTH]; /* line split into plane runs */
+    int i;                                 /* loop index over plane runs */
+
+    /*
+     * Short pieces(from redraw_rect) are cheaper to store one pixel at
+     * a time than to split in full.
+     */
+    if (n < SCROLL_X_DIM / 4) {
+        for (i = 0; i < n; i++)
+            *BUILD_ADDR((x + i) & 3, (x + i) >> 2, y) = buf[i];
+        return;
+    }
+
+    /* Split the line into four runs of every fourth pixel. */
+    deinterleave_line(buf, runs);
+
+    /*
+     * Run i starts with logical pixel x + i, so the phase of x decides
+     * which build buffer plane receives it and whether it begins one
+     * address further along. Each run fills consecutive(wrapped) bytes
+     * of one row of its plane; only the first n pixels are copied.
+     */
+    for (i = 0; i < 4 && i < n; i++)
+        copy_to_ring_row((x + i) & 3, (x + i) >> 2, y, runs[i], (n - i + 3) >> 2);
+}
+
+
+/*
+ * frame_store_line
+ *     DESCRIPTION: Store one line of a pre-composed image of the logical
+ *                  view window, split into the four plane runs in the
+ *                  order used by load_frame. Only the frame is written,
+ *                  so any thread may compose a frame while the build
+ *                  buffer is in use.
+ *     INPUTS: y -- screen row of the line(0 to SCROLL_Y_DIM - 1)
+ *             buf -- graphical image of the line
+ *     OUTPUTS: frame -- the image, with the line stored
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: none
+ */
+void frame_store_line(unsigned char frame[FRAME_SIZE], int y,
+                      const unsigned char buf[SCROLL_X_DIM]) {
+    unsigned char runs[4][SCROLL_X_WIDTH]; /* line split into plane runs */
+    int i;                                 /* loop index over plane runs */
+
+    deinterleave_line(buf, runs);
+    for (i = 0; i < 4; i++)
+        (void)memcpy(frame + (i * SCROLL_Y_DIM + y) * SCROLL_X_WIDTH, runs[i],
+                     SCROLL_X_WIDTH);
+}
+
+
+/*
+ * load_frame
+ *     DESCRIPTION: Replace the logical view window with a pre-composed
+ *                  image of it(see frame_store_line), one run per row
+ *                  of each plane instead of drawing every line. The
+ *                  caller should invalidate the build buffer first if
+ *                  the view belongs to a different room.
+ *     INPUTS: frame -- image of the view at its current position
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: draws into the build buffer
+ */
+void load_frame(const unsigned char frame[FRAME_SIZE]) {
+    int i; /* loop index over plane runs */
+    int y; /* loop index over rows       */
+
+    for (i = 0; i < 4; i++) {
+        for (y = 0; y < SCROLL_Y_DIM; y++) {
+            copy_to_ring_row((show_x + i) & 3, (show_x + i) >> 2, show_y + y,
+                             frame + (i * SCROLL_Y_DIM + y) * SCROLL_X_WIDTH,
+                             SCROLL_X_WIDTH);
+        }
+    }
+    mark_dirty(show_x, show_y, SCROLL_X_DIM, SCROLL_Y_DIM);
+}
+
+
+/*
+ * draw_preview
+ *     DESCRIPTION: Fill the logical view window with a quarter-resolution
+ *                  image, each preview pixel covering four by four
+ *                  pixels. A block of four pixels is one address in every
+ *                  plane, so each preview line is copied unchanged into
+ *                  four rows of all four planes. The caller should
+ *                  invalidate the build buffer first, then replace the
+ *                  preview with full-resolution lines(see redraw_rect).
+ *     INPUTS: preview_fn -- fills a buffer with the preview pixels of the
+ *                           blocks starting at a logical(x,y) position
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: draws into the build buffer
+ */
+void draw_preview(void (*preview_fn)(int, int, unsigned char[SCROLL_X_WIDTH])) {
+    unsigned char buf[SCROLL_X_WIDTH]; /* preview pixels of a line */
+    int i;                             /* loop index over planes   */
+    int y;                             /* loop index over rows     */
+
+    for (y = 0; y < SCROLL_Y_DIM; y++) {
+        if (0 == (y & 3))
+            (*preview_fn)(show_x, show_y + y, buf);
+        for (i = 0; i < 4; i++)
+            copy_to_ring_row((show_x + i) & 3, (show_x + i) >> 2, show_y + y,
+                             buf, SCROLL_X_WIDTH);
+    }
+    mark_dirty(show_x, show_y, SCROLL_X_DIM, SCROLL_Y_DIM);
+}
+
+
+/*
+ * mark_dirty
+ *     DESCRIPTION: Record that a logical rectangle of the build buffer has
+ *                  been rewritten, marking the affected rows of each
+ *                  display page that shows part of the rectangle.
+ *     INPUTS:(x,y) -- upper left pixel of the rectangle
+ *            w, h -- width and height of the rectangle in pixels
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: changes the dirty row maps of the display pages
+ */
+static void mark_dirty(int x, int y, int w, int h) {
+    int x0, y0, x1, y1; /* rectangle clipped to the view of a page */
+    int page;           /* loop index over display pages           */
+    int i;              /* loop index over video planes            */
+    int r;              /* loop index over screen rows             */
+
+    for (page = 0; page < NUM_DISPLAY_PAGES; page++) {
+        if (!page_valid[page])
+            continue;
+
+        /* Clip to the page's view; the result is in screen coordinates. */
+        x0 = (x > page_x[page] ? x : page_x[page]) - page_x[page];
+        x1 = (x + w < page_x[page] + SCROLL_X_DIM ? x + w : page_x[page] + SCROLL_X_DIM) - page_x[page];
+        y0 = (y > page_y[page] ? y : page_y[page]) - page_y[page];
+        y1 = (y + h < page_y[page] + SCROLL_Y_DIM ? y + h : page_y[page] + SCROLL_Y_DIM) - page_y[page];
+        if (x0 >= x1 || y0 >= y1)
+            continue;
+
+        /* Screen column c is in video plane(c & 3). */
+        for (i = 0; i < 4; i++) {
+            if (x1 - x0 < 4 && ((i - x0) & 3) >= x1 - x0)
+                continue;
+            for (r = y0; r < y1; r++)
+                page_dirty[page][i][r >> 5] |= (1U << (r & 31));
+        }
+    }
+}
+
+
+/*
+ * deinterleave_line
+ *   DESCRIPTION: Split a line of pixels into the four runs used by mode X
+ *                planes: pixel i of the line goes to run (i & 3) at index
+ *                (i >> 2). SSE2 is used where the compiler allows it;
+ *                without SSE2(the default for i386 builds), a scalar loop
+ *                is used. Both versions produce identical results(checked
+ *                by TEST_DEINTERLEAVE).
+ *   INPUTS: buf -- graphical image of the line (one byte per pixel)
+ *   OUTPUTS: runs -- the four runs of SCROLL_X_WIDTH pixels
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void deinterleave_line(const unsigned char buf[SCROLL_X_DIM],
+                              unsigned char runs[4][SCROLL_X_WIDTH]) {
+#if defined(__SSE2__)
+    deinterleave_line_sse2(buf, runs);
+#else
+    deinterleave_line_scalar(buf, runs);
+#endif
+}
+
+
+#if defined(__SSE2__)
+/*
+ * deinterleave_line_sse2
+ *   DESCRIPTION: deinterleave_line with SSE2: each group of four pixels is
+ *                treated as one 32-bit lane, and a byte is pulled out for
+ *                each run with a shift, a mask, and two saturating packs
+ *                (values never exceed 255, so the packs do not saturate).
+ *   INPUTS: buf -- graphical image of the line (one byte per pixel)
+ *   OUTPUTS: runs -- the four runs of SCROLL_X_WIDTH pixels
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void deinterleave_line_sse2(const unsigned char buf[SCROLL_X_DIM],
+                                   unsigned char runs[4][SCROLL_X_WIDTH]) {
+    __m128i mask;           /* low byte of each 32-bit lane */
+    __m128i v0, v1, v2, v3; /* 64 pixels of the line        */
+    int i;                  /* loop index over pixels       */
+
+    mask = _mm_set1_epi32(0xFF);
+
+#define STORE_RUN(j)                                                        \
+    _mm_storeu_si128((__m128i*)(runs[j] + (i >> 2)), _mm_packus_epi16(      \
+        _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(v0, 8 * (j)), mask),   \
+                        _mm_and_si128(_mm_srli_epi32(v1, 8 * (j)), mask)),  \
+        _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(v2, 8 * (j)), mask),   \
+                        _mm_and_si128(_mm_srli_epi32(v3, 8 * (j)), mask))))
+
+    for (i = 0; i < SCROLL_X_DIM; i += 64) {
+        v0 = _mm_loadu_si128((const __m128i*)(buf + i));
+        v1 = _mm_loadu_si128((const __m128i*)(buf + i + 16));
+        v2 = _mm_loadu_si128((const __m128i*)(buf + i + 32));
+        v3 = _mm_loadu_si128((const __m128i*)(buf + i + 48));
+        STORE_RUN(0);
+        STORE_RUN(1);
+        STORE_RUN(2);
+        STORE_RUN(3);
+    }
+
+#undef STORE_RUN
+}
+#endif /* defined(__SSE2__) */
+
+
+#if !defined(__SSE2__) || (TEST_DEINTERLEAVE == 1)
+/*
+ * deinterleave_line_scalar
+ *   DESCRIPTION: deinterleave_line one run address at a time.
+ *   INPUTS: buf -- graphical image of the line (one byte per pixel)
+ *   OUTPUTS: runs -- the four runs of SCROLL_X_WIDTH pixels
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void deinterleave_line_scalar(const unsigned char buf[SCROLL_X_DIM],
+                                     unsigned char runs[4][SCROLL_X_WIDTH]) {
+    int i; /* loop index over run addresses */
+
+    for (i = 0; i < SCROLL_X_WIDTH; i++) {
+        runs[0][i] = buf[4 * i];
+        runs[1][i] = buf[4 * i + 1];
+        runs[2][i] = buf[4 * i + 2];
+        runs[3][i] = buf[4 * i + 3];
+    }
+}
+#endif
+
+#endif /* !defined(TEXT_RESTORE_PROGRAM) */
+
+
+/*
+ * open_memory_and_ports
+ *     DESCRIPTION: Map video memory into our address space; obtain permission
+ *                  to access VGA ports.
+ *     INPUTS: none
+ *     OUTPUTS: none
+ *     RETURN VALUE: 0 on success, -1 on failure
+ *     SIDE EFFECTS: prints an error message to stdout on failure
+ */
+static int open_memory_and_ports() {
+    int mem_fd;    /* file descriptor for physical memory image */
+
+    /* Obtain permission to access ports 0x03C0 through 0x03DA. */
+    if (ioperm(0x03C0, 0x03DA - 0x03C0 + 1, 1) == -1) {
+        perror("set port permissions");
+        return -1;
+    }
+
+    /* Open file to access physical memory. */
+    if ((mem_fd = open("/dev/mem", O_RDWR)) == -1) {
+        perror("open /dev/mem");
+        return -1;
     }
 
     /* Map video memory(0xA0000 - 0xBFFFF) into our address space. */
@@ -1027,30 +2357,81 @@ static void set_text_mode_3(int clear_scr) {
 }
 
 
+#if !defined(TEXT_RESTORE_PROGRAM)
+/*
+ * copy_to_ring_row
+ *     DESCRIPTION: Copy bytes into one row of a build buffer plane,
+ *                  wrapping around to the start of the row if necessary.
+ *     INPUTS: plane -- the build buffer plane(0 to 3)
+ *             (col,row) -- logical address and row of the first byte
+ *             src -- the bytes to be copied
+ *             len -- number of bytes to copy(at most BUILD_X_WIDTH)
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: writes into the build buffer
+ */
+static void copy_to_ring_row(int plane, int col, int row,
+                             const unsigned char* src, int len) {
+    int first;  /* number of bytes copied before wrapping */
+
+    col &= BUILD_X_MASK;
+    first = BUILD_X_WIDTH - col;
+    if (first >= len) {
+        memcpy(BUILD_ADDR(plane, col, row), src, len);
+    }
+    else {
+        memcpy(BUILD_ADDR(plane, col, row), src, first);
+        memcpy(BUILD_ADDR(plane, 0, row), src + first, len - first);
+    }
+}
+#endif /* !defined(TEXT_RESTORE_PROGRAM) */
+
+
+#if (PANNED_SCROLLING == 0)
 /*
  * copy_image
- *     DESCRIPTION: Copy one plane of a screen from the build buffer to the video memory.
- *     INPUTS: img -- a pointer to a single screen plane in the build buffer
+ *     DESCRIPTION: Copy the dirty rows of one plane of a screen from the
+ *                  build buffer to the video memory. The source is
+ *                  SCROLL_Y_DIM rows of SCROLL_X_WIDTH bytes within one
+ *                  build buffer ring, so each row is copied separately
+ *                  (in at most two pieces).
+ *     INPUTS: plane -- the build buffer plane(0 to 3)
+ *             (col,row) -- logical address and row of the upper left byte
  *             scr_addr -- the destination offset in video memory
+ *             dirty -- bit map of screen rows to be copied
  *     OUTPUTS: none
- *     RETURN VALUE: none
+ *     RETURN VALUE: number of bytes written to video memory
  *     SIDE EFFECTS: copies a plane from the build buffer to video memory
  */
-static void copy_image(unsigned char* img, unsigned short scr_addr) {
+static int copy_image(int plane, int col, int row, unsigned short scr_addr,
+                      const unsigned int dirty[DIRTY_WORDS]) {
+    unsigned char* dst; /* destination of each row in video memory */
+    int first;          /* bytes in each row before wrapping       */
+    int copied;         /* bytes written to video memory           */
+    int i;              /* loop index over rows                    */
+
     /*
-     * memcpy is actually probably good enough here, and is usually
-     * implemented using ISA-specific features like those below,
-     * but the code here provides an example of x86 string moves
+     * memcpy is good enough here; the rows are too short for the single
+     * REP MOVSB that we could use when the build buffer was linear.
      */
-    asm volatile("                                                  \n\
-        cld                                                         \n\
-        movl $16000, %%ecx                                          \n\
-        rep movsb        /* copy ECX bytes from M[ESI] to M[EDI] */ \n\
-        "
-        : /* no outputs */
-        : "S"(img), "D"(mem_image + scr_addr)
-        : "eax", "ecx", "memory"
-    );
+    col &= BUILD_X_MASK;
+    first = BUILD_X_WIDTH - col;
+    if (first > SCROLL_X_WIDTH) {
+        first = SCROLL_X_WIDTH;
+    }
+    dst = mem_image + scr_addr;
+    copied = 0;
+    for (i = 0; i < SCROLL_Y_DIM; i++, row++, dst += SCROLL_X_WIDTH) {
+        if (0 == (dirty[i >> 5] & (1U << (i & 31)))) {
+            continue;
+        }
+        memcpy(dst, BUILD_ADDR(plane, col, row), first);
+        if (first < SCROLL_X_WIDTH) {
+            memcpy(dst + first, BUILD_ADDR(plane, 0, row), SCROLL_X_WIDTH - first);
+        }
+        copied += SCROLL_X_WIDTH;
+    }
+    return copied;
 }
 
 
@@ -1079,7 +2460,517 @@ static void copy_status_bar(unsigned char* img, unsigned short scr_addr) {
         : "eax", "ecx", "memory"
     );
 }
+#endif /* PANNED_SCROLLING == 0 */
+
+
+
+#if (EMULATED_VGA)
+/*
+ * The emulated VGA: four planes of video memory, the sequencer map mask,
+ * the CRTC start address, and the attribute controller's PEL panning
+ * register(written through its index/data flip-flop). The input status
+ * register alternates between retrace and display, so that every wait
+ * for either ends at once.
+ */
+static unsigned char emu_vram[4][MODE_X_MEM_SIZE];
+static unsigned short emu_start;    /* CRTC start address          */
+static int emu_pel;                 /* PEL panning register        */
+static int emu_attr_index;          /* attribute controller index  */
+static int emu_attr_data;           /* flip-flop selects data      */
+static unsigned char emu_status;    /* input status register 1     */
+
+/*
+ * emu_set_write_mask
+ *     DESCRIPTION: Select the planes written through mem_image. Only
+ *                  clear_screens writes several planes at once; those
+ *                  writes reach only the lowest of them.
+ *     INPUTS: mask_hi_bits -- plane mask in bits 8-11
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: changes mem_image
+ */
+static void emu_set_write_mask(int mask_hi_bits) {
+    int p; /* lowest plane selected */
+
+    for (p = 0; p < 3 && 0 == (mask_hi_bits & (0x100 << p)); p++);
+    mem_image = emu_vram[p];
+}
+
+/* write a byte to an emulated port */
+static void emu_outb(int port, int val) {
+    if (0x03C0 != port)
+        return;
+    if (emu_attr_data && 0x13 == (emu_attr_index & 0x1F))
+        emu_pel = val & 0x0F;
+    else if (!emu_attr_data)
+        emu_attr_index = val;
+    emu_attr_data = !emu_attr_data;
+}
+
+/* write an index and a data byte to an emulated register */
+static void emu_outw(int port, int val) {
+    if (0x03C4 == port && 0x02 == (val & 0xFF))
+        emu_set_write_mask(val & 0x0F00);
+    else if (0x03D4 == port && 0x0C == (val & 0xFF))
+        emu_start = (emu_start & 0x00FF) | (val & 0xFF00);
+    else if (0x03D4 == port && 0x0D == (val & 0xFF))
+        emu_start = (emu_start & 0xFF00) | ((val >> 8) & 0xFF);
+}
+
+/* read an emulated port */
+static unsigned char emu_inb(int port) {
+    if (0x03DA != port)
+        return 0;
+    emu_attr_data = 0;
+    emu_status ^= 0x09;
+    return emu_status;
+}
+#endif /* EMULATED_VGA */
+
+
+#if (TEST_PANNED_SCROLLING == 1)
+
+#include <stdlib.h>
+
+#define TEST_PHOTO_X_DIM 900  /* size of the test photo    */
+#define TEST_PHOTO_Y_DIM 700
+#define TEST_MOVES       3000 /* random moves checked      */
+#define TEST_REDRAW      50   /* moves between new photos  */
+
+static int test_gen;          /* changes the photo         */
+
+/* the test photo, changed by test_gen */
+static unsigned char test_pixel(int x, int y) {
+    return (unsigned char)(x * 7 + y * 13 + ((x * y) >> 3) + test_gen);
+}
+
+static void test_horiz_line(int x, int y, unsigned char buf[SCROLL_X_DIM]) {
+    int i; /* loop index over pixels */
+
+    for (i = 0; i < SCROLL_X_DIM; i++)
+        buf[i] = test_pixel(x + i, y);
+}
+
+static void test_vert_line(int x, int y, unsigned char buf[SCROLL_Y_DIM]) {
+    int i; /* loop index over pixels */
+
+    for (i = 0; i < SCROLL_Y_DIM; i++)
+        buf[i] = test_pixel(x, y + i);
+}
+
+/*
+ * check_screen
+ *     DESCRIPTION: Compare the screen that the emulated VGA shows with
+ *                  the logical view: screen pixel sx, shifted right by the
+ *                  PEL panning value, is read from plane(sx & 3) at the
+ *                  start address plus(sx >> 2) in its row.
+ *     INPUTS: none
+ *     OUTPUTS: none
+ *     RETURN VALUE: 0 if they match, -1 if not
+ *     SIDE EFFECTS: prints the first mismatch
+ */
+static int check_screen() {
+    int sx, sy; /* screen coordinates            */
+    int x;      /* screen x after panning        */
+
+    for (sy = 0; sy < SCROLL_Y_DIM; sy++) {
+        for (sx = 0; sx < SCROLL_X_DIM; sx++) {
+            x = sx + (emu_pel >> 1);
+            if (emu_vram[x & 3][(unsigned short)(emu_start + sy * VRAM_PITCH + (x >> 2))] !=
+                test_pixel(show_x + sx, show_y + sy)) {
+                printf("screen(%d,%d) is wrong with the view at(%d,%d)\n",
+                       sx, sy, show_x, show_y);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * main -- for the panned scrolling test
+ *     DESCRIPTION: Move the view about a photo by random steps(a few of
+ *                  them long enough to leave the canvas), drawing the
+ *                  lines exposed as the game does, and now and then
+ *                  change the photo and redraw the view. The screen is
+ *                  checked after every show_screen.
+ *     INPUTS: none(command line arguments are ignored)
+ *     OUTPUTS: none
+ *     RETURN VALUE: 0 if every screen was right, 1 if not
+ */
+int main() {
+    int max_x, max_y;   /* farthest view position     */
+    int x, y;           /* view position              */
+    int d;              /* length of a move           */
+    int t;              /* loop index over moves      */
+    int i;              /* loop index over lines      */
+
+    horiz_line_fn = test_horiz_line;
+    vert_line_fn = test_vert_line;
+    mem_image = emu_vram[0];
+    clear_screens();
+
+    max_x = TEST_PHOTO_X_DIM - SCROLL_X_DIM;
+    max_y = TEST_PHOTO_Y_DIM - SCROLL_Y_DIM;
+    x = y = 0;
+    set_view_window(x, y);
+    redraw_view();
+    show_screen();
+    if (0 != check_screen())
+        return 1;
+
+    srand(3);
+    for (t = 0; t < TEST_MOVES; t++) {
+        d = 1 + rand() % (0 == rand() % 10 ? 60 : 8);
+        switch (rand() % 4) {
+            case 0:
+                if (d > y)
+                    d = y;
+                set_view_window(x, y -= d);
+                for (i = 0; i < d; i++)
+                    (void)draw_horiz_line(i);
+                break;
+            case 1:
+                if (d > max_y - y)
+                    d = max_y - y;
+                set_view_window(x, y += d);
+                for (i = 1; i <= d; i++)
+                    (void)draw_horiz_line(SCROLL_Y_DIM - i);
+                break;
+            case 2:
+                if (d > x)
+                    d = x;
+                set_view_window(x -= d, y);
+                for (i = 0; i < d; i++)
+                    (void)draw_vert_line(i);
+                break;
+            default:
+                if (d > max_x - x)
+                    d = max_x - x;
+                set_view_window(x += d, y);
+                for (i = 1; i <= d; i++)
+                    (void)draw_vert_line(SCROLL_X_DIM - i);
+                break;
+        }
+        if (TEST_REDRAW - 1 == t % TEST_REDRAW) {
+            test_gen++;
+            invalidate_build_buffer();
+            redraw_view();
+        }
+        else if (0 == rand() % 4) {
+            (void)prerender_view_margins(TEST_PHOTO_X_DIM, TEST_PHOTO_Y_DIM, 8);
+        }
+        show_screen();
+        if (0 != check_screen())
+            return 1;
+    }
+
+    printf("%d moves shown right; %lu start address changes, "
+           "%lu + %lu bytes copied(idle + scrolling)\n",
+           TEST_MOVES, page_flips, vram_bytes[0], vram_bytes[1]);
+    return 0;
+}
+
+#endif /* TEST_PANNED_SCROLLING == 1 */
+
+
+#if (TEST_RENDER_POOL == 1)
+
+#define TEST_REDRAWS 1000     /* redraws timed per count   */
+#define TEST_STOPS   500      /* pool stops during redraws */
+#define TEST_TIMEOUT 60       /* seconds before a hang fails the test */
+
+static volatile int test_stop;  /* redraw thread must exit   */
+static long test_redraws;       /* redraws by redraw thread  */
+static int test_wrong;          /* a redraw was wrong        */
+
+/* a line of a photo costing about as much per pixel as a room's */
+static void bench_horiz_line(int x, int y, unsigned char buf[SCROLL_X_DIM]) {
+    int i; /* loop index over pixels */
+
+    for (i = 0; i < SCROLL_X_DIM; i++)
+        buf[i] = (unsigned char)((x + i) * 7 + y * 13 + (((x + i) * y) >> 3));
+}
+
+static void bench_vert_line(int x, int y, unsigned char buf[SCROLL_Y_DIM]) {
+    int i; /* loop index over pixels */
+
+    for (i = 0; i < SCROLL_Y_DIM; i++)
+        buf[i] = (unsigned char)(x * 7 + (y + i) * 13 + ((x * (y + i)) >> 3));
+}
+
+/*
+ * check_build_view
+ *     DESCRIPTION: Check that every band of the view reached the build
+ *                  buffer.
+ *     INPUTS: none
+ *     OUTPUTS: none
+ *     RETURN VALUE: 0 if the view is right, -1 if not
+ *     SIDE EFFECTS: prints the first wrong row
+ */
+static int check_build_view() {
+    unsigned char buf[SCROLL_X_DIM]; /* expected line  */
+    int x, y;                        /* view pixel     */
+
+    for (y = 0; y < SCROLL_Y_DIM; y++) {
+        bench_horiz_line(show_x, show_y + y, buf);
+        for (x = 0; x < SCROLL_X_DIM; x++) {
+            if (*BUILD_ADDR((show_x + x) & 3, (show_x + x) >> 2, show_y + y) != buf[x]) {
+                printf("row %d of the view is wrong\n", y);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * test_redraw_thread
+ *     DESCRIPTION: Redraw and check the view again and again, as the game's
+ *                  display thread does, until test_stop is set.
+ *     INPUTS: arg -- ignored
+ *     OUTPUTS: none
+ *     RETURN VALUE: NULL
+ *     SIDE EFFECTS: sets test_wrong if a redraw is wrong
+ */
+static void* test_redraw_thread(void* arg) {
+    while (!test_stop) {
+        invalidate_build_buffer();
+        redraw_view();
+        if (0 != check_build_view()) {
+            test_wrong = 1;
+            break;
+        }
+        test_redraws++;
+    }
+    return NULL;
+}
+
+/*
+ * main -- for the render pool test
+ *     DESCRIPTION: Time redraw_view with each number of threads, starting
+ *                  a new pool(and joining the old one) for each, and check
+ *                  that each redraw draws the whole view. Then stop the
+ *                  pool again and again while another thread redraws, as
+ *                  clear_mode_X may, checking that neither side hangs(an
+ *                  alarm ends the test if one does) and that every
+ *                  redraw is still whole.
+ *     INPUTS: none(command line arguments are ignored)
+ *     OUTPUTS: none
+ *     RETURN VALUE: 0 if every view was right, 1 if not
+ */
+int main() {
+    static const int counts[] = {1, 2, 4, 8};
+    struct timespec start, end; /* time of the redraws           */
+    double usec;                /* average time of a redraw      */
+    int i;                      /* loop index over thread counts */
+    int n;                      /* loop index over redraws/stops */
+#if (NUM_RENDER_THREADS > 1)
+    pthread_t redraw_id;        /* thread redrawing during stops */
+#endif
+
+    horiz_line_fn = bench_horiz_line;
+    vert_line_fn = bench_vert_line;
+    printf("redraw_view with %ld processor(s) online:\n",
+           sysconf(_SC_NPROCESSORS_ONLN));
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]) &&
+                NUM_RENDER_THREADS >= counts[i]; i++) {
+#if (NUM_RENDER_THREADS > 1)
+        stop_render_threads();
+        render_limit = counts[i];
+#endif
+        set_view_window(4 * i + i, 3 * i);
+        invalidate_build_buffer();
+        redraw_view();
+        if (0 != check_build_view())
+            return 1;
+
+        (void)clock_gettime(CLOCK_MONOTONIC, &start);
+        for (n = 0; n < TEST_REDRAWS; n++) {
+            invalidate_build_buffer();
+            redraw_view();
+        }
+        (void)clock_gettime(CLOCK_MONOTONIC, &end);
+        usec = ((end.tv_sec - start.tv_sec) * 1e9 +
+                (end.tv_nsec - start.tv_nsec)) / 1e3 / TEST_REDRAWS;
+        printf("  %d thread(s): %8.1f us\n", counts[i], usec);
+    }
+#if (NUM_RENDER_THREADS > 1)
+    stop_render_threads();
+    render_limit = NUM_RENDER_THREADS;
+    (void)alarm(TEST_TIMEOUT);
+    if (0 != pthread_create(&redraw_id, NULL, test_redraw_thread, NULL))
+        return 1;
+    for (n = 0; n < TEST_STOPS && !test_wrong; n++) {
+        (void)usleep(100);
+        stop_render_threads();
+    }
+    test_stop = 1;
+    (void)pthread_join(redraw_id, NULL);
+    stop_render_threads();
+    (void)alarm(0);
+    if (test_wrong)
+        return 1;
+    printf("%d pool stops during %ld redraws by another thread\n", n,
+           test_redraws);
+#endif
+    return 0;
+}
+
+#endif /* TEST_RENDER_POOL == 1 */
+
+
+#if (TEST_DEINTERLEAVE == 1)
+
+#define TEST_LINES 2000       /* random lines stored per phase */
+
+/*
+ * scatter_line
+ *     DESCRIPTION: Store the first n pixels of a line into the build
+ *                  buffer one pixel at a time, as store_horiz_pixels did
+ *                  before lines were split into plane runs.
+ *     INPUTS: (x,y) -- leftmost pixel of line to be drawn
+ *             buf -- graphical image of the line
+ *             n -- number of pixels to store
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: draws into the build buffer
+ */
+static void scatter_line(int x, int y, const unsigned char buf[SCROLL_X_DIM], int n) {
+    int i; /* loop index over pixels */
+
+    for (i = 0; i < n; i++)
+        *BUILD_ADDR((x + i) & 3, (x + i) >> 2, y) = buf[i];
+}
+
+/*
+ * store_scalar_line
+ *     DESCRIPTION: store_horiz_pixels for a line of SCROLL_X_DIM / 4 or
+ *                  more pixels, with the scalar deinterleave_line.
+ *     INPUTS: (x,y) -- leftmost pixel of line to be drawn
+ *             buf -- graphical image of the line
+ *             n -- number of pixels to store
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: draws into the build buffer
+ */
+static void store_scalar_line(int x, int y, const unsigned char buf[SCROLL_X_DIM], int n) {
+    unsigned char runs[4][SCROLL_X_WIDTH]; /* line split into plane runs */
+    int i;                                 /* loop index over plane runs */
+
+    deinterleave_line_scalar(buf, runs);
+    for (i = 0; i < 4 && i < n; i++)
+        copy_to_ring_row((x + i) & 3, (x + i) >> 2, y, runs[i], (n - i + 3) >> 2);
+}
+
+/*
+ * check_runs
+ *     DESCRIPTION: Check runs split from a line against the line itself.
+ *     INPUTS: name -- version of deinterleave_line that split them
+ *             buf -- graphical image of the line
+ *             runs -- the four runs
+ *     OUTPUTS: none
+ *     RETURN VALUE: 0 if every pixel is in place, -1 if not
+ *     SIDE EFFECTS: prints the first misplaced pixel
+ */
+static int check_runs(const char* name, const unsigned char buf[SCROLL_X_DIM],
+                      unsigned char runs[4][SCROLL_X_WIDTH]) {
+    int i; /* loop index over pixels */
+
+    for (i = 0; i < SCROLL_X_DIM; i++) {
+        if (runs[i & 3][i >> 2] != buf[i]) {
+            printf("%s: pixel %d of the line is not in run %d\n", name, i, i & 3);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * main -- for the deinterleave test
+ *     DESCRIPTION: For each phase of x within a group of four pixels,
+ *                  store random lines at random places(including places
+ *                  where the rows wrap around the ring) with each version
+ *                  of deinterleave_line, and compare the whole build
+ *                  buffer with that left by storing one pixel at a time.
+ *                  frame_store_line is checked the same way.
+ *     INPUTS: none(command line arguments are ignored)
+ *     OUTPUTS: none
+ *     RETURN VALUE: 0 if every line matched, 1 if not
+ */
+int main() {
+    static unsigned char expect[sizeof(build)]; /* build buffer, one pixel at a time */
+    static unsigned char frame[FRAME_SIZE];     /* frame holding one line            */
+    unsigned char buf[SCROLL_X_DIM];            /* random line                       */
+    unsigned char runs[4][SCROLL_X_WIDTH];      /* line split into plane runs        */
+    int phase;                                  /* x & 3                             */
+    int line;                                   /* loop index over lines             */
+    int x, y, n;                                /* where and how much to store       */
+    int i;                                      /* loop index over pixels/runs       */
+
+    srand(1);
+    for (phase = 0; phase < 4; phase++) {
+        for (line = 0; line < TEST_LINES; line++) {
+            for (i = 0; i < SCROLL_X_DIM; i++)
+                buf[i] = (unsigned char)rand();
+            x = 4 * (rand() % (2 * BUILD_X_WIDTH)) + phase;
+            y = rand() % (2 * BUILD_Y_DIM);
+            n = SCROLL_X_DIM / 4 + rand() % (SCROLL_X_DIM - SCROLL_X_DIM / 4 + 1);
+            if (0 == (line & 1))
+                n = SCROLL_X_DIM;
+
+            /* the runs themselves */
+            deinterleave_line_scalar(buf, runs);
+            if (0 != check_runs("scalar", buf, runs))
+                return 1;
+#if defined(__SSE2__)
+            (void)memset(runs, 0, sizeof(runs));
+            deinterleave_line_sse2(buf, runs);
+            if (0 != check_runs("SSE2", buf, runs))
+                return 1;
+#endif
+
+            /* the runs placed in the build buffer */
+            (void)memset(build, line, sizeof(build));
+            scatter_line(x, y, buf, n);
+            (void)memcpy(expect, build, sizeof(build));
+
+            (void)memset(build, line, sizeof(build));
+            store_horiz_pixels(x, y, buf, n);
+            if (0 != memcmp(build, expect, sizeof(build))) {
+                printf("store_horiz_pixels(%d, %d, %d) differs from storing "
+                       "one pixel at a time\n", x, y, n);
+                return 1;
+            }
+            (void)memset(build, line, sizeof(build));
+            store_scalar_line(x, y, buf, n);
+            if (0 != memcmp(build, expect, sizeof(build))) {
+                printf("scalar store(%d, %d, %d) differs from storing one "
+                       "pixel at a time\n", x, y, n);
+                return 1;
+            }
+
+            /* the runs in the order used by load_frame */
+            y = rand() % SCROLL_Y_DIM;
+            frame_store_line(frame, y, buf);
+            for (i = 0; i < SCROLL_X_DIM; i++) {
+                if (frame[((i & 3) * SCROLL_Y_DIM + y) * SCROLL_X_WIDTH + (i >> 2)] != buf[i]) {
+                    printf("frame_store_line misplaced pixel %d of row %d\n", i, y);
+                    return 1;
+                }
+            }
+        }
+    }
+#if defined(__SSE2__)
+    printf("deinterleave_line(SSE2 and scalar) matches storing one pixel "
+           "at a time\n");
+#else
+    printf("deinterleave_line(scalar) matches storing one pixel at a time\n");
+#endif
+    return 0;
+}
 
+#endif /* TEST_DEINTERLEAVE == 1 */
 
 
 #ifdef TEXT_RESTORE_PROGRAM
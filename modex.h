@@ -124,6 +124,34 @@ extern void set_view_window(int scr_x, int scr_y);
 /* show the logical view window on the monitor */
 extern void show_screen();
 
+/* forget pre-rendered lines; call before redrawing changed contents */
+extern void invalidate_build_buffer();
+
+/* draw every line of the logical view window, using a pool of threads */
+extern void redraw_view();
+
+/* redraw a changed rectangle of the logical photo space */
+extern void redraw_rect(int x, int y, int w, int h);
+
+/* bytes in a pre-composed image of the logical view window */
+#define FRAME_SIZE (4 * SCROLL_Y_DIM * SCROLL_X_WIDTH)
+
+/* store line y of a pre-composed view image; touches only the frame */
+extern void frame_store_line(unsigned char frame[FRAME_SIZE], int y,
+                             const unsigned char buf[SCROLL_X_DIM]);
+
+/* copy a pre-composed image into the logical view window */
+extern void load_frame(const unsigned char frame[FRAME_SIZE]);
+
+/* fill the logical view window with a quarter-resolution preview */
+extern void draw_preview(void (*preview_fn)(int, int, unsigned char[SCROLL_X_WIDTH]));
+
+/* draw up to budget lines around the view; returns 0 when none remain */
+extern int prerender_view_margins(int max_x, int max_y, int budget);
+
+/* print line draw, pre-rendering, and video memory write statistics */
+extern void report_render_stats();
+
 /* clear the video memory in mode X */
 extern void clear_screens();
 
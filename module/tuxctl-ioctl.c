@@ -8,6 +8,7 @@
  * Puskar Naha 2013
  */
 
+#ifndef TUXCTL_USERSPACE
 #include <asm/current.h>
 #include <asm/uaccess.h>
 
@@ -21,6 +22,14 @@
 #include <linux/kdev_t.h>
 #include <linux/tty.h>
 #include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/hrtimer.h>
+#include <linux/mm.h>
+#include <asm/io.h>
+#include <asm/system.h>
+#else
+#include "tuxctl-user.h"
+#endif
 
 #include "tuxctl-ld.h"
 #include "tuxctl-ioctl.h"
@@ -30,84 +39,117 @@
 	printk(KERN_DEBUG "%s: " str, __FUNCTION__, ## __VA_ARGS__)
 	
 #define PUSH_BUFFER	6
+#define CLOCK_PACKET	10
+#define CLOCK_COMMANDS	6	//commands in the CLOCK_PACKET bytes
+#define ACK_TIMEOUT	(HZ / 4)	//wait for ACKs before taking them as lost
+#define SECONDS_PER_MINUTE	60
 #define WHICH_LED	0x000F0000
 #define ONE_BYTE	4
-#define TWO_BYTE	8
-#define THREE_BYTE	12
 #define FOUR_BYTE	16
 #define BUTTON_MASK1	0xF0
 #define BUTTON_MASK2	0x0F
 #define LED_MASK1	0x1
 #define LED_MASK2	0xF
-#define LED1	0x2
-#define LED2	0x4
-#define LED3	0x8
 #define LED0_SHIFT	24
-#define LED1_SHIFT	25
-#define LED2_SHIFT	26
-#define LED3_SHIFT	27
-#define VAL_MASK	0xFF
 #define LAYER0	0
 #define LAYER1	1
 #define LAYER2	2
-#define LAYER3	3
-#define LAYER4	4
-#define LAYER5	5
-#define VAL0	0x000000F7
-#define VAL1	0x00000016
-#define VAL2	0x000000DB
-#define VAL3	0x0000009F
-#define VAL4	0x0000003E
-#define VAL5	0x000000BD
-#define VAL6	0x000000FD
-#define VAL7	0x00000096
-#define VAL8	0x000000FF
-#define VAL9	0x000000BE
-#define VALA	0x000000FE
-#define VALB	0x0000007D
-#define VALC	0x000000F1
-#define VALD	0x0000005F
-#define VALE	0x000000F9
-#define VALF	0x000000F8
-
-#define VALL1	0x000000E7
-#define VALL2	0x00000006
-#define VALL3	0x000000CB
-#define VALL4	0x0000008F
-#define VALL5	0x0000002E
-#define VALL6	0x000000AD
-#define VALL7	0x000000ED
-#define VALL8	0x00000086
-#define VALL9	0x000000EF
-#define VALL10	0x000000AE
-#define VALLA	0x000000EE
-#define VALLB	0x0000006D
-#define VALLC	0x000000E1
-#define VALLD	0x0000004F
-#define VALLE	0x000000E9	
-#define VALLF	0x000000E8
 
+/* set to 1 to time each hold of the device lock(read by TUX_GET_STATS) */
+#ifndef TUXCTL_LOCK_STATS
+#define TUXCTL_LOCK_STATS 0
+#endif
 
+/* seven-segment patterns for the hex digits, without and with the decimal
+ * point; the bits are A E F dp G C B D, as described in mtcp.h */
+static const unsigned char seven_seg[2][16] = {
+	{0xE7, 0x06, 0xCB, 0x8F, 0x2E, 0xAD, 0xED, 0x86,
+	 0xEF, 0xAE, 0xEE, 0x6D, 0xE1, 0x4F, 0xE9, 0xE8},
+	{0xF7, 0x16, 0xDB, 0x9F, 0x3E, 0xBD, 0xFD, 0x96,
+	 0xFF, 0xBE, 0xFE, 0x7D, 0xF1, 0x5F, 0xF9, 0xF8}
+};
 
+/* State of the controller, all protected by its one lock. The lock is held
+ * only to read or change the state and to queue the packets that the change
+ * calls for, so that packets reach the device in the order of the changes;
+ * LED packets are encoded before it is taken.
+ *
+ * The device ACKs every command that it carries out, so acks_owed counts
+ * the commands sent and not yet ACKed. An LED value set while any are
+ * outstanding waits in led_packet(replacing any value already waiting) and
+ * is sent when the last ACK arrives; values already on the device are not
+ * resent. An ACK can be lost on the line(a packet dropped to resync the
+ * receiver, say), so once ACK_TIMEOUT has passed since the last command
+ * was queued, the ACKs still owed are given up; the next packet from the
+ * device or TUX_SET_LED then sends the value waiting. A value that could
+ * not be queued(the line discipline being full) also stays waiting. */
+typedef struct tuxctl_dev {
+	spinlock_t lock;
+	unsigned char button;	//latest button bitmap(a bit is clear while pressed)
+	unsigned char led_packet[PUSH_BUFFER];	//MTCP_LED_SET packet for led_value
+	int led_len;	//bytes in led_packet; 0 until an LED value is set
+	unsigned int acks_owed;	//commands sent and not yet ACKed
+	unsigned long last_put;	//jiffies when a command was last queued
+	unsigned int led_pending;	//led_packet waits for the ACKs
+	unsigned long led_value;	//latest value set, for TUX_READ_LED
+	unsigned long led_shown;	//value last sent to the device
+	unsigned int clock_mode;	//LEDs show the controller's own clock
+	unsigned long clock_secs;	//clock value when it was started
+	unsigned long clock_start;	//jiffies when it was started
+	struct tux_stats stats;	//for TUX_GET_STATS
+	struct tux_state *state;	//page mapped from TUX_STATE_DEV
+#if (TUXCTL_LOCK_STATS == 1)
+	ktime_t lock_start;	//time at which the lock was taken
+#endif
+} tuxctl_dev_t;
 
-	
-//global variables below
-	//static unsigned long led_state;	//keeps track of the LED status
-	uint8_t button;
-	unsigned char buffer[6];	//declare a buffer that of size 6 to hold the LED bits
-	unsigned char bioc;
-	unsigned char led;
-	
-	unsigned int flag = 0;
-	
-	static spinlock_t button_lock = SPIN_LOCK_UNLOCKED;
-	static spinlock_t led_lock = SPIN_LOCK_UNLOCKED;
-	static spinlock_t flag_lock = SPIN_LOCK_UNLOCKED;
+static tuxctl_dev_t tux = {
+	.lock = SPIN_LOCK_UNLOCKED,
+	.button = 0xFF,	//no buttons pressed until the first report
+};
+
+#if (TUXCTL_LOCK_STATS == 1)
+#define tux_lock(flags) do {	\
+	spin_lock_irqsave(&tux.lock, flags);	\
+	tux.lock_start = ktime_get();	\
+} while (0)
+#define tux_unlock(flags) do {	\
+	tuxctl_lock_held();	\
+	spin_unlock_irqrestore(&tux.lock, flags);	\
+} while (0)
+static void tuxctl_lock_held(void);
+#else
+#define tux_lock(flags) spin_lock_irqsave(&tux.lock, flags)
+#define tux_unlock(flags) spin_unlock_irqrestore(&tux.lock, flags)
+#endif
 
 
 int tuxctl_ioctl_tux_set_led(struct tty_struct *tty, unsigned long arg);
-//helper function to set LED
-unsigned long determin_val(unsigned long val, unsigned long dp);
+int tuxctl_ioctl_tux_read_led(struct tty_struct *tty, unsigned long arg);
+static int tuxctl_encode_led(unsigned long arg, unsigned char *packet);
+static void tuxctl_send_led(struct tty_struct *tty);
+static void tuxctl_flush_led(struct tty_struct *tty);
+int tuxctl_ioctl_tux_get_events(struct tty_struct *tty, unsigned long arg);
+int tuxctl_ioctl_tux_set_clock(struct tty_struct *tty, unsigned long arg);
+int tuxctl_ioctl_tux_get_stats(struct tty_struct *tty, unsigned long arg);
+int tuxctl_ioctl_tux_get_ld_stats(struct tty_struct *tty, unsigned long arg);
+static void tuxctl_put_clock(struct tty_struct *tty, unsigned long secs);
+static int tuxctl_put_commands(struct tty_struct *tty, const unsigned char *buf,
+				int len, int commands);
+static void tuxctl_publish_buttons(unsigned char buttons, unsigned long long time);
+static int tuxctl_state_mmap(struct file *file, struct vm_area_struct *vma);
+
+/* TUX_STATE_DEV, through which the state page is mapped */
+static const struct file_operations tuxctl_state_fops = {
+	.owner = THIS_MODULE,
+	.mmap = tuxctl_state_mmap,
+};
+
+static struct miscdevice tuxctl_state_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "tuxctl",
+	.fops = &tuxctl_state_fops,
+};
 
 /************************ Protocol Implementation *************************/
 
@@ -119,6 +161,10 @@ unsigned long determin_val(unsigned long val, unsigned long dp);
 void tuxctl_handle_packet (struct tty_struct* tty, unsigned char* packet)	
 {
     unsigned a, b, c;
+	unsigned char state;	//button bitmap reported
+	unsigned char cmd;	//single-byte command to send
+	unsigned long secs;	//clock value to restore after a reset
+	unsigned long long now;	//time of a button report
 	unsigned long flags;
 
     a = packet[0]; /* Avoid printk() sign extending the 8-bit */
@@ -127,34 +173,45 @@ void tuxctl_handle_packet (struct tty_struct* tty, unsigned char* packet)
 
     /*printk("packet : %x %x %x\n", a, b, c); */
 	switch(a){
-		case MTCP_ACK:	//set flag here
-			spin_lock_irqsave(&flag_lock, flags);
-			flag = 0;
-			spin_unlock_irqrestore(&flag_lock, flags);
+		case MTCP_ACK:	//send the LED value that waited for the last ACK
+		case MTCP_ERROR:	//a command refused is answered all the same
+			tux_lock(flags);
+			if(tux.acks_owed > 0){
+				tux.acks_owed--;
+			}
+			tuxctl_flush_led(tty);
+			tux_unlock(flags);
 			return;
 			
 		case MTCP_BIOC_EVENT:	//check button status
-			spin_lock_irqsave(&button_lock, flags);
-			button = ((c<<ONE_BYTE)&BUTTON_MASK1) | (b&BUTTON_MASK2);
-			spin_unlock_irqrestore(&button_lock, flags);
+			state = ((c<<ONE_BYTE)&BUTTON_MASK1) | (b&BUTTON_MASK2);
+			now = ktime_to_ns(ktime_get());
+			tux_lock(flags);
+			tux.button = state;
+			tuxctl_publish_buttons(state, now);	//for readers of the state page
+			tuxctl_flush_led(tty);	//in case the ACKs were lost
+			tux_unlock(flags);
+			tuxctl_ldisc_put_event(tty, state, now);	//queue for TUX_GET_EVENTS and read
 			return;
 			
 		case MTCP_RESET:	//reset the game to initial state
-			bioc = MTCP_BIOC_ON;
-			led = MTCP_LED_USR;
-			tuxctl_ldisc_put(tty, &bioc, 1);	//reset button
-			tuxctl_ldisc_put(tty, &led, 1);		//reset LED
-			
-			spin_lock_irqsave(&flag_lock, flags);
-			if(flag==1){
-				spin_unlock_irqrestore(&flag_lock, flags);
-				return;
+			tux_lock(flags);
+			tux.acks_owed = 0;	//the device has forgotten any command in flight
+			cmd = MTCP_BIOC_ON;
+			tuxctl_put_commands(tty, &cmd, 1, 1);	//reset button
+			if(tux.clock_mode){	//restart the clock at the time it would show
+				tux.led_pending = 0;
+				secs = tux.clock_secs + (jiffies - tux.clock_start) / HZ;
+				tuxctl_put_clock(tty, secs > TUX_CLOCK_MAX ? TUX_CLOCK_MAX : secs);
 			}
-			spin_unlock_irqrestore(&flag_lock, flags);
-			
-			spin_lock_irqsave(&led_lock, flags);
-			tuxctl_ldisc_put(tty, buffer, PUSH_BUFFER);	//set the LED
-			spin_unlock_irqrestore(&led_lock, flags);
+			else{
+				cmd = MTCP_LED_USR;
+				tuxctl_put_commands(tty, &cmd, 1, 1);	//reset LED
+				if(tux.led_len > 0){	//restore the latest value set
+					tuxctl_send_led(tty);
+				}
+			}
+			tux_unlock(flags);
 			return;	
 		default:
 			return;	
@@ -178,25 +235,39 @@ int
 tuxctl_ioctl (struct tty_struct* tty, struct file* file, 	
 	      unsigned cmd, unsigned long arg)
 {
+	unsigned char init[2] = {MTCP_BIOC_ON, MTCP_LED_USR};
+	unsigned char button;
 	unsigned long flags;
 	
     switch (cmd) {
 		case TUX_INIT:
-			bioc = MTCP_BIOC_ON;
-			led = MTCP_LED_USR;
-			tuxctl_ldisc_put(tty, &bioc, 1);
-			tuxctl_ldisc_put(tty, &led, 1);
+			tux_lock(flags);
+			tuxctl_put_commands(tty, init, 2, 2);
+			tux_unlock(flags);
 			return 0;
 		case TUX_BUTTONS:
 			if(arg==0){
 				return -EINVAL;
 			}
-			spin_lock_irqsave(&button_lock, flags);
-			copy_to_user((void*)arg, &button, 1);	//copy to user
-			spin_unlock_irqrestore(&button_lock, flags);
+			tux_lock(flags);
+			button = tux.button;
+			tux_unlock(flags);
+			if(copy_to_user((void*)arg, &button, 1)){	//copy to user
+				return -EFAULT;
+			}
 			return 0;
 		case TUX_SET_LED:
 			return tuxctl_ioctl_tux_set_led(tty, arg);	//set the led
+		case TUX_READ_LED:
+			return tuxctl_ioctl_tux_read_led(tty, arg);	//read the led value set
+		case TUX_GET_EVENTS:
+			return tuxctl_ioctl_tux_get_events(tty, arg);	//drain button reports
+		case TUX_SET_CLOCK:
+			return tuxctl_ioctl_tux_set_clock(tty, arg);	//let the controller count
+		case TUX_GET_STATS:
+			return tuxctl_ioctl_tux_get_stats(tty, arg);	//read driver statistics
+		case TUX_GET_LD_STATS:
+			return tuxctl_ioctl_tux_get_ld_stats(tty, arg);	//read serial line statistics
 		default:
 			return -EINVAL;
     }
@@ -205,209 +276,400 @@ tuxctl_ioctl (struct tty_struct* tty, struct file* file,
 
 /*
  * tuxctl_ioctl_tux_set_led
- *   DESCRIPTION: Set the led
- *   INPUTS: none
+ *   DESCRIPTION: Set the led. If the device has not yet ACKed every
+ *                command sent, the new value replaces any value waiting and
+ *                is sent when the last ACK arrives(or the ACKs time out);
+ *                a value already shown is not sent again
+ *   INPUTS: arg -- LED values, which LEDs to set, and decimal points
  *   OUTPUTS: 0
  *   SIDE EFFECTS: Enable the LED to be turned on and off
  */
 int tuxctl_ioctl_tux_set_led(struct tty_struct *tty, unsigned long arg){	
 	
-	unsigned long which_led;
-	unsigned long led0, led1, led2, led3;
-	unsigned long dp_temp;
-	uint8_t val_on_buf;
+	unsigned char packet[PUSH_BUFFER];
+	int len;
 	unsigned long flags;
 	
-	buffer[LAYER0] = MTCP_LED_SET;	//opcode
+	len = tuxctl_encode_led(arg, packet);	//encode before taking the lock
 	
-	which_led = (arg & WHICH_LED);	//which LED should be turned on
-	which_led = which_led >> FOUR_BYTE;	//now the lowest four bits
-	buffer[LAYER1] = which_led;	
-
-	spin_lock_irqsave(&led_lock, flags);
-	if((which_led & LED_MASK1)){	//if LED0 is on
-		led0 = (arg & LED_MASK2);	//value of LED0
-		dp_temp = ((arg>>LED0_SHIFT)&LED_MASK1);
-		val_on_buf = determine_val(led0, dp_temp);	//determine the bits to be written on the buffer for LED0 
-		buffer[LAYER2] = val_on_buf&VAL_MASK;	//write the bits on the buffer
-		spin_unlock_irqrestore(&led_lock, flags);
+	tux_lock(flags);
+	if(!tux.clock_mode && tux.led_len > 0 && arg == tux.led_value){
+		tux.stats.led_coalesced++;	//already shown, or about to be
 	}
-	
-	spin_lock_irqsave(&led_lock, flags);
-	if((which_led & LED1)){	//if LED1 is on 
-		led1 = ((arg>>ONE_BYTE) & LED_MASK2);	//value of LED1
-		dp_temp = ((arg>>LED1_SHIFT)&LED_MASK1);
-		val_on_buf = determine_val(led1, dp_temp);	//determine the bits to be written on the buffer for LED1
-		buffer[LAYER3] = val_on_buf&VAL_MASK;	//write the bits on the buffer
-		spin_unlock_irqrestore(&led_lock, flags);
-	}	
-	
-	spin_lock_irqsave(&led_lock, flags);
-	if((which_led & LED2)){	//if LED2 is on
-		led2 = ((arg>>TWO_BYTE) & LED_MASK2);	//value of LED0
-		dp_temp = ((arg>>LED2_SHIFT)&LED_MASK1);
-		val_on_buf = determine_val(led2, dp_temp);	//determine the bits to be written on the buffer for LED2
-		buffer[LAYER4] = val_on_buf&VAL_MASK;	//write the bits on the buffer
-		spin_unlock_irqrestore(&led_lock, flags);
+	else{
+		if(tux.led_pending){
+			tux.stats.led_coalesced++;	//replaces the value waiting
+		}
+		memcpy(tux.led_packet, packet, len);
+		tux.led_len = len;
+		tux.led_value = arg;
+		tux.led_pending = 1;
 	}
-	
-	spin_lock_irqsave(&led_lock, flags);
-	if((which_led & LED3)){	//if LED3 is on
-		led3 = ((arg>>THREE_BYTE) & LED_MASK2);	//value of LED0
-		dp_temp = ((arg>>LED3_SHIFT)&LED_MASK1);
-		val_on_buf = determine_val(led3, dp_temp);	//determine the bits to be written on the buffer for LED3
-		buffer[LAYER5] = val_on_buf&VAL_MASK;	//write the bits on the buffer
-		spin_unlock_irqrestore(&led_lock, flags);
-	}	
-	
-	spin_lock_irqsave(&flag_lock, flags);
-	if(flag == 1){
-		spin_unlock_irqrestore(&flag_lock, flags);
+	tuxctl_flush_led(tty);	//send now unless ACKs are owed
+	tux_unlock(flags);
+	return 0;
+}
+
+/*
+ * tuxctl_ioctl_tux_read_led
+ *   DESCRIPTION: Read the latest LED value set
+ *   INPUTS: arg -- user pointer to an unsigned long
+ *   OUTPUTS: 0, or -EINVAL/-EFAULT for a bad pointer
+ *   SIDE EFFECTS: None
+ */
+int tuxctl_ioctl_tux_read_led(struct tty_struct *tty, unsigned long arg){
+
+	unsigned long value;
+	unsigned long flags;
+
+	if(arg==0){
 		return -EINVAL;
 	}
-	else{
-		flag = 1;
+	tux_lock(flags);
+	value = tux.led_value;
+	tux_unlock(flags);
+	if(copy_to_user((void*)arg, &value, sizeof(value))){	//copy to user
+		return -EFAULT;
 	}
-	spin_unlock_irqrestore(&flag_lock, flags);
-	
-
-	spin_lock_irqsave(&led_lock, flags);
-	tuxctl_ldisc_put(tty,buffer,6);	//Write bytes out to the device
-	spin_unlock_irqrestore(&led_lock, flags);
 	return 0;
-	
-	
-	
 }
 
 /*
- * determine_val
- *   DESCRIPTION: Helper function for set led. Determin the bits for each LED
- *   INPUTS: Value to be displayed for each LED, decimal point val
- *   OUTPUTS: Bits set for each LED
+ * tuxctl_encode_led
+ *   DESCRIPTION: Helper function for set led. Build the MTCP_LED_SET packet,
+ *                with one byte for each LED to be set
+ *   INPUTS: arg -- LED values, which LEDs to set, and decimal points
+ *   OUTPUTS: packet -- the packet(up to PUSH_BUFFER bytes)
+ *   RETURN VALUE: length of the packet
  *   SIDE EFFECTS: None
  */
-unsigned long determine_val(unsigned long val, unsigned long dp_temp){	
+static int tuxctl_encode_led(unsigned long arg, unsigned char *packet){
 
-	unsigned long flags;
-	
-	spin_lock_irqsave(&led_lock, flags);
-	if(dp_temp == 1){	//if decimal point is 1
-		switch(val){
-			case(0x0):	//value is 0
-				val = VAL0;
-				break;
-			case(0x1):	//value is 1
-				val = VAL1;
-				break;
-			case(0x2):	//value is 2
-				val = VAL2;
-				break;
-			case(0x3):	//value is 3
-				val = VAL3;
-				break;
-			case(0x4):	//value is 4
-				val = VAL4;
-				break;
-			case(0x5):	//value is 5
-				val = VAL5;
-				break;
-			case(0x6):	//value is 6
-				val = VAL6;
-				break;
-			case(0x7):	//value is 7
-				val = VAL7;
-				break;
-			case(0x8):	//value is 8
-				val = VAL8;
-				break;
-			case(0x9):	//value is 9
-				val = VAL9;
-				break;
-				
-			case(0xA):	//value is A
-				val = VALA;
-				break;
-			case(0xB):	//value is B
-				val = VALB;
-				break;
-			case(0xC):	//value is C
-				val = VALC;
-				break;
-			case(0xD):	//value is D
-				val =VALD;
-				break;
-			case(0xE):	//value is E
-				val = VALE;
-				break;
-			case(0xF):	//value is F
-				val = VALF;
-				break;
-			default:
-				return 0x0;
+	unsigned long which_led;
+	int i, len;
+
+	which_led = (arg & WHICH_LED) >> FOUR_BYTE;	//which LEDs to set
+	packet[LAYER0] = MTCP_LED_SET;	//opcode
+	packet[LAYER1] = which_led;
+	for(len = LAYER2, i = 0; i < 4; i++){
+		if(which_led & (1 << i)){	//one byte per LED, in order
+			packet[len++] = seven_seg[(arg >> (LED0_SHIFT + i)) & LED_MASK1]
+						 [(arg >> (i * ONE_BYTE)) & LED_MASK2];
 		}
-		spin_unlock_irqrestore(&led_lock, flags);
-		return val;
 	}
-	
-	spin_lock_irqsave(&led_lock, flags);
-	if(dp_temp == 0){	//if decimal point is 0
-		switch(val){
-			case(0x0):	//value is 0
-				val = VALL1;
-				break;
-			case(0x1):	//value is 1
-				val = VALL2;
-				break;
-			case(0x2):	//value is 2
-				val = VALL3;
-				break;
-			case(0x3):	//value is 3
-				val = VALL4;
-				break;
-			case(0x4):	//value is 4
-				val = VALL5;
-				break;
-			case(0x5):	//value is 5
-				val = VALL6;
-				break;
-			case(0x6):	//value is 6
-				val = VALL7;
-				break;
-			case(0x7):	//value is 7
-				val = VALL8;
-				break;
-			case(0x8):	//value is 8
-				val = VALL9;
-				break;
-			case(0x9):	//value is 9
-				val = VALL10;
-				break;
-				
-			case(0xA):	//value is A
-				val = VALLA;
-				break;
-			case(0xB):	//value is B
-				val =VALLB;
-				break;
-			case(0xC):	//value is C
-				val =VALLC;
-				break;
-			case(0xD):	//value is D
-				val =VALLD;
-				break;
-			case(0xE):	//value is E
-				val =VALLE;
-				break;
-			case(0xF):	//value is F
-				val =VALLF;
-				break;
-			default:
-				return 0x0;
+	return len;
+}
+
+/*
+ * tuxctl_send_led
+ *   DESCRIPTION: Helper function for set led. Send the LED packet for the
+ *                latest value set, leaving clock mode first. Called with
+ *                the device lock held
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   SIDE EFFECTS: The ACKs for the packet are now owed; if the line
+ *                 discipline has no room, the value stays waiting
+ */
+static void tuxctl_send_led(struct tty_struct *tty){
+
+	unsigned char cmd = MTCP_LED_USR;
+
+	tux.led_pending = 1;
+	if(tux.clock_mode){	//show the value set rather than the clock
+		if(0 != tuxctl_put_commands(tty, &cmd, 1, 1)){
+			return;
 		}
-		spin_unlock_irqrestore(&led_lock, flags);
-		return val;
+		tux.clock_mode = 0;
+	}
+	if(0 != tuxctl_put_commands(tty, tux.led_packet, tux.led_len, 1)){	//Write bytes out to the device
+		return;
+	}
+	tux.led_shown = tux.led_value;
+	tux.led_pending = 0;
+	tux.stats.led_sent++;
+}
+
+/*
+ * tuxctl_flush_led
+ *   DESCRIPTION: Helper function for set led. Send the value waiting once
+ *                no ACKs are owed, giving up on ACKs owed for ACK_TIMEOUT
+ *                since the last command was queued; a value that is
+ *                already shown is not sent. Called with the device lock
+ *                held
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   SIDE EFFECTS: May send the LED packet
+ */
+static void tuxctl_flush_led(struct tty_struct *tty){
+
+	if(tux.acks_owed > 0 && time_after(jiffies, tux.last_put + ACK_TIMEOUT)){
+		tux.acks_owed = 0;	//lost on the line
+		tux.stats.ack_timeouts++;
+	}
+	if(!tux.led_pending || tux.acks_owed > 0){
+		return;
+	}
+	if(!tux.clock_mode && tux.led_value == tux.led_shown){
+		tux.led_pending = 0;	//set back to the value shown
+		return;
+	}
+	tuxctl_send_led(tty);
+}
+
+/*
+ * tuxctl_ioctl_tux_set_clock
+ *   DESCRIPTION: Show the controller's clock on the LEDs, counting up from
+ *                a given time, so that the LEDs need no further updates
+ *   INPUTS: arg -- seconds at which to start the clock
+ *   OUTPUTS: 0, or -EINVAL if arg exceeds TUX_CLOCK_MAX
+ *   SIDE EFFECTS: Sends the clock commands to the device
+ */
+int tuxctl_ioctl_tux_set_clock(struct tty_struct *tty, unsigned long arg){
+
+	unsigned long flags;
+
+	if(arg > TUX_CLOCK_MAX){
+		return -EINVAL;
+	}
+	tux_lock(flags);
+	tux.clock_mode = 1;
+	tux.led_pending = 0;	//the clock replaces any value waiting
+	tux.clock_secs = arg;
+	tux.clock_start = jiffies;
+	tuxctl_put_clock(tty, arg);
+	tux_unlock(flags);
+	return 0;
+}
+
+/*
+ * tuxctl_put_clock
+ *   DESCRIPTION: Helper function for set clock. Set the clock, count it up
+ *                and show it on the LEDs
+ *   INPUTS: secs -- seconds at which to start the clock
+ *   OUTPUTS: none
+ *   SIDE EFFECTS: Sends the clock commands to the device
+ */
+static void tuxctl_put_clock(struct tty_struct *tty, unsigned long secs){
+
+	unsigned char packet[CLOCK_PACKET] = {
+		MTCP_CLK_STOP, MTCP_CLK_UP,
+		MTCP_CLK_SET, secs / SECONDS_PER_MINUTE, secs % SECONDS_PER_MINUTE,
+		MTCP_CLK_MAX, TUX_CLOCK_MAX / SECONDS_PER_MINUTE, TUX_CLOCK_MAX % SECONDS_PER_MINUTE,
+		MTCP_LED_CLK, MTCP_CLK_RUN
+	};
+
+	tuxctl_put_commands(tty, packet, CLOCK_PACKET, CLOCK_COMMANDS);
+}
+
+/*
+ * tuxctl_put_commands
+ *   DESCRIPTION: Queue whole commands for the device and count the ACKs
+ *                that they will bring. Called with the device lock held,
+ *                so that the count and the line agree
+ *   INPUTS: buf -- the command bytes
+ *           len -- number of bytes
+ *           commands -- number of commands in them
+ *   OUTPUTS: 0 if queued, -1 if not
+ *   SIDE EFFECTS: Nothing is sent, or owed, if the line discipline lacks
+ *                 room for all of it
+ */
+static int tuxctl_put_commands(struct tty_struct *tty, const unsigned char *buf,
+				int len, int commands){
+
+	if(0 != tuxctl_ldisc_put(tty, (const char*)buf, len)){
+		return -1;
+	}
+	tux.acks_owed += commands;
+	tux.last_put = jiffies;
+	return 0;
+}
+
+/*
+ * tuxctl_ioctl_tux_get_events
+ *   DESCRIPTION: Take the waiting button reports, oldest first, without
+ *                waiting for more
+ *   INPUTS: arg -- user pointer to a struct tux_events
+ *   OUTPUTS: 0, or -EINVAL/-EFAULT for a bad pointer
+ *   SIDE EFFECTS: Empties up to TUX_MAX_EVENTS reports from the ring
+ */
+int tuxctl_ioctl_tux_get_events(struct tty_struct *tty, unsigned long arg){
+
+	struct tux_events evs;
+
+	if(arg==0){
+		return -EINVAL;
+	}
+	evs.count = tuxctl_ldisc_get_events(tty, evs.event, TUX_MAX_EVENTS, &evs.lost);
+	if(copy_to_user((void*)arg, &evs, sizeof(evs))){	//copy to user
+		return -EFAULT;
+	}
+	return 0;
+}
+
+/*
+ * tuxctl_ioctl_tux_get_stats
+ *   DESCRIPTION: Read the driver's statistics
+ *   INPUTS: arg -- user pointer to a struct tux_stats
+ *   OUTPUTS: 0, or -EINVAL/-EFAULT for a bad pointer
+ *   SIDE EFFECTS: None
+ */
+int tuxctl_ioctl_tux_get_stats(struct tty_struct *tty, unsigned long arg){
+
+	struct tux_stats stats;
+	unsigned long flags;
+
+	if(arg==0){
+		return -EINVAL;
+	}
+	tux_lock(flags);
+	stats = tux.stats;
+	tux_unlock(flags);
+	if(copy_to_user((void*)arg, &stats, sizeof(stats))){	//copy to user
+		return -EFAULT;
+	}
+	return 0;
+}
+
+/*
+ * tuxctl_ioctl_tux_get_ld_stats
+ *   DESCRIPTION: Read the line discipline's byte and packet counters
+ *   INPUTS: arg -- user pointer to a struct tux_ld_stats
+ *   OUTPUTS: 0, or -EINVAL/-EFAULT for a bad pointer
+ *   SIDE EFFECTS: None
+ */
+int tuxctl_ioctl_tux_get_ld_stats(struct tty_struct *tty, unsigned long arg){
+
+	struct tux_ld_stats stats;
+
+	if(arg==0){
+		return -EINVAL;
+	}
+	tuxctl_ldisc_get_stats(tty, &stats);
+	if(copy_to_user((void*)arg, &stats, sizeof(stats))){	//copy to user
+		return -EFAULT;
+	}
+	return 0;
+}
+
+/*
+ * tuxctl_publish_buttons
+ *   DESCRIPTION: Write a button report to the state page, making its
+ *                sequence count odd while the page changes so that readers
+ *                retry. Called with the device lock held, which keeps
+ *                writers apart
+ *   INPUTS: buttons -- button bitmap reported
+ *           time -- time of the report in nanoseconds(as ktime_get)
+ *   OUTPUTS: none
+ *   SIDE EFFECTS: Changes the state page
+ */
+static void tuxctl_publish_buttons(unsigned char buttons, unsigned long long time){
+
+	struct tux_state *state = tux.state;
+
+	if(state == NULL){
+		return;
+	}
+	state->seq++;
+	smp_wmb();
+	state->buttons = buttons;
+	state->time = time;
+	smp_wmb();
+	state->seq++;
+}
+
+/*
+ * tuxctl_state_mmap
+ *   DESCRIPTION: Map the state page, read-only, for TUX_STATE_DEV. The
+ *                mapping takes its own reference to the page, so the page
+ *                outlives the module if it is still mapped at unload
+ *   INPUTS: vma -- one page at offset 0, not writable
+ *   OUTPUTS: 0, -EINVAL for another size or offset, -EPERM if writable,
+ *            or -ENODEV once the page is gone
+ *   SIDE EFFECTS: Maps the page into the caller
+ */
+static int tuxctl_state_mmap(struct file *file, struct vm_area_struct *vma){
+
+	struct tux_state *state = tux.state;
+
+	if(vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE){
+		return -EINVAL;
+	}
+	if(vma->vm_flags & VM_WRITE){
+		return -EPERM;
+	}
+	if(state == NULL){
+		return -ENODEV;
+	}
+	vma->vm_flags &= ~VM_MAYWRITE;	//nor by mprotect later
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(state));
+}
+
+/*
+ * tuxctl_state_init
+ *   DESCRIPTION: Allocate the state page and register TUX_STATE_DEV
+ *   INPUTS: none
+ *   OUTPUTS: 0, or a negative error
+ *   SIDE EFFECTS: No buttons are pressed until the first report
+ */
+int tuxctl_state_init(void){
+
+	struct tux_state *state;
+	int err;
+
+	if(!(state = (struct tux_state*)get_zeroed_page(GFP_KERNEL))){
+		return -ENOMEM;
+	}
+	state->buttons = 0xFF;
+	tux.state = state;
+
+	if((err = misc_register(&tuxctl_state_dev))){
+		tux.state = NULL;	//never registered, so never mapped
+		free_page((unsigned long)state);
+	}
+	return err;
+}
+
+/*
+ * tuxctl_state_exit
+ *   DESCRIPTION: Drop the driver's reference to the state page. Mappings
+ *                still open keep their own, and the page is freed when the
+ *                last of them is unmapped
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   SIDE EFFECTS: Removes TUX_STATE_DEV; reports no longer reach the page
+ */
+void tuxctl_state_exit(void){
+
+	struct tux_state *state = tux.state;
+	unsigned long flags;
+
+	if(state == NULL){
+		return;
+	}
+	misc_deregister(&tuxctl_state_dev);
+	tux_lock(flags);
+	tux.state = NULL;
+	tux_unlock(flags);
+	free_page((unsigned long)state);
+}
+
+#if (TUXCTL_LOCK_STATS == 1)
+/*
+ * tuxctl_lock_held
+ *   DESCRIPTION: Record the time for which the device lock has been held.
+ *                Called by tux_unlock just before the lock is released
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   SIDE EFFECTS: Updates the lock statistics
+ */
+static void tuxctl_lock_held(void){
+
+	unsigned long long ns = ktime_to_ns(ktime_sub(ktime_get(), tux.lock_start));
+
+	tux.stats.lock_count++;
+	tux.stats.lock_ns += ns;
+	if(tux.stats.lock_max_ns < ns){
+		tux.stats.lock_max_ns = ns;
 	}
-	spin_unlock_irqrestore(&led_lock, flags);
-	return val;
 }
+#endif
@@ -9,9 +9,70 @@
 #define TUX_INIT _IO('E', 0x13)
 #define TUX_LED_REQUEST _IO('E', 0x14)
 #define TUX_LED_ACK _IO('E', 0x15)
+#define TUX_GET_EVENTS _IOR('E', 0x16, struct tux_events)
+#define TUX_SET_CLOCK _IOW('E', 0x17, unsigned long)
+
+/* TUX_SET_CLOCK shows the controller's own clock on the LEDs, counting up
+ * as minutes:seconds from arg seconds (at most TUX_CLOCK_MAX); the next
+ * TUX_SET_LED returns the LEDs to the value set */
+#define TUX_CLOCK_MAX (99 * 60 + 59)
+
+#define TUX_GET_STATS _IOR('E', 0x18, struct tux_stats)
+
+/* TUX_GET_STATS reads the driver's statistics; the device lock hold times
+ * are kept only if the driver is built with TUXCTL_LOCK_STATS=1 */
+struct tux_stats {
+	unsigned long lock_count;	/* holds of the device lock */
+	unsigned long long lock_ns;	/* total nanoseconds held */
+	unsigned long long lock_max_ns;	/* longest hold in nanoseconds */
+	unsigned long led_sent;	/* LED packets sent */
+	unsigned long led_coalesced;	/* LED values replaced or not resent */
+	unsigned long ack_timeouts;	/* waits for lost ACKs given up */
+};
+
+/* The current buttons are also on a page that can be mapped read-only from
+ * TUX_STATE_DEV(one page at offset 0), so that they can be read without a
+ * system call. The driver makes seq odd while it changes the page and even
+ * again after; a reader copies the fields between two reads of the same
+ * even seq, and retries otherwise. */
+#define TUX_STATE_DEV "/dev/tuxctl"
+struct tux_state {
+	unsigned int seq;	/* changes: twice for each report */
+	unsigned char buttons;	/* as TUX_BUTTONS gives */
+	unsigned long long time;	/* of the last report, as in tux_event */
+};
+
+#define TUX_GET_LD_STATS _IOR('E', 0x19, struct tux_ld_stats)
+
+/* TUX_GET_LD_STATS reads the line discipline's counters since the tty was
+ * set to it: what arrived and left, and what was lost on the way */
+struct tux_ld_stats {
+	unsigned long rx_bytes;	/* bytes received into the rx ring */
+	unsigned long tx_bytes;	/* bytes handed to the serial driver */
+	unsigned long rx_overflow;	/* bytes dropped with the rx ring full */
+	unsigned long rx_packets;	/* whole packets parsed */
+	unsigned long rx_resyncs;	/* times framing was lost and sought */
+	unsigned long rx_skipped;	/* bytes skipped while resyncing */
+	unsigned long tx_dropped;	/* packets dropped with the tx ring full */
+};
+
+/* a button report from the controller, and the time(ktime_get, in
+ * nanoseconds on the monotonic clock) at which it arrived; buttons is
+ * the bitmap returned by TUX_BUTTONS(a bit is clear while pressed) */
+struct tux_event {
+	unsigned long long time;
+	unsigned char buttons;
+};
+
+/* TUX_GET_EVENTS takes up to TUX_MAX_EVENTS reports, oldest first,
+ * without waiting; lost counts reports overwritten since the last take */
+#define TUX_MAX_EVENTS 16
+struct tux_events {
+	unsigned int count;
+	unsigned int lost;
+	struct tux_event event[TUX_MAX_EVENTS];
+};
 
-/*helper function to determine the bits to write on the buffer for each LED*/
-extern unsigned long determine_val(unsigned long val, unsigned long dp);
 
 #endif
 
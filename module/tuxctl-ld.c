@@ -5,15 +5,25 @@
  * Puskar Naha 2013
  */
 
+#ifndef TUXCTL_USERSPACE
 #include <linux/tty.h>
 #include <linux/tty_ldisc.h>
 
 #include <linux/slab.h>
+#include <linux/string.h>
 #include <linux/kernel.h>
 #include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/hrtimer.h>
+#include <asm/uaccess.h>
 
 #include <linux/init.h>
+#else
+#include "tuxctl-user.h"
+#endif
 #include "tuxctl-ld.h"
+#include "tuxctl-ioctl.h"
 
 #define uhoh(str, ...) printk(KERN_EMERG "%s " str, __FUNCTION__, ##__VA_ARGS__)
 #define debug(str, ...) printk(KERN_DEBUG "%s " str, __FUNCTION__,\
@@ -49,17 +59,54 @@ static void tuxctl_ldisc_close(struct tty_struct*);
 static void tuxctl_ldisc_rcv_buf(struct tty_struct*, const unsigned char *, 
 					char *, int);
 static void tuxctl_ldisc_write_wakeup(struct tty_struct*);
+static ssize_t tuxctl_ldisc_read(struct tty_struct*, struct file*,
+					unsigned char __user*, size_t);
+static unsigned int tuxctl_ldisc_poll(struct tty_struct*, struct file*,
+					poll_table*);
 static void tuxctl_ldisc_data_callback(struct tty_struct *tty);
 
-#define TUXCTL_BUFSIZE 64
+/* The rx and tx rings hold 2^TUXCTL_RX_ORDER and 2^TUXCTL_TX_ORDER bytes.
+ * Like the event ring below, their start and end count without wrapping;
+ * the slot is the count masked by the size less one. */
+#ifndef TUXCTL_RX_ORDER
+#define TUXCTL_RX_ORDER 10
+#endif
+#ifndef TUXCTL_TX_ORDER
+#define TUXCTL_TX_ORDER 8
+#endif
+#define TUXCTL_RX_SIZE (1 << TUXCTL_RX_ORDER)
+#define TUXCTL_TX_SIZE (1 << TUXCTL_TX_ORDER)
+
+/* MTCP packets from the controller are 3 bytes; the data callback takes
+ * up to TUXCTL_PACKETS of them from the rx ring at a time. */
+#define TUXCTL_PACKET_LEN 3
+#define TUXCTL_PACKETS 16
+
+/* write_wakeup may run in interrupt context, so it hands the tx ring to
+ * the serial driver through a small stack buffer, TUXCTL_TX_CHUNK bytes
+ * at a time, whatever TUXCTL_TX_ORDER is. */
+#define TUXCTL_TX_CHUNK 64
+
+/* Button reports wait in a ring of TUXCTL_EVENTS (a power of two) for
+ * TUX_GET_EVENTS or read(). ev_head and ev_tail count without wrapping;
+ * the slot is the count modulo TUXCTL_EVENTS. */
+#define TUXCTL_EVENTS 64
 typedef struct tuxctl_ldisc_data {
 	unsigned long magic;
 
-	char rx_buf[TUXCTL_BUFSIZE];
-	int rx_start, rx_end;
+	char rx_buf[TUXCTL_RX_SIZE];
+	unsigned int rx_start, rx_end;
+	int rx_resync;		/* skipping bytes to find a packet start */
 
-	char tx_buf[TUXCTL_BUFSIZE];
-	int tx_start, tx_end;
+	char tx_buf[TUXCTL_TX_SIZE];
+	unsigned int tx_start, tx_end;
+
+	struct tux_ld_stats stats;
+
+	struct tux_event ev_buf[TUXCTL_EVENTS];
+	unsigned int ev_head, ev_tail;
+	unsigned int ev_lost;
+	wait_queue_head_t ev_wait;
 
 } tuxctl_ldisc_data_t;
 
@@ -70,6 +117,8 @@ static struct tty_ldisc tuxctl_ldisc  = {
 	.open = tuxctl_ldisc_open,
 	.close = tuxctl_ldisc_close,
         .ioctl = tuxctl_ioctl,
+	.read = tuxctl_ldisc_read,
+	.poll = tuxctl_ldisc_poll,
 	.receive_buf = tuxctl_ldisc_rcv_buf,
 	.write_wakeup = tuxctl_ldisc_write_wakeup,
 };
@@ -78,8 +127,11 @@ int __init
 tuxctl_ldisc_init(void)
 {
 	int err = 0;
-	if((err = tty_register_ldisc(N_MOUSE, &tuxctl_ldisc))){
+	if((err = tuxctl_state_init())){
+		debug("tuxctl state page setup failed\n");
+	}else if((err = tty_register_ldisc(N_MOUSE, &tuxctl_ldisc))){
 		debug("tuxctl line discipline register failed\n");
+		tuxctl_state_exit();
 	}else{
 		printk("tuxctl line discipline registered\n");
 	}
@@ -91,20 +143,19 @@ void __exit
 tuxctl_ldisc_exit(void)
 {
 	tty_unregister_ldisc(N_MOUSE);
+	tuxctl_state_exit();
 	printk("tuxctl line discipline removed\n");
 }
 module_exit(tuxctl_ldisc_exit);
 
 
-#define buf_used(start,end) ((start) <= (end) ? \
-				  ((end) - (start))  \
-				: (TUXCTL_BUFSIZE + (end) - (start)))
-
-#define buf_room(start,end) (TUXCTL_BUFSIZE - buf_used(start,end) - 1)
-
+#define buf_used(start,end) ((end) - (start))
 #define buf_empty(start, end) ((start) == (end))
-#define buf_full(start, end) ((((end)+1)%TUXCTL_BUFSIZE) == (start))
-#define buf_incidx(idx) ((idx) = ((idx)+1) % TUXCTL_BUFSIZE)
+
+#define rx_room(data) (TUXCTL_RX_SIZE - buf_used((data)->rx_start, (data)->rx_end))
+#define rx_byte(data, idx) ((data)->rx_buf[(idx) & (TUXCTL_RX_SIZE - 1)])
+#define tx_room(data) (TUXCTL_TX_SIZE - buf_used((data)->tx_start, (data)->tx_end))
+#define tx_byte(data, idx) ((data)->tx_buf[(idx) & (TUXCTL_TX_SIZE - 1)])
 
 
 static int 
@@ -124,9 +175,16 @@ tuxctl_ldisc_open(struct tty_struct *tty)
 
 	data->rx_start = 0;
 	data->rx_end = 0;
+	data->rx_resync = 0;
 
 	data->tx_start = 0;
 	data->tx_end = 0;
+
+	memset(&data->stats, 0, sizeof(data->stats));
+	data->ev_head = 0;
+	data->ev_tail = 0;
+	data->ev_lost = 0;
+	init_waitqueue_head(&data->ev_wait);
 	tty->disc_data = data;
 
 	spin_unlock_irqrestore(&tuxctl_ldisc_lock, flags);
@@ -155,13 +213,14 @@ tuxctl_ldisc_close(struct tty_struct *tty)
  * The receive_buf() method of our line discipline. It receives count bytes
  * from cp. fp points to some flag/error bytes which I conveniently ignore. 
  * This is called when there are bytes received from the serial driver, and
- * is called from an interrupt handler.
+ * is called from an interrupt handler. Bytes that do not fit in the rx ring
+ * are dropped and counted in rx_overflow.
  */
 static void 
 tuxctl_ldisc_rcv_buf(struct tty_struct *tty, const unsigned char *cp, 
 			char *fp, int count)
 {
-	int call = 0, c=0;
+	int call = 0, c, room;
 	unsigned long flags;
 	tuxctl_ldisc_data_t *data;
 
@@ -169,10 +228,12 @@ tuxctl_ldisc_rcv_buf(struct tty_struct *tty, const unsigned char *cp,
 	if(0 != (data = tty->disc_data)){
 		call = 1;
 
-		while(count-- > 0 && !buf_full(data->rx_start, data->rx_end)) {
-			data->rx_buf[data->rx_end] = *cp++;
-			buf_incidx(data->rx_end);
-			c++;
+		room = rx_room(data);
+		c = count < room ? count : room;
+		data->stats.rx_bytes += c;
+		data->stats.rx_overflow += count - c;
+		while(c-- > 0) {
+			rx_byte(data, data->rx_end++) = *cp++;
 		}
 	}
 
@@ -190,30 +251,98 @@ static void
 tuxctl_ldisc_write_wakeup(struct tty_struct *tty)
 {
 	tuxctl_ldisc_data_t *data;
-	int sent, n = 0, room;
-	char buf[TUXCTL_BUFSIZE];
+	int sent, n, room;
+	unsigned char buf[TUXCTL_TX_CHUNK];
 	unsigned long flags;
 
 	/* I hope that this doesn't need synchronization. */
 	room = tty->driver->write_room(tty);
-	
-	spin_lock_irqsave(&tuxctl_ldisc_lock, flags);
-	data = tty->disc_data;
 
-	while(n <= room && !buf_empty(data->tx_start, data->tx_end)){
-		buf[n++] = data->tx_buf[data->tx_start];
-		buf_incidx(data->tx_start);
-	}
+	while(room > 0){
+		n = 0;
+		spin_lock_irqsave(&tuxctl_ldisc_lock, flags);
+		if(0 != (data = tty->disc_data)){
+			while(n < room && n < TUXCTL_TX_CHUNK &&
+			      !buf_empty(data->tx_start, data->tx_end)){
+				buf[n++] = tx_byte(data, data->tx_start++);
+			}
+		}
+		spin_unlock_irqrestore(&tuxctl_ldisc_lock, flags);
 
-	spin_unlock_irqrestore(&tuxctl_ldisc_lock, flags);
+		if(n == 0)
+			return;
+
+		sent = tty->driver->write(tty, buf, n);
 
-	sent = tty->driver->write(tty, buf, n);
+		spin_lock_irqsave(&tuxctl_ldisc_lock, flags);
+		if(0 != (data = tty->disc_data))
+			data->stats.tx_bytes += sent;
+		spin_unlock_irqrestore(&tuxctl_ldisc_lock, flags);
 
-	if(sent != n){
-		debug("driver lied to us? We lost some data");
+		if(sent != n){
+			debug("driver lied to us? We lost some data");
+			return;
+		}
+		room -= sent;
 	}
 }
 
+/* tuxctl_ldisc_read()
+ * The read() method of our line discipline. Copies out whole struct
+ * tux_event button reports, oldest first, sleeping until one arrives
+ * unless the file is non-blocking.
+ */
+static ssize_t
+tuxctl_ldisc_read(struct tty_struct *tty, struct file *file,
+			unsigned char __user *buf, size_t nr)
+{
+	struct tux_event ev[TUX_MAX_EVENTS];
+	tuxctl_ldisc_data_t *data = tty->disc_data;
+	int n, want;
+
+	if((want = nr / sizeof(ev[0])) == 0)
+		return -EINVAL;
+	if(want > TUX_MAX_EVENTS)
+		want = TUX_MAX_EVENTS;
+	if(0 == data)
+		return -EIO;
+
+	while((n = tuxctl_ldisc_get_events(tty, ev, want, NULL)) == 0){
+		if(file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if(wait_event_interruptible(data->ev_wait,
+				data->ev_head != data->ev_tail))
+			return -ERESTARTSYS;
+	}
+
+	if(copy_to_user(buf, ev, n * sizeof(ev[0])))
+		return -EFAULT;
+	return n * sizeof(ev[0]);
+}
+
+/* tuxctl_ldisc_poll()
+ * The poll() method of our line discipline: readable while button
+ * reports are waiting.
+ */
+static unsigned int
+tuxctl_ldisc_poll(struct tty_struct *tty, struct file *file, poll_table *wait)
+{
+	tuxctl_ldisc_data_t *data = tty->disc_data;
+	unsigned int mask = 0;
+	unsigned long flags;
+
+	if(0 == data)
+		return POLLERR;
+	poll_wait(file, &data->ev_wait, wait);
+
+	spin_lock_irqsave(&tuxctl_ldisc_lock, flags);
+	if(data->ev_head != data->ev_tail)
+		mask = POLLIN | POLLRDNORM;
+	spin_unlock_irqrestore(&tuxctl_ldisc_lock, flags);
+
+	return mask;
+}
+
 /*********** Interface to the char driver ********************/
 
 
@@ -232,8 +361,7 @@ tuxctl_ldisc_get(struct tty_struct *tty, char *buf, int n)
 	spin_lock_irqsave(&tuxctl_ldisc_lock, flags);
 	data = tty->disc_data;
 	while(n-- > 0 && !buf_empty(data->rx_start, data->rx_end)){
-		*buf++ = data->rx_buf[data->rx_start];
-		buf_incidx(data->rx_start);
+		*buf++ = rx_byte(data, data->rx_start++);
 		r++;
 	}
 	spin_unlock_irqrestore(&tuxctl_ldisc_lock, flags);
@@ -244,7 +372,8 @@ tuxctl_ldisc_get(struct tty_struct *tty, char *buf, int n)
 /* tuxctl_ldisc_put()
  * Write bytes out to the device. Returns the number of bytes *not* written.
  * This means, 0 on success and >0 if the line discipline's internal buffer
- * is full.
+ * is full. The bytes are queued all or none, so that the device never
+ * sees part of a packet; a packet that does not fit counts in tx_dropped.
  */
 int 
 tuxctl_ldisc_put(struct tty_struct *tty, char const *buf, int n)
@@ -256,10 +385,13 @@ tuxctl_ldisc_put(struct tty_struct *tty, char const *buf, int n)
 
 	data = tty->disc_data;
 
-	while (n > 0 && !buf_full(data->tx_start, data->tx_end)) {
-		data->tx_buf[data->tx_end] = *buf++;
-		buf_incidx(data->tx_end);
-		--n;
+	if (n > tx_room(data)) {
+		data->stats.tx_dropped++;
+	} else {
+		while (n > 0) {
+			tx_byte(data, data->tx_end++) = *buf++;
+			--n;
+		}
 	}
 
 	spin_unlock_irqrestore(&tuxctl_ldisc_lock, flags);
@@ -271,6 +403,136 @@ tuxctl_ldisc_put(struct tty_struct *tty, char const *buf, int n)
 	return n;
 }
 
+/* tuxctl_ldisc_put_event()
+ * Record a button report in the event ring, overwriting the oldest if
+ * the ring is full, and wake any reader.
+ */
+void
+tuxctl_ldisc_put_event(struct tty_struct *tty, unsigned char buttons,
+			unsigned long long now)
+{
+	tuxctl_ldisc_data_t *data;
+	struct tux_event *ev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tuxctl_ldisc_lock, flags);
+	if(0 == (data = tty->disc_data)){
+		spin_unlock_irqrestore(&tuxctl_ldisc_lock, flags);
+		return;
+	}
+
+	if(data->ev_head - data->ev_tail == TUXCTL_EVENTS){
+		data->ev_tail++;
+		data->ev_lost++;
+	}
+	ev = &data->ev_buf[data->ev_head++ & (TUXCTL_EVENTS - 1)];
+	ev->time = now;
+	ev->buttons = buttons;
+
+	/* Wake under the lock: close may free data as soon as we let go. */
+	wake_up_interruptible(&data->ev_wait);
+	spin_unlock_irqrestore(&tuxctl_ldisc_lock, flags);
+}
+
+/* tuxctl_ldisc_get_events()
+ * Take up to n button reports from the event ring without waiting.
+ */
+int
+tuxctl_ldisc_get_events(struct tty_struct *tty, struct tux_event *ev, int n,
+			unsigned int *lost)
+{
+	tuxctl_ldisc_data_t *data;
+	unsigned long flags;
+	int r = 0;
+
+	spin_lock_irqsave(&tuxctl_ldisc_lock, flags);
+	if(0 == (data = tty->disc_data)){
+		spin_unlock_irqrestore(&tuxctl_ldisc_lock, flags);
+		if(lost)
+			*lost = 0;
+		return 0;
+	}
+	while(r < n && data->ev_tail != data->ev_head){
+		ev[r++] = data->ev_buf[data->ev_tail++ & (TUXCTL_EVENTS - 1)];
+	}
+	if(lost){
+		*lost = data->ev_lost;
+		data->ev_lost = 0;
+	}
+	spin_unlock_irqrestore(&tuxctl_ldisc_lock, flags);
+
+	return r;
+}
+
+/* tuxctl_ldisc_get_stats()
+ * Copy the tty's byte and packet counters.
+ */
+void
+tuxctl_ldisc_get_stats(struct tty_struct *tty, struct tux_ld_stats *stats)
+{
+	tuxctl_ldisc_data_t *data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tuxctl_ldisc_lock, flags);
+	if(0 != (data = tty->disc_data))
+		*stats = data->stats;
+	else
+		memset(stats, 0, sizeof(*stats));
+	spin_unlock_irqrestore(&tuxctl_ldisc_lock, flags);
+}
+
+/* tuxctl_ldisc_get_packets()
+ * Take up to n whole packets from the rx ring. Checks the framing bits
+ * of each byte as a potential packet beginning, skipping bytes that are
+ * not, and leaves an incomplete packet in the ring for next time.
+ */
+static int
+tuxctl_ldisc_get_packets(struct tty_struct *tty,
+			unsigned char packet[][TUXCTL_PACKET_LEN], int n)
+{
+	tuxctl_ldisc_data_t *data;
+	unsigned long flags;
+	unsigned int i;
+	unsigned char a, b, c;
+	int r = 0;
+
+	spin_lock_irqsave(&tuxctl_ldisc_lock, flags);
+	if(0 == (data = tty->disc_data)){
+		spin_unlock_irqrestore(&tuxctl_ldisc_lock, flags);
+		return 0;
+	}
+
+	i = data->rx_start;
+	while(r < n && buf_used(i, data->rx_end) >= TUXCTL_PACKET_LEN){
+		a = rx_byte(data, i);
+		b = rx_byte(data, i + 1);
+		c = rx_byte(data, i + 2);
+
+		/* Check the framing bits to detect lost bytes */
+		if(!(a&0x80) && b&0x80 && c&0x80){
+			packet[r][0] = a;
+			packet[r][1] = b;
+			packet[r][2] = c;
+			r++;
+			i += TUXCTL_PACKET_LEN;
+			data->rx_resync = 0;
+		}else{
+			if(!data->rx_resync){
+				data->rx_resync = 1;
+				data->stats.rx_resyncs++;
+			}
+			data->stats.rx_skipped++;
+			i++;
+		}
+	}
+	data->rx_start = i;
+	data->stats.rx_packets += r;
+
+	spin_unlock_irqrestore(&tuxctl_ldisc_lock, flags);
+
+	return r;
+}
+
 /* tuxctl_ldisc_data_callback()
  * This is the function called from the line-discipline when data is
  * available from the device. This is how responses to polling the buttons
@@ -282,38 +544,20 @@ tuxctl_ldisc_put(struct tty_struct *tty, char const *buf, int n)
  * IMPORTANT: This function is called from an interrupt context, so it 
  *            cannot acquire any semaphores or otherwise sleep, or access
  *            the 'current' pointer. It also must not take up too much time.
+ *
+ * Packets are parsed in the rx ring in batches of TUXCTL_PACKETS, and
+ * handled after the lock is dropped; a partial packet stays in the ring
+ * until the rest of it arrives.
  */
 static void tuxctl_ldisc_data_callback(struct tty_struct *tty)
 {
-	/* Should probably synchronize these */
-	static unsigned char saved[2];
-	static int n_saved = 0;
-	
-	unsigned char packet[12], *p;
-	int n, i = 0, j;
-
-	for(i=0; i< n_saved; i++)
-		packet[i] = saved[i];
-	
-	n = n_saved + tuxctl_ldisc_get(tty, packet + n_saved,  12 - n_saved);
-
-	/* Look at all bytes as potential packet beginnings except for 
-	 * the last two bytes. Save them for next time. */
-	for(i = 0; i < n-2; ){
-		p = packet + i;
-
-		/* Check the framing bits to detect lost bytes */
-		if(!(p[0]&0x80) && p[1]&0x80 && p[2]&0x80){
-			tuxctl_handle_packet(tty, p);
-			i += 3;
-		}else{
-			i++;
-		}
-	}
-
-	/* Save the leftovers - extra bytes for breakfast */
-	n_saved = n - i;
-	for(j = 0; j < n_saved; j++)
-		saved[j] = packet[i+j];
+	unsigned char packet[TUXCTL_PACKETS][TUXCTL_PACKET_LEN];
+	int n, i;
+
+	do{
+		n = tuxctl_ldisc_get_packets(tty, packet, TUXCTL_PACKETS);
+		for(i = 0; i < n; i++)
+			tuxctl_handle_packet(tty, packet[i]);
+	}while(n == TUXCTL_PACKETS);
 }
 
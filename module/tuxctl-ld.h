@@ -1,10 +1,14 @@
 #ifndef TUXCTL_LD_H
 #define TUXCTL_LD_H
 
+#ifndef TUXCTL_USERSPACE
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/fs.h>
 #include <linux/tty.h>
+#else
+#include "tuxctl-user.h"
+#endif
 
 /* tuxctl-ld.h
  * Interface between line discipline and driver */
@@ -24,6 +28,31 @@ extern int tuxctl_ldisc_get(struct tty_struct*, char *, int);
  */
 extern int tuxctl_ldisc_put(struct tty_struct*, char const*, int);
 
+/* tuxctl_ldisc_put_event()
+ * Record a button report, stamped with its time in ns(from ktime_get), in
+ * the tty's event ring and wake any reader. If the ring is full, the oldest
+ * report is overwritten; each report holds the whole button state, so the
+ * latest state is never lost. May be called from interrupt context.
+ */
+extern void tuxctl_ldisc_put_event(struct tty_struct*, unsigned char,
+				   unsigned long long);
+
+/* tuxctl_ldisc_get_events()
+ * Take up to n reports from the tty's event ring, oldest first, without
+ * waiting. Returns the number taken; if lost is not NULL, stores the
+ * number of reports overwritten since the last call and resets it.
+ */
+struct tux_event;
+extern int tuxctl_ldisc_get_events(struct tty_struct*, struct tux_event*, int,
+				   unsigned int*);
+
+/* tuxctl_ldisc_get_stats()
+ * Copy the tty's counts of bytes received and sent, rx overflows, packets
+ * dropped and resyncs, kept since the line discipline was opened.
+ */
+struct tux_ld_stats;
+extern void tuxctl_ldisc_get_stats(struct tty_struct*, struct tux_ld_stats*);
+
 /* tuxctl_handle_packet
  * To be written by the student.  This function will handle a 
  * packet sent to the computer from the tux controller.  This is
@@ -32,6 +61,13 @@ extern int tuxctl_ldisc_put(struct tty_struct*, char const*, int);
 void tuxctl_handle_packet(struct tty_struct *tty, unsigned char *packet);
 
 
+/* tuxctl_state_init(), tuxctl_state_exit()
+ * Set up and remove the button state page and the device through which
+ * it is mapped. Located in tuxctl-ioctl.c
+ */
+extern int tuxctl_state_init(void);
+extern void tuxctl_state_exit(void);
+
 /* ioctl for the line discipline that the students will implement.
  * Located in tuxctl.c
  */
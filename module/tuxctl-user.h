@@ -0,0 +1,225 @@
+/* tuxctl-user.h
+ * Just enough of the kernel interface for tuxctl-ioctl.c and tuxctl-ld.c
+ * to be built as part of a user program (-DTUXCTL_USERSPACE), with the
+ * serial line supplied by the program. tuxemu uses it to run the driver
+ * against an emulated controller on a pseudo-terminal.
+ *
+ * Spinlocks become mutexes, and user pointers are plain pointers. There
+ * are no sleeping readers to wake, so the line discipline's blocking
+ * read() just polls. A "mapping" made by vm_insert_page is the page
+ * itself, at vma->vm_start, and holds a reference to the page until
+ * tuxctl_user_unmap() drops it.
+ */
+
+#ifndef TUXCTL_USER_H
+#define TUXCTL_USER_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define __user
+#define __init
+#define __exit
+#define module_init(fn)
+#define module_exit(fn)
+
+#define KERN_EMERG ""
+#define KERN_DEBUG ""
+#define printk(...) fprintf(stderr, __VA_ARGS__)
+#define BUG() abort()
+
+#define ERESTARTSYS 512
+
+#define GFP_KERNEL 0
+#define kmalloc(size, gfp) malloc(size)
+#define kfree(ptr) free(ptr)
+
+#define copy_to_user(to, from, n) (memcpy((to), (from), (n)), 0UL)
+#define copy_from_user(to, from, n) (memcpy((to), (from), (n)), 0UL)
+
+typedef int64_t s64;
+
+#define THIS_MODULE NULL
+
+typedef pthread_mutex_t spinlock_t;
+#define SPIN_LOCK_UNLOCKED PTHREAD_MUTEX_INITIALIZER
+#define spin_lock_irqsave(lock, flags) \
+	do { (flags) = 0; pthread_mutex_lock(lock); } while (0)
+#define spin_unlock_irqrestore(lock, flags) \
+	do { (void)(flags); pthread_mutex_unlock(lock); } while (0)
+
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+
+typedef s64 ktime_t;
+#define ktime_sub(a, b) ((a) - (b))
+#define ktime_to_ns(t) (t)
+
+static inline ktime_t ktime_get(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#define HZ 100
+#define jiffies ((unsigned long)(ktime_get() / (1000000000 / HZ)))
+#define time_after(a, b) ((long)((b) - (a)) < 0)
+
+typedef struct { int unused; } wait_queue_head_t;
+#define init_waitqueue_head(wq) ((void)(wq))
+#define wake_up_interruptible(wq) ((void)(wq))
+#define wait_event_interruptible(wq, cond) \
+	({ while (!(cond)) usleep(1000); 0; })
+
+typedef struct poll_table_struct poll_table;
+#define poll_wait(file, wq, wait) ((void)(wait))
+
+struct file {
+	unsigned int f_flags;
+};
+
+/* The serial port below the line discipline; write returns the number
+ * of bytes taken. */
+struct tty_struct;
+struct tty_driver {
+	int (*write)(struct tty_struct*, const unsigned char*, int);
+	int (*write_room)(struct tty_struct*);
+};
+
+struct tty_struct {
+	void *disc_data;
+	struct tty_driver *driver;
+	void *driver_data;
+};
+
+struct tty_ldisc {
+	int magic;
+	const char *name;
+	int (*open)(struct tty_struct*);
+	void (*close)(struct tty_struct*);
+	int (*ioctl)(struct tty_struct*, struct file*, unsigned int,
+		     unsigned long);
+	ssize_t (*read)(struct tty_struct*, struct file*, unsigned char*,
+			size_t);
+	unsigned int (*poll)(struct tty_struct*, struct file*, poll_table*);
+	void (*receive_buf)(struct tty_struct*, const unsigned char*, char*,
+			    int);
+	void (*write_wakeup)(struct tty_struct*);
+};
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+
+/* A page counts its references in the word just past it, where struct
+ * page would keep them: one for the allocation and one per mapping. */
+#define page_refs(page) ((int *)((char *)(page) + PAGE_SIZE))
+
+static inline unsigned long get_zeroed_page(int gfp)
+{
+	void *page = aligned_alloc(PAGE_SIZE, 2 * PAGE_SIZE);
+
+	if (page != NULL) {
+		memset(page, 0, PAGE_SIZE);
+		*page_refs(page) = 1;
+	}
+	return (unsigned long)page;
+}
+
+#define virt_to_page(addr) ((void *)(addr))
+#define get_page(page) __atomic_add_fetch(page_refs(page), 1, __ATOMIC_RELAXED)
+
+static inline void put_page(void *page)
+{
+	if (0 == __atomic_sub_fetch(page_refs(page), 1, __ATOMIC_ACQ_REL))
+		free(page);
+}
+
+#define free_page(addr) put_page((void *)(addr))
+
+#define VM_WRITE 0x2
+#define VM_MAYWRITE 0x20
+typedef unsigned long pgprot_t;
+
+struct vm_area_struct {
+	unsigned long vm_start, vm_end;
+	unsigned long vm_pgoff;
+	unsigned long vm_flags;
+	pgprot_t vm_page_prot;
+};
+
+static inline int vm_insert_page(struct vm_area_struct *vma,
+				 unsigned long addr, void *page)
+{
+	get_page(page);
+	vma->vm_start = (unsigned long)page;
+	vma->vm_end = vma->vm_start + PAGE_SIZE;
+	return 0;
+}
+
+/* munmap() of a mapping made by vm_insert_page */
+static inline void tuxctl_user_unmap(struct vm_area_struct *vma)
+{
+	put_page((void *)vma->vm_start);
+}
+
+struct module;
+struct file_operations {
+	struct module *owner;
+	int (*mmap)(struct file*, struct vm_area_struct*);
+};
+
+#define MISC_DYNAMIC_MINOR 255
+struct miscdevice {
+	int minor;
+	const char *name;
+	const struct file_operations *fops;
+};
+
+/* the device registered by tuxctl_state_init(), to reach its mmap */
+extern struct miscdevice *tuxctl_user_misc;
+
+static inline int misc_register(struct miscdevice *misc)
+{
+	tuxctl_user_misc = misc;
+	return 0;
+}
+
+static inline int misc_deregister(struct miscdevice *misc)
+{
+	tuxctl_user_misc = NULL;
+	return 0;
+}
+
+/* the line discipline registered by tuxctl_ldisc_init() */
+extern struct tty_ldisc *tuxctl_user_ldisc;
+
+static inline int tty_register_ldisc(int disc, struct tty_ldisc *ld)
+{
+	tuxctl_user_ldisc = ld;
+	return 0;
+}
+
+static inline int tty_unregister_ldisc(int disc)
+{
+	tuxctl_user_ldisc = NULL;
+	return 0;
+}
+
+extern int tuxctl_ldisc_init(void);
+
+#endif
@@ -89,8 +89,17 @@ struct photo_t {
     photo_header_t hdr;            /* defines height and width */
     uint8_t        palette[192][3];     /* optimized palette colors */
     uint8_t*       img;                 /* pixel data               */
+    uint8_t*       preview;             /* 1/4 resolution pixel data */
 };
 
+/*
+ * The preview of a room photo holds one pixel for each block of
+ * PREVIEW_SCALE by PREVIEW_SCALE photo pixels(the pixel nearest the
+ * center of the block), stored in the same order as the photo.
+ */
+#define PREVIEW_SCALE 4
+#define PREVIEW_DIM(n) (((n) + PREVIEW_SCALE - 1) / PREVIEW_SCALE)
+
 /*
  * An object image.  The code for managing these images has been given
  * to you.  The data are simply loaded from a file, where they have
@@ -109,12 +118,13 @@ struct image_t {
 /* file-scope variables */
 
 /*
- * The room currently shown on the screen.  This value is not known to
- * the mode X code, but is needed when filling buffers in callbacks from
- * that code(fill_horiz_buffer/fill_vert_buffer).  The value is set
- * by calling prep_room.
+ * The image of the room currently shown on the screen(a copy made by
+ * copy_room_image).  This value is not known to the mode X code, but is
+ * needed when filling buffers in callbacks from that code
+ * (fill_horiz_buffer/fill_vert_buffer).  The value is set by calling
+ * prep_room or set_room_image.
  */
-static const room_t* cur_room = NULL;
+static const room_image_t* cur_image = NULL;
 
 
 /*
@@ -133,8 +143,26 @@ static const room_t* cur_room = NULL;
  *   SIDE EFFECTS: none
  */
 void fill_horiz_buffer(int x, int y, unsigned char buf[SCROLL_X_DIM]) {
+    fill_image_horiz_buffer(cur_image, x, y, buf);
+}
+
+
+/*
+ * fill_image_horiz_buffer
+ *   DESCRIPTION: Produce the image of a horizontal line of any room's
+ *                image, in the same way as fill_horiz_buffer does for the
+ *                current room.  Only reads the image, so it may be used by
+ *                a thread other than the one preparing the current room.
+ *                Rows outside of the photo are black.
+ *   INPUTS: ri -- the room's image
+ *          (x,y) -- leftmost pixel of line to be drawn
+ *   OUTPUTS: buf -- buffer holding image data for the line
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+void fill_image_horiz_buffer(const room_image_t* ri, int x, int y, unsigned char buf[SCROLL_X_DIM]) {
     int            idx;   /* loop index over pixels in the line          */
-    object_t*      obj;   /* loop index over objects in the current room */
+    int            obj;   /* loop index over objects in the room         */
     int            imgx;  /* loop index over pixels in object image      */
     int            yoff;  /* y offset into object image                  */
     uint8_t        pixel; /* pixel from object image                     */
@@ -143,19 +171,24 @@ void fill_horiz_buffer(int x, int y, unsigned char buf[SCROLL_X_DIM]) {
     int32_t        obj_y; /* object y position                           */
     const image_t* img;   /* object image                                */
 
-    /* Get pointer to current photo of current room. */
-    view = room_photo(cur_room);
+    /* Get pointer to current photo of the room. */
+    view = ri->photo;
 
     /* Loop over pixels in line. */
-    for (idx = 0; idx < SCROLL_X_DIM; idx++) {
-        buf[idx] = (0 <= x + idx && view->hdr.width > x + idx ? view->img[view->hdr.width * y + x + idx] : 0);
+    if (0 > y || view->hdr.height <= y) {
+        (void)memset(buf, 0, SCROLL_X_DIM);
+    }
+    else {
+        for (idx = 0; idx < SCROLL_X_DIM; idx++) {
+            buf[idx] = (0 <= x + idx && view->hdr.width > x + idx ? view->img[view->hdr.width * y + x + idx] : 0);
+        }
     }
 
-    /* Loop over objects in the current room. */
-    for (obj = room_contents_iterate(cur_room); NULL != obj; obj = obj_next(obj)) {
-        obj_x = obj_get_x(obj);
-        obj_y = obj_get_y(obj);
-        img = obj_image(obj);
+    /* Loop over objects in the room. */
+    for (obj = 0; ri->n_objs > obj; obj++) {
+        obj_x = ri->obj[obj].x;
+        obj_y = ri->obj[obj].y;
+        img = ri->obj[obj].img;
 
         /* Is object outside of the line we're drawing? */
         if (y < obj_y || y >= obj_y + img->hdr.height || x + SCROLL_X_DIM <= obj_x || x >= obj_x + img->hdr.width) {
@@ -191,6 +224,76 @@ void fill_horiz_buffer(int x, int y, unsigned char buf[SCROLL_X_DIM]) {
 }
 
 
+/*
+ * fill_preview_buffer
+ *   DESCRIPTION: Produce a quarter-resolution image of a horizontal line
+ *                of the current room from the photo's preview: one pixel
+ *                for each block of four photo pixels, starting with the
+ *                block containing(x,y).  Objects are sampled at the
+ *                centers of the blocks.  Used to show a room quickly
+ *                while it is drawn at full resolution.
+ *   INPUTS:(x,y) -- leftmost pixel of line to be drawn
+ *   OUTPUTS: buf -- buffer holding one pixel per block
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+void fill_preview_buffer(int x, int y, unsigned char buf[SCROLL_X_WIDTH]) {
+    int            idx;   /* loop index over blocks in the line          */
+    int            obj;   /* loop index over objects in the current room */
+    int            px;    /* photo x coordinate of a block's center      */
+    int            py;    /* photo y coordinate of the blocks' centers   */
+    int            pw;    /* width of preview in pixels                  */
+    uint8_t        pixel; /* pixel from object image                     */
+    const photo_t* view;  /* room photo                                  */
+    int32_t        obj_x; /* object x position                           */
+    int32_t        obj_y; /* object y position                           */
+    const image_t* img;   /* object image                                */
+
+    /* Get pointer to current photo of current room. */
+    view = cur_image->photo;
+    pw = PREVIEW_DIM(view->hdr.width);
+    x /= PREVIEW_SCALE;
+    y /= PREVIEW_SCALE;
+
+    /* Loop over blocks in line. */
+    if (0 > y || PREVIEW_DIM(view->hdr.height) <= y) {
+        (void)memset(buf, 0, SCROLL_X_WIDTH);
+    }
+    else {
+        for (idx = 0; idx < SCROLL_X_WIDTH; idx++) {
+            buf[idx] = (0 <= x + idx && pw > x + idx ? view->preview[pw * y + x + idx] : 0);
+        }
+    }
+
+    /* Loop over objects in the current room. */
+    py = y * PREVIEW_SCALE + PREVIEW_SCALE / 2;
+    for (obj = 0; cur_image->n_objs > obj; obj++) {
+        obj_x = cur_image->obj[obj].x;
+        obj_y = cur_image->obj[obj].y;
+        img = cur_image->obj[obj].img;
+
+        /* Is object outside of the line we're drawing? */
+        if (py < obj_y || py >= obj_y + img->hdr.height) {
+            continue;
+        }
+
+        /* Sample the object at the centers of the blocks it covers. */
+        for (idx = 0; idx < SCROLL_X_WIDTH; idx++) {
+            px = (x + idx) * PREVIEW_SCALE + PREVIEW_SCALE / 2;
+            if (px < obj_x || px >= obj_x + img->hdr.width) {
+                continue;
+            }
+            pixel = img->img[(py - obj_y) * img->hdr.width + px - obj_x];
+
+            /* Don't copy transparent pixels. */
+            if (OBJ_CLR_TRANSP != pixel) {
+                buf[idx] = pixel;
+            }
+        }
+    }
+}
+
+
 /*
  * fill_vert_buffer
  *   DESCRIPTION: Given the(x,y) map pixel coordinate of the top pixel of
@@ -208,7 +311,7 @@ void fill_horiz_buffer(int x, int y, unsigned char buf[SCROLL_X_DIM]) {
  */
 void fill_vert_buffer(int x, int y, unsigned char buf[SCROLL_Y_DIM]) {
     int            idx;   /* loop index over pixels in the line          */
-    object_t*      obj;   /* loop index over objects in the current room */
+    int            obj;   /* loop index over objects in the current room */
     int            imgy;  /* loop index over pixels in object image      */
     int            xoff;  /* x offset into object image                  */
     uint8_t        pixel; /* pixel from object image                     */
@@ -218,7 +321,7 @@ void fill_vert_buffer(int x, int y, unsigned char buf[SCROLL_Y_DIM]) {
     const image_t* img;   /* object image                                */
 
     /* Get pointer to current photo of current room. */
-    view = room_photo(cur_room);
+    view = cur_image->photo;
 
     /* Loop over pixels in line. */
     for (idx = 0; idx < SCROLL_Y_DIM; idx++) {
@@ -226,10 +329,10 @@ void fill_vert_buffer(int x, int y, unsigned char buf[SCROLL_Y_DIM]) {
     }
 
     /* Loop over objects in the current room. */
-    for (obj = room_contents_iterate(cur_room); NULL != obj; obj = obj_next(obj)) {
-        obj_x = obj_get_x(obj);
-        obj_y = obj_get_y(obj);
-        img = obj_image(obj);
+    for (obj = 0; cur_image->n_objs > obj; obj++) {
+        obj_x = cur_image->obj[obj].x;
+        obj_y = cur_image->obj[obj].y;
+        img = cur_image->obj[obj].img;
 
         /* Is object outside of the line we're drawing? */
         if (x < obj_x || x >= obj_x + img->hdr.width ||
@@ -327,15 +430,30 @@ uint32_t palette(const ){
  *   DESCRIPTION: Prepare a new room for display.  You might want to set
  *                up the VGA palette registers according to the color
  *                palette that you chose for this room.
- *   INPUTS: r -- pointer to the new room
+ *   INPUTS: ri -- image of the new room(see set_room_image)
  *   OUTPUTS: none
  *   RETURN VALUE: none
- *   SIDE EFFECTS: changes recorded cur_room for this file
+ *   SIDE EFFECTS: changes recorded cur_image for this file
  */
-void prep_room(const room_t* r) {
+void prep_room(const room_image_t* ri) {
     /* Record the current room. */
-    cur_room = r;
-	set_palette(room_photo(r)->palette);
+    set_room_image(ri);
+	set_palette(ri->photo->palette);
+}
+
+
+/*
+ * set_room_image
+ *   DESCRIPTION: Record the image of the current room drawn by the
+ *                callbacks from the mode X code.  The image must stay
+ *                unchanged until it is replaced.
+ *   INPUTS: ri -- image of the room
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: changes recorded cur_image for this file
+ */
+void set_room_image(const room_image_t* ri) {
+    cur_image = ri;
 }
 
 
@@ -570,6 +688,32 @@ photo_t* read_photo(const char* fname) {
 			}
 		}	
 	}
+
+    /*
+     * Make the preview from the pixel nearest the center of each block
+     * (rows and columns past the edges of the photo are clamped).
+     */
+    if (NULL == (p->preview = malloc
+        (PREVIEW_DIM(p->hdr.width) * PREVIEW_DIM(p->hdr.height) * sizeof (p->preview[0])))) {
+        free(p->img);
+        free(p);
+        (void)fclose(in);
+        return NULL;
+    }
+    for (y = 0; PREVIEW_DIM(p->hdr.height) > y; y++) {
+        index = y * PREVIEW_SCALE + PREVIEW_SCALE / 2;
+        if (p->hdr.height <= index) {
+            index = p->hdr.height - 1;
+        }
+        index *= p->hdr.width;
+        for (x = 0; PREVIEW_DIM(p->hdr.width) > x; x++) {
+            i = x * PREVIEW_SCALE + PREVIEW_SCALE / 2;
+            if (p->hdr.width <= i) {
+                i = p->hdr.width - 1;
+            }
+            p->preview[PREVIEW_DIM(p->hdr.width) * y + x] = p->img[index + i];
+        }
+    }
 		
 	/* All done.  Return success. */
 		(void)fclose(in);
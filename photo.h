@@ -64,6 +64,12 @@ typedef struct octree_t{
 /* Fill a buffer with the pixels for a horizontal line of current room. */
 extern void fill_horiz_buffer(int x, int y, unsigned char buf[SCROLL_X_DIM]);
 
+/* Fill a buffer with the pixels for a horizontal line of any room's image. */
+extern void fill_image_horiz_buffer(const room_image_t* ri, int x, int y, unsigned char buf[SCROLL_X_DIM]);
+
+/* Fill a buffer with a quarter-resolution horizontal line of current room. */
+extern void fill_preview_buffer(int x, int y, unsigned char buf[SCROLL_X_WIDTH]);
+
 /* Fill a buffer with the pixels for a vertical line of current room. */
 extern void fill_vert_buffer(int x, int y, unsigned char buf[SCROLL_Y_DIM]);
 
@@ -83,7 +89,10 @@ extern uint32_t photo_width(const photo_t* p);
  * Prepare room for display(record pointer for use by callbacks, set up
  * VGA palette, etc.).
  */
-extern void prep_room(const room_t* r);
+extern void prep_room(const room_image_t* ri);
+
+/* Record a new image of the current room for the callbacks to draw. */
+extern void set_room_image(const room_image_t* ri);
 
 /* Read object image from a file into a dynamically allocated structure. */
 extern image_t* read_obj_image(const char* fname);
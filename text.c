@@ -36,6 +36,12 @@
 #include <string.h>
 
 #include "text.h"
+
+/* set to 1 and compile this file by itself to check and time the status bar */
+#ifndef TEST_STATUS_BAR
+#define TEST_STATUS_BAR 0
+#endif
+
 unsigned char temp_buffer[5760];
 
 /*
@@ -567,62 +573,202 @@ unsigned char font_data[256][16] = {
 
 
 
+/*
+ * The status bar image in temp_buffer is four planes of 18 rows of 80
+ * bytes(one plane of each 4 pixels); the 16 rows of glyphs start at the
+ * second row, and each character cell covers two bytes of each row of
+ * each plane.
+ */
+#define STATUS_CHARS       40
+#define STATUS_ROW_BYTES   80
+#define STATUS_PLANE_SIZE  1440
+#define STATUS_BG_COLOR    0x32
+#define STATUS_FG_COLOR    0x40
+
+/*
+ * glyph_pixels holds the two bytes written for each character, glyph
+ * row, and plane; it is built from font_data on first use. shown_text
+ * is the string last rendered into temp_buffer, so that only the cells
+ * whose characters differ need to be rewritten.
+ */
+static unsigned char glyph_pixels[256][FONT_HEIGHT][4][2];
+static int glyphs_ready;
+static char shown_text[STATUS_CHARS];
+static int text_ready;      /* temp_buffer holds shown_text */
+
+static void build_glyph_table();
+static void draw_status_cell(int j, unsigned char c);
+
+
 /*
  * text_to_graphics
- *     DESCRIPTION: Put VGA into text mode 3(color text).
- *     INPUTS: a string in the status bar
+ *     DESCRIPTION: Render the status bar text into temp_buffer. Only the
+ *                  character cells that differ from the text rendered
+ *                  by the previous call are rewritten.
+ *     INPUTS: a string in the status bar(STATUS_CHARS characters)
  *     OUTPUTS: none
  *     RETURN VALUE: none
  *     SIDE EFFECTS: produce a buffer that holds a graphical image of the ASCII characters in the string
  */
 void text_to_graphics(char *str){
-	
-	int background = 0x32;	// background color 
-	int foreground = 0x40;	// foreground color 
-	int i;
-	int j;
-	int n;
-	int val;	//used to determine there is a pixel or not
-	
-	for (i =0; i<5760; i++){
-		temp_buffer[i] = background;	//set temp buffer to background color
+	int j;	/* loop index over character cells */
+
+	if (!glyphs_ready)
+		build_glyph_table();
+
+	/* On the first call, fill the rows above and below the glyphs. */
+	if (!text_ready) {
+		memset(temp_buffer, STATUS_BG_COLOR, sizeof(temp_buffer));
+	}
+
+	for (j = 0; j < STATUS_CHARS; j++) {
+		if (text_ready && shown_text[j] == str[j])
+			continue;
+		draw_status_cell(j, (unsigned char)str[j]);
+		shown_text[j] = str[j];
+	}
+	text_ready = 1;
+}
+
+
+/*
+ * build_glyph_table
+ *     DESCRIPTION: Fill glyph_pixels from font_data. Plane n shows font
+ *                  columns n and n + 4 of each character.
+ *     INPUTS: none
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: fills glyph_pixels
+ */
+static void build_glyph_table() {
+	int c;	/* loop index over characters */
+	int i;	/* loop index over glyph rows */
+	int n;	/* loop index over planes     */
+
+	for (c = 0; c < 256; c++) {
+		for (i = 0; i < FONT_HEIGHT; i++) {
+			for (n = 0; n < 4; n++) {
+				glyph_pixels[c][i][n][0] = ((font_data[c][i] & (0x80 >> n)) ?
+				                            STATUS_FG_COLOR : STATUS_BG_COLOR);
+				glyph_pixels[c][i][n][1] = ((font_data[c][i] & (0x08 >> n)) ?
+				                            STATUS_FG_COLOR : STATUS_BG_COLOR);
+			}
+		}
+	}
+	glyphs_ready = 1;
+}
+
+
+/*
+ * draw_status_cell
+ *     DESCRIPTION: Write one character cell of the status bar image.
+ *     INPUTS: j -- index of the cell
+ *             c -- the character
+ *     OUTPUTS: none
+ *     RETURN VALUE: none
+ *     SIDE EFFECTS: writes 128 bytes of temp_buffer
+ */
+static void draw_status_cell(int j, unsigned char c) {
+	unsigned char* dst;	/* cell in the first glyph row of a plane */
+	int i;				/* loop index over glyph rows             */
+	int n;				/* loop index over planes                 */
+
+	for (n = 0; n < 4; n++) {
+		dst = temp_buffer + n * STATUS_PLANE_SIZE + STATUS_ROW_BYTES + 2 * j;
+		for (i = 0; i < FONT_HEIGHT; i++, dst += STATUS_ROW_BYTES) {
+			dst[0] = glyph_pixels[c][i][n][0];
+			dst[1] = glyph_pixels[c][i][n][1];
+		}
 	}
-	
-	int arr_data;	//to hold one number in the array shown above
-	int mask_num_1 = 0x80;
-	int mask_num_2 = 0x08;
-	int index_to_draw = 80;	
-	
-	//put all pixel colors in a single array in this order: plane 0, 1, 2, 3
-	//process all of plane 0 pixels first, from top to bottom, from left to right
-	//then process plane 1 pixels and so on
-	for (n = 0; n < 4; n++){	//loop 4 planes
-		for (i = 0; i < 16; i++){	//loop 16 rows of pixels
-			for (j = 0; j < 40; j++){	//there are 40 characters in one row on the status bar
-				int str_info=(int)str[j];
-												//loop the string passed in
-				arr_data = font_data[str_info][i];	//arr_data is the hex number indicating whether there is a color pixel or not
-				val = arr_data & mask_num_1;
-				if (val != 0){	//if val is not 0, there is a color pixel, write it to temp_buffer
-					temp_buffer[index_to_draw] = foreground;	//draw the text
-					index_to_draw += 1;	//process the next index of the array
-				}	
-				else
-				{index_to_draw += 1;}
-				
-				val = arr_data & mask_num_2;
-				if (val != 0){	//if val is not 0, there is a color pixel, write it to temp_buffer
-					temp_buffer[index_to_draw] = foreground;
-					index_to_draw += 1;
-				}	
-				else
-				{index_to_draw += 1;}
+}
+
+
+#if (TEST_STATUS_BAR == 1)
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * reference_text_to_graphics -- the original bit-by-bit renderer, which
+ * clears and redraws the whole image; used to check text_to_graphics
+ */
+static void reference_text_to_graphics(const char* str, unsigned char buf[5760]) {
+	int i, j, n;
+
+	memset(buf, STATUS_BG_COLOR, 5760);
+	for (n = 0; n < 4; n++) {
+		for (i = 0; i < FONT_HEIGHT; i++) {
+			for (j = 0; j < STATUS_CHARS; j++) {
+				unsigned char bits = font_data[(unsigned char)str[j]][i];
+				unsigned char* dst = buf + n * STATUS_PLANE_SIZE + (i + 1) * STATUS_ROW_BYTES + 2 * j;
+				if (bits & (0x80 >> n))
+					dst[0] = STATUS_FG_COLOR;
+				if (bits & (0x08 >> n))
+					dst[1] = STATUS_FG_COLOR;
 			}
 		}
-		mask_num_1 = mask_num_1 >> 1;	//go to the next plane, therefore need to right shift
-		mask_num_2 = mask_num_2 >> 1;
-		index_to_draw += 160;	//go to the next plane, therefore index in the array need to increment 160
-	} 
-	return;
+	}
+}
+
+/* average microseconds per call of fn over the n strings in strs */
+static double time_renders(void (*fn)(const char*), char strs[][STATUS_CHARS + 1], int n, int reps) {
+	struct timespec t0, t1;
+	int r;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (r = 0; r < reps; r++)
+		fn(strs[r % n]);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return ((t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3) / reps;
 }
 
+static unsigned char ref_buffer[5760];
+static void render_cached(const char* str) { text_to_graphics((char*)str); }
+static void render_reference(const char* str) { reference_text_to_graphics(str, ref_buffer); }
+
+int main() {
+	static char same[1][STATUS_CHARS + 1] = {"   Kitchen                    > eat_   "};
+	static char clock_tick[60][STATUS_CHARS + 1];	/* one cell changes */
+	static char all[2][STATUS_CHARS + 1];			/* every cell changes */
+	int i, j;
+
+	for (i = 0; i < 60; i++)
+		snprintf(clock_tick[i], sizeof(clock_tick[i]), "   Kitchen         00:%02d       > eat_   ", i);
+	for (j = 0; j < STATUS_CHARS; j++) {
+		all[0][j] = 'A' + j % 26;
+		all[1][j] = 'a' + j % 26;
+	}
+
+	/* Check against the reference over random strings and small edits. */
+	srand(1);
+	for (i = 0; i < 100000; i++) {
+		char str[STATUS_CHARS];
+		if (0 == i % 16) {
+			for (j = 0; j < STATUS_CHARS; j++)
+				str[j] = rand() % 256;
+		}
+		else {
+			memcpy(str, shown_text, STATUS_CHARS);
+			str[rand() % STATUS_CHARS] = rand() % 256;
+		}
+		text_to_graphics(str);
+		reference_text_to_graphics(str, ref_buffer);
+		if (0 != memcmp(temp_buffer, ref_buffer, sizeof(ref_buffer))) {
+			printf("mismatch after %d renders\n", i);
+			return 1;
+		}
+	}
+
+	printf("status bar render, us per tick(reference / cached):\n");
+	printf("  unchanged text:   %6.2f / %6.2f\n",
+	       time_renders(render_reference, same, 1, 100000),
+	       time_renders(render_cached, same, 1, 100000));
+	printf("  one cell changed: %6.2f / %6.2f\n",
+	       time_renders(render_reference, clock_tick, 60, 100000),
+	       time_renders(render_cached, clock_tick, 60, 100000));
+	printf("  all cells changed:%6.2f / %6.2f\n",
+	       time_renders(render_reference, all, 2, 100000),
+	       time_renders(render_cached, all, 2, 100000));
+	return 0;
+}
+#endif
@@ -0,0 +1,1153 @@
+/* tab:4
+ *
+ * tuxemu.c - Tux controller emulator for testing the driver without one
+ *
+ * The emulator plays the controller's side of the MTCP protocol (see
+ * module/mtcp.h) on the master side of a pseudo-terminal: it keeps the
+ * buttons, LEDs and clock, answers commands, and reports button changes.
+ * The driver (module/tuxctl-ioctl.c and module/tuxctl-ld.c, built for
+ * user space with module/tuxctl-user.h) runs on the slave side. input.c's
+ * Tux code is linked in and drives it as it drives the kernel module: the
+ * build wraps open, ioctl, mmap and munmap(ld --wrap), and the wrappers
+ * below hand the calls for /dev/ttyS0 and TUX_STATE_DEV to the driver.
+ *
+ * A script of button presses, LED and clock settings and expected
+ * results is run first; then the round-trip latency of LED updates and
+ * their throughput are measured, and the driver is loaded from several
+ * threads at once. The line is slowed to the controller's 9600 baud
+ * unless told otherwise.
+ *
+ *     usage: tuxemu [-b baud] [-l updates] [-t seconds] [-s seconds]
+ *                   [script]
+ *
+ * Script lines(blank lines and those starting with '#' are skipped):
+ *     press <button>             press a button(start a b c up down
+ *     release <button>           left right), or release it
+ *     led <value>                TUX_SET_LED
+ *     time <seconds>             display_time_on_tux
+ *     clock <seconds>            start_clock_on_tux
+ *     reset                      press the controller's RESET button
+ *     drop <count>               lose the ACKs of the next count commands
+ *     wait <ms>                  wait
+ *     expect buttons <value>     TUX_BUTTONS and get_tux_buttons give value
+ *     expect commands <count>    read_tux_buttons queues count commands
+ *     expect display <text>      the LEDs show text, e.g. 01.23
+ * Expectations are retried for up to a second to let the line settle.
+ * The exit status is 0 only if every expectation was met.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "input.h"
+#include "module/tuxctl-ld.h"
+#include "module/tuxctl-ioctl.h"
+#include "module/mtcp.h"
+
+#define DEFAULT_BAUD     9600
+#define DEFAULT_UPDATES  200    /* LED updates timed one at a time   */
+#define DEFAULT_SECONDS  2      /* seconds of back-to-back LED updates */
+#define DEFAULT_STRESS   2      /* seconds of ioctls from many threads */
+#define STRESS_THREADS   3      /* stress threads of each kind        */
+#define SETTLE_MS        1000   /* time allowed for an expectation    */
+#define MAX_CMD_LEN      6      /* longest command: LED_SET, 4 LEDs   */
+
+/* segments for the hex digits, bits as in MTCP_LED_SET; dp is MTCP bit 4 */
+#define SEG_DP 0x10
+static const unsigned char seg_digit[16] = {
+    0xE7, 0x06, 0xCB, 0x8F, 0x2E, 0xAD, 0xED, 0x86,
+    0xEF, 0xAE, 0xEE, 0x6D, 0xE1, 0x4F, 0xE9, 0xE8
+};
+
+/* button names in the order of the driver's bitmap bits */
+static const char* const button_name[8] = {
+    "start", "a", "b", "c", "up", "left", "down", "right"
+};
+
+/*
+ * The emulated controller. The device thread owns the master side of the
+ * pty and runs commands; the script changes buttons and presses RESET.
+ * All fields are protected by lock; led_sets is also read without it, so
+ * that a reader need not wait while a response is on the line.
+ */
+static struct {
+    pthread_mutex_t lock;
+    int fd;                     /* master side of the pty           */
+    double byte_time;           /* seconds per byte on the line     */
+    unsigned char buttons;      /* driver's bitmap, active low      */
+    int bioc;                   /* report button changes            */
+    int led_clk;                /* LEDs show the clock              */
+    unsigned char led[4];       /* segments set by MTCP_LED_SET     */
+    unsigned long led_sets;     /* MTCP_LED_SET commands run        */
+    int clk_run, clk_up;        /* clock running, counting up       */
+    int clk_val, clk_max;       /* clock and its limit, in seconds  */
+    double clk_next;            /* time of the next clock tick      */
+    unsigned long errors;       /* bytes that were not commands     */
+    int drop_acks;              /* ACKs still to be lost            */
+} dev = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .buttons = 0xFF,
+    .clk_max = 99 * 60 + 59
+};
+
+/* the driver's side of the line */
+struct tty_ldisc* tuxctl_user_ldisc;
+struct miscdevice* tuxctl_user_misc;
+static const volatile struct tux_state* state_page;
+static struct vm_area_struct state_vma;
+static int host_fd;             /* slave side of the pty */
+static struct tty_struct host_tty;
+static struct file host_file;
+
+/* input.c's descriptors for the driver, and its mapping of the page */
+static int input_tty_fd = -1;   /* /dev/ttyS0    */
+static int input_state_fd = -1; /* TUX_STATE_DEV */
+static struct vm_area_struct input_vma;
+
+static int failures;            /* expectations not met */
+
+/* counts kept by the stress threads */
+static volatile int stress_stop;
+static unsigned long stress_ops[2 * STRESS_THREADS];
+static unsigned long stress_errors;
+
+
+/*
+ * now
+ *   DESCRIPTION: Read the monotonic clock.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: seconds
+ *   SIDE EFFECTS: none
+ */
+static double
+now ()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * line_delay
+ *   DESCRIPTION: Wait as long as n bytes take on the emulated line.
+ *   INPUTS: n -- number of bytes
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: sleeps
+ */
+static void
+line_delay (int n)
+{
+    if (0 < dev.byte_time)
+        usleep (n * dev.byte_time * 1e6);
+}
+
+/*
+ * dev_send
+ *   DESCRIPTION: Send a 3-byte response packet to the driver. Called with
+ *                the device lock held.
+ *   INPUTS: op -- response opcode; b, c -- data bytes(the framing bit is
+ *                 added here)
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: writes to the pty
+ */
+static void
+dev_send (unsigned char op, unsigned char b, unsigned char c)
+{
+    unsigned char packet[3] = {op, 0x80 | b, 0x80 | c};
+
+    line_delay (3);
+    if (3 != write (dev.fd, packet, 3))
+        perror ("tuxemu: write");
+}
+
+/* report the buttons; called with the device lock held */
+static void
+dev_send_buttons (unsigned char op)
+{
+    dev_send (op, dev.buttons & 0x0F, dev.buttons >> 4);
+}
+
+/*
+ * dev_reset
+ *   DESCRIPTION: Reinitialize the controller, as after power-up or the
+ *                RESET button, and announce it with MTCP_RESET. Called
+ *                with the device lock held.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: clears the LEDs and clock; stops button reports
+ */
+static void
+dev_reset ()
+{
+    dev.bioc = 0;
+    dev.led_clk = 0;
+    memset (dev.led, 0, sizeof (dev.led));
+    dev.clk_run = dev.clk_up = 0;
+    dev.clk_val = 0;
+    dev_send (MTCP_RESET, 0, 0);
+}
+
+/*
+ * dev_update_clock
+ *   DESCRIPTION: Advance the clock by the seconds elapsed since it last
+ *                ticked, stopping it with MTCP_CLK_EVENT at its limit.
+ *                Called with the device lock held.
+ *   INPUTS: t -- current time in seconds
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: may send MTCP_CLK_EVENT
+ */
+static void
+dev_update_clock (double t)
+{
+    while (dev.clk_run && t >= dev.clk_next) {
+        dev.clk_next += 1;
+        dev.clk_val += (dev.clk_up ? 1 : -1);
+        if ((dev.clk_up && dev.clk_val >= dev.clk_max) ||
+            (!dev.clk_up && 0 >= dev.clk_val)) {
+            dev.clk_run = 0;
+            dev_send (MTCP_CLK_EVENT, 0, 0);
+        }
+    }
+}
+
+/*
+ * dev_command_len
+ *   DESCRIPTION: Find the length of the command starting a buffer.
+ *   INPUTS: cmd -- command bytes received so far
+ *           n -- number of bytes in cmd(at least 1)
+ *   OUTPUTS: none
+ *   RETURN VALUE: length of the command, or 0 if more bytes are needed
+ *                 to tell
+ *   SIDE EFFECTS: none
+ */
+static int
+dev_command_len (const unsigned char* cmd, int n)
+{
+    int mask;
+
+    switch (cmd[0]) {
+        case MTCP_LED_SET:
+            if (2 > n)
+                return 0;
+            for (mask = cmd[1] & 0x0F, n = 2; 0 != mask; mask >>= 1)
+                n += (mask & 1);
+            return n;
+        case MTCP_CLK_SET:
+        case MTCP_CLK_MAX:
+            return 3;
+        default:
+            return 1;
+    }
+}
+
+/*
+ * dev_run_command
+ *   DESCRIPTION: Carry out one command from the driver and respond as the
+ *                controller does. Called with the device lock held.
+ *   INPUTS: cmd -- the whole command
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: changes the controller's state; writes the response
+ */
+static void
+dev_run_command (const unsigned char* cmd)
+{
+    unsigned char seg[4];
+    int i, j;
+
+    switch (cmd[0]) {
+        case MTCP_RESET_DEV:
+            dev_reset ();
+            return;
+        case MTCP_POLL:
+            dev_send_buttons (MTCP_POLL_OK);
+            return;
+        case MTCP_CLK_POLL:
+            dev_send (MTCP_POLL_OK, dev.clk_val / 60,
+                      (dev.clk_run << 6) | (dev.clk_val % 60));
+            return;
+        case MTCP_POLL_LEDS:
+            for (i = 0; 4 > i; i++)
+                seg[i] = dev.led[i];
+            dev_send (MTCP_LEDS_POLL0 | (seg[1] >> 6 & 2) | (seg[0] >> 7),
+                      seg[0] & 0x7F, seg[1] & 0x7F);
+            dev_send (MTCP_LEDS_POLL1 | (seg[3] >> 6 & 2) | (seg[2] >> 7),
+                      seg[2] & 0x7F, seg[3] & 0x7F);
+            return;
+        case MTCP_BIOC_ON:  dev.bioc = 1; break;
+        case MTCP_BIOC_OFF: dev.bioc = 0; break;
+        case MTCP_LED_SET:
+            for (i = 0, j = 2; 4 > i; i++)
+                if (cmd[1] & (1 << i))
+                    dev.led[i] = cmd[j++];
+            __atomic_add_fetch (&dev.led_sets, 1, __ATOMIC_RELEASE);
+            break;
+        case MTCP_LED_CLK:   dev.led_clk = 1; break;
+        case MTCP_LED_USR:   dev.led_clk = 0; break;
+        case MTCP_CLK_RESET:
+            dev.clk_val = 0;
+            dev.clk_run = dev.clk_up = 0;
+            break;
+        case MTCP_CLK_SET:   dev.clk_val = cmd[1] * 60 + cmd[2]; break;
+        case MTCP_CLK_MAX:   dev.clk_max = cmd[1] * 60 + cmd[2]; break;
+        case MTCP_CLK_RUN:
+            if (!dev.clk_run)
+                dev.clk_next = now () + 1;
+            dev.clk_run = 1;
+            break;
+        case MTCP_CLK_STOP:  dev.clk_run = 0; break;
+        case MTCP_CLK_UP:    dev.clk_up = 1; break;
+        case MTCP_CLK_DOWN:  dev.clk_up = 0; break;
+        case MTCP_OFF:
+        case MTCP_DBG_OFF:
+        case MTCP_MOUSE_ON:
+        case MTCP_MOUSE_OFF:
+            break;
+        default:
+            dev.errors++;
+            dev_send (MTCP_ERROR, 0, 0);
+            return;
+    }
+    if (0 < dev.drop_acks)
+        dev.drop_acks--;            /* lost on the line */
+    else
+        dev_send (MTCP_ACK, 0, 0);
+}
+
+/*
+ * dev_thread
+ *   DESCRIPTION: Run the controller: read commands from the pty as they
+ *                arrive and keep the clock ticking.
+ *   INPUTS: arg -- ignored
+ *   OUTPUTS: none
+ *   RETURN VALUE: NULL
+ *   SIDE EFFECTS: runs until the pty is closed
+ */
+static void*
+dev_thread (void* arg)
+{
+    unsigned char cmd[MAX_CMD_LEN];
+    unsigned char buf[256];
+    struct pollfd pfd = {.events = POLLIN};
+    int n_cmd = 0, n, i, len;
+
+    pfd.fd = dev.fd;
+    while (1) {
+        n = 0;
+        if (0 < poll (&pfd, 1, 10) &&
+            0 >= (n = read (dev.fd, buf, sizeof (buf))))
+            return NULL;
+        line_delay (n);
+
+        pthread_mutex_lock (&dev.lock);
+        for (i = 0; n > i; i++) {
+            if (0 == n_cmd &&
+                MTCP_CMD_CHECK != (buf[i] & MTCP_CMD_CHECK_MASK)) {
+                dev.errors++;       /* not the start of a command */
+                continue;
+            }
+            cmd[n_cmd++] = buf[i];
+            if (0 != (len = dev_command_len (cmd, n_cmd)) && n_cmd >= len) {
+                dev_run_command (cmd);
+                n_cmd = 0;
+            }
+        }
+        dev_update_clock (now ());
+        pthread_mutex_unlock (&dev.lock);
+    }
+}
+
+/*
+ * dev_display
+ *   DESCRIPTION: Read the LEDs as text, LED3 first: a hex digit or '?'
+ *                for each LED(a space if it is blank), followed by '.' if
+ *                its decimal point is lit.
+ *   INPUTS: none
+ *   OUTPUTS: text -- at least 9 chars
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void
+dev_display (char* text)
+{
+    unsigned char seg[4];
+    int i, d;
+
+    pthread_mutex_lock (&dev.lock);
+    if (dev.led_clk) {      /* MM.SS */
+        seg[3] = seg_digit[dev.clk_val / 600];
+        seg[2] = seg_digit[dev.clk_val / 60 % 10] | SEG_DP;
+        seg[1] = seg_digit[dev.clk_val % 60 / 10];
+        seg[0] = seg_digit[dev.clk_val % 10];
+    } else {
+        memcpy (seg, dev.led, sizeof (seg));
+    }
+    pthread_mutex_unlock (&dev.lock);
+
+    for (i = 3; 0 <= i; i--) {
+        for (d = 0; 16 > d && seg_digit[d] != (seg[i] & ~SEG_DP); d++);
+        *text++ = (0 == (seg[i] & ~SEG_DP) ? ' ' :
+                   16 > d ? "0123456789ABCDEF"[d] : '?');
+        if (seg[i] & SEG_DP)
+            *text++ = '.';
+    }
+    *text = '\0';
+}
+
+/*
+ * dev_set_button
+ *   DESCRIPTION: Press or release a button, reporting the change if the
+ *                driver has asked for reports.
+ *   INPUTS: name -- button name
+ *           down -- 1 to press, 0 to release
+ *   OUTPUTS: none
+ *   RETURN VALUE: 0 on success, -1 for an unknown button
+ *   SIDE EFFECTS: may send MTCP_BIOC_EVENT
+ */
+static int
+dev_set_button (const char* name, int down)
+{
+    unsigned char old;
+    int i;
+
+    for (i = 0; 8 > i && 0 != strcmp (name, button_name[i]); i++);
+    if (8 == i)
+        return -1;
+    pthread_mutex_lock (&dev.lock);
+    old = dev.buttons;
+    dev.buttons = (down ? old & ~(1 << i) : old | (1 << i));
+    if (dev.bioc && old != dev.buttons)
+        dev_send_buttons (MTCP_BIOC_EVENT);
+    pthread_mutex_unlock (&dev.lock);
+    return 0;
+}
+
+
+/*
+ * host_write
+ *   DESCRIPTION: The serial port's write for the driver: send bytes over
+ *                the slave side of the pty.
+ *   INPUTS: tty -- ignored; buf -- bytes; n -- number of bytes
+ *   OUTPUTS: none
+ *   RETURN VALUE: number of bytes sent
+ *   SIDE EFFECTS: writes to the pty
+ */
+static int
+host_write (struct tty_struct* tty, const unsigned char* buf, int n)
+{
+    int done, r;
+
+    for (done = 0; n > done; done += r)
+        if (0 >= (r = write (host_fd, buf + done, n - done)))
+            break;
+    return done;
+}
+
+/* the pty buffers far more than the line discipline sends at once */
+static int
+host_write_room (struct tty_struct* tty)
+{
+    return 4096;
+}
+
+static struct tty_driver host_driver = {
+    .write = host_write,
+    .write_room = host_write_room
+};
+
+/*
+ * host_thread
+ *   DESCRIPTION: The serial port's receive side: hand bytes from the pty
+ *                to the line discipline as they arrive, as the serial
+ *                driver's interrupt handler does.
+ *   INPUTS: arg -- ignored
+ *   OUTPUTS: none
+ *   RETURN VALUE: NULL
+ *   SIDE EFFECTS: runs until the pty is closed
+ */
+static void*
+host_thread (void* arg)
+{
+    unsigned char buf[256];
+    int n;
+
+    while (0 < (n = read (host_fd, buf, sizeof (buf))))
+        tuxctl_user_ldisc->receive_buf (&host_tty, buf, NULL, n);
+    return NULL;
+}
+
+/* issue an ioctl to the driver */
+static int
+tux_ioctl (unsigned cmd, unsigned long arg)
+{
+    return tuxctl_ioctl (&host_tty, &host_file, cmd, arg);
+}
+
+
+/*
+ * The calls that input.c makes to reach the driver. The build links them
+ * in place of the C library's(ld --wrap), so each passes any other call on
+ * to the __real_ function. The driver's devices are stood in for by
+ * /dev/null, so that their descriptors are real and can be closed.
+ */
+int __real_open (const char* path, int flags, ...);
+int __real_ioctl (int fd, unsigned long request, ...);
+void* __real_mmap (void* addr, size_t len, int prot, int flags, int fd,
+                   off_t off);
+int __real_munmap (void* addr, size_t len);
+
+/* open /dev/ttyS0 or TUX_STATE_DEV, or pass the call on */
+int
+__wrap_open (const char* path, int flags, ...)
+{
+    va_list ap;
+    int mode;
+
+    if (0 == strcmp (path, "/dev/ttyS0"))
+        return (input_tty_fd = __real_open ("/dev/null", O_RDWR));
+    if (0 == strcmp (path, TUX_STATE_DEV))
+        return (input_state_fd = __real_open ("/dev/null", O_RDONLY));
+    va_start (ap, flags);
+    mode = (flags & O_CREAT ? va_arg (ap, int) : 0);
+    va_end (ap);
+    return __real_open (path, flags, mode);
+}
+
+/* issue an ioctl on /dev/ttyS0 to the driver(the line discipline is set
+ * already), or pass the call on */
+int
+__wrap_ioctl (int fd, unsigned long request, ...)
+{
+    va_list ap;
+    unsigned long arg;
+
+    va_start (ap, request);
+    arg = va_arg (ap, unsigned long);
+    va_end (ap);
+    if (0 > fd || fd != input_tty_fd)
+        return __real_ioctl (fd, request, arg);
+    if (TIOCSETD == request)
+        return 0;
+    return tux_ioctl (request, arg);
+}
+
+/* map the state page through the driver's mmap, or pass the call on */
+void*
+__wrap_mmap (void* addr, size_t len, int prot, int flags, int fd, off_t off)
+{
+    struct vm_area_struct vma = {.vm_end = len, .vm_pgoff = off >> PAGE_SHIFT};
+    int err;
+
+    if (0 > fd || fd != input_state_fd)
+        return __real_mmap (addr, len, prot, flags, fd, off);
+    if (prot & PROT_WRITE)
+        vma.vm_flags = VM_WRITE | VM_MAYWRITE;
+    if (NULL == tuxctl_user_misc)
+        err = -ENODEV;
+    else
+        err = tuxctl_user_misc->fops->mmap (&host_file, &vma);
+    if (0 != err) {
+        errno = -err;
+        return MAP_FAILED;
+    }
+    input_vma = vma;
+    return (void*)vma.vm_start;
+}
+
+/* unmap the state page, or pass the call on */
+int
+__wrap_munmap (void* addr, size_t len)
+{
+    if (0 == input_vma.vm_start || addr != (void*)input_vma.vm_start)
+        return __real_munmap (addr, len);
+    tuxctl_user_unmap (&input_vma);
+    input_vma.vm_start = 0;
+    return 0;
+}
+
+/*
+ * open_line
+ *   DESCRIPTION: Open a pty for the serial line, start the controller on
+ *                the master side and the driver on the slave side, and
+ *                initialize the driver as input.c does.
+ *   INPUTS: baud -- emulated line rate, or 0 for no delay
+ *   OUTPUTS: none
+ *   RETURN VALUE: 0 on success, -1 on failure
+ *   SIDE EFFECTS: starts the device and host threads; opens the driver
+ *                 through input.c
+ */
+static int map_state_page ();
+
+static int
+open_line (int baud)
+{
+    struct termios tio;
+    pthread_t thread;
+
+    if (0 > (dev.fd = posix_openpt (O_RDWR | O_NOCTTY)) ||
+        0 != grantpt (dev.fd) || 0 != unlockpt (dev.fd) ||
+        0 > (host_fd = open (ptsname (dev.fd), O_RDWR | O_NOCTTY))) {
+        perror ("tuxemu: pty");
+        return -1;
+    }
+    /* Pass bytes through untouched, as a serial port does. */
+    tcgetattr (host_fd, &tio);
+    cfmakeraw (&tio);
+    tcsetattr (host_fd, TCSANOW, &tio);
+    dev.byte_time = (0 < baud ? 10.0 / baud : 0);  /* 8N1: 10 bits */
+
+    host_tty.driver = &host_driver;
+    if (0 != tuxctl_ldisc_init () || NULL == tuxctl_user_ldisc ||
+        0 != tuxctl_user_ldisc->open (&host_tty)) {
+        fprintf (stderr, "tuxemu: line discipline failed to open\n");
+        return -1;
+    }
+    if (0 != pthread_create (&thread, NULL, dev_thread, NULL) ||
+        0 != pthread_create (&thread, NULL, host_thread, NULL)) {
+        perror ("tuxemu: pthread_create");
+        return -1;
+    }
+    if (0 != map_state_page ())
+        return -1;
+    tuxcontro_int ();
+    if (0 > input_tty_fd || 0 == input_vma.vm_start) {
+        fprintf (stderr, "tuxemu: input.c did not reach the driver\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * map_state_page
+ *   DESCRIPTION: Map the driver's button state page through the mmap of
+ *                the device that it registered, checking that a writable
+ *                mapping is refused.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: 0 on success, -1 on failure
+ *   SIDE EFFECTS: sets state_page
+ */
+static int
+map_state_page ()
+{
+    struct vm_area_struct vma = {.vm_end = PAGE_SIZE, .vm_flags = VM_WRITE};
+
+    if (NULL == tuxctl_user_misc ||
+        -EPERM != tuxctl_user_misc->fops->mmap (&host_file, &vma)) {
+        fprintf (stderr, "tuxemu: state page is missing or writable\n");
+        return -1;
+    }
+    vma.vm_flags = VM_MAYWRITE;
+    if (0 != tuxctl_user_misc->fops->mmap (&host_file, &vma) ||
+        (vma.vm_flags & VM_MAYWRITE)) {
+        fprintf (stderr, "tuxemu: state page cannot be mapped read-only\n");
+        return -1;
+    }
+    state_vma = vma;
+    state_page = (const struct tux_state*)vma.vm_start;
+    return 0;
+}
+
+/*
+ * unmap_state_page
+ *   DESCRIPTION: Check that the state page outlives the driver's teardown
+ *                while it is mapped: after tuxctl_state_exit, input.c must
+ *                still read the last report from the page, and the page
+ *                must no longer be mappable. The page is freed by the
+ *                unmaps that follow(shutdown_input's last).
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: 0 on success, -1 on failure
+ *   SIDE EFFECTS: removes the state page; state_page becomes NULL; shuts
+ *                 down input.c
+ */
+static int
+unmap_state_page ()
+{
+    unsigned char before, after;
+
+    before = get_tux_buttons ();
+    tuxctl_state_exit ();
+    after = get_tux_buttons ();
+    tuxctl_user_unmap (&state_vma);
+    state_page = NULL;
+    shutdown_input ();
+    if (NULL != tuxctl_user_misc || before != after) {
+        fprintf (stderr, "tuxemu: state page lost at teardown\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * expect
+ *   DESCRIPTION: Check a result until it is as expected or SETTLE_MS
+ *                passes.
+ *   INPUTS: what -- buttons, commands or display
+ *           want -- expected value(text for display)
+ *           line -- script line number, for the report
+ *   OUTPUTS: none
+ *   RETURN VALUE: 0 if met, -1 if not
+ *   SIDE EFFECTS: counts failures; drains button reports and commands
+ *                 for commands
+ */
+static int
+expect (const char* what, const char* want, int line)
+{
+    cmd_event_t ev;
+    unsigned char buttons, page;
+    unsigned long long time, page_time;
+    char got[32];
+    double give_up = now () + SETTLE_MS / 1000.0;
+    int commands = 0;
+
+    do {
+        if (0 == strcmp (what, "buttons")) {
+            tux_ioctl (TUX_BUTTONS, (unsigned long)&buttons);
+            page = get_tux_buttons ();
+            snprintf (got, sizeof (got), "0x%02X/0x%02X", buttons, page);
+            if (strtoul (want, NULL, 0) == buttons && page == buttons)
+                return 0;
+        } else if (0 == strcmp (what, "commands")) {
+            read_tux_buttons ();
+            page_time = __atomic_load_n (&state_page->time, __ATOMIC_ACQUIRE);
+            while (dequeue_command (&ev)) {
+                commands++;
+                time = ev.time.tv_sec * 1000000000ULL + ev.time.tv_nsec;
+                if (time > page_time) {
+                    snprintf (got, sizeof (got), "a report newer than the page");
+                    goto failed;
+                }
+            }
+            snprintf (got, sizeof (got), "%d", commands);
+            if (strtol (want, NULL, 0) == commands)
+                return 0;
+        } else if (0 == strcmp (what, "display")) {
+            dev_display (got);
+            if (0 == strcmp (want, got))
+                return 0;
+        } else {
+            fprintf (stderr, "line %d: cannot expect %s\n", line, what);
+            failures++;
+            return -1;
+        }
+        usleep (1000);
+    } while (now () < give_up);
+
+failed:
+    printf ("line %d: expected %s %s, got %s\n", line, what, want, got);
+    failures++;
+    return -1;
+}
+
+/*
+ * run_script_line
+ *   DESCRIPTION: Run one line of a script.
+ *   INPUTS: text -- the line
+ *           line -- its number, for reports
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: as the line says; counts failures
+ */
+static void
+run_script_line (char* text, int line)
+{
+    char *op, *arg, *want;
+
+    if (NULL == (op = strtok (text, " \t\r\n")) || '#' == *op)
+        return;
+    arg = strtok (NULL, " \t\r\n");
+    want = strtok (NULL, " \t\r\n");
+
+    if (0 == strcmp (op, "reset")) {
+        pthread_mutex_lock (&dev.lock);
+        dev_reset ();
+        pthread_mutex_unlock (&dev.lock);
+        return;
+    }
+    if (NULL == arg)
+        goto bad_line;
+    if (0 == strcmp (op, "press") || 0 == strcmp (op, "release")) {
+        if (0 != dev_set_button (arg, 'p' == *op))
+            goto bad_line;
+    } else if (0 == strcmp (op, "led")) {
+        tux_ioctl (TUX_SET_LED, strtoul (arg, NULL, 0));
+    } else if (0 == strcmp (op, "time")) {
+        display_time_on_tux (atoi (arg));
+    } else if (0 == strcmp (op, "clock")) {
+        if (0 != start_clock_on_tux (atoi (arg)))
+            goto bad_line;
+    } else if (0 == strcmp (op, "drop")) {
+        pthread_mutex_lock (&dev.lock);
+        dev.drop_acks = atoi (arg);
+        pthread_mutex_unlock (&dev.lock);
+    } else if (0 == strcmp (op, "wait")) {
+        usleep (strtoul (arg, NULL, 0) * 1000);
+    } else if (0 == strcmp (op, "expect") && NULL != want) {
+        (void)expect (arg, want, line);
+    } else {
+        goto bad_line;
+    }
+    return;
+
+bad_line:
+    fprintf (stderr, "line %d: cannot run \"%s\"\n", line, op);
+    failures++;
+}
+
+/* run when no script is given; the clock is started last, as
+ * display_time_on_tux does nothing once it has been */
+static const char* const default_script[] = {
+    "time 83",            "expect display 01.23",
+    "time 754",           "expect display 12.34",
+    "led 0x000F1234",     "expect display 1234",
+    "led 0x040F0083",     "expect display 00.83",
+    "led 0x000C5600",     "expect display 5683",
+    "press up",           "expect buttons 0xEF",    "expect commands 1",
+    "press a",            "press right",            "expect buttons 0x6D",
+    "release up",         "release a",              "release right",
+    "expect buttons 0xFF", "expect commands 2",
+    "clock 83",           "expect display 01.23",
+    "reset",              "expect display 01.23",
+    "led 0x000F4321",     "expect display 4321",
+    "reset",              "expect display 4321",
+    "press start",        "expect buttons 0xFE",
+    "release start",      "expect buttons 0xFF",    "expect commands 1",
+    "clock 83",           "led 0x000F1111",         "led 0x000F2222",
+    "expect display 2222",
+    "drop 1",             "led 0x000F5555",         "led 0x000F6666",
+    "expect display 5555", "wait 300",              "led 0x000F6666",
+    "expect display 6666", "led 0x000F7777",        "expect display 7777",
+};
+
+/*
+ * run_script
+ *   DESCRIPTION: Run a script file, or the default script.
+ *   INPUTS: path -- script file, or NULL for the default
+ *   OUTPUTS: none
+ *   RETURN VALUE: 0 on success, -1 if the file cannot be read
+ *   SIDE EFFECTS: counts failures
+ */
+static int
+run_script (const char* path)
+{
+    char text[256];
+    FILE* f;
+    int line;
+
+    if (NULL == path) {
+        for (line = 0; sizeof (default_script) / sizeof (default_script[0]) >
+             line; line++) {
+            snprintf (text, sizeof (text), "%s", default_script[line]);
+            run_script_line (text, line + 1);
+        }
+        return 0;
+    }
+    if (NULL == (f = fopen (path, "r"))) {
+        perror (path);
+        return -1;
+    }
+    for (line = 1; NULL != fgets (text, sizeof (text), f); line++)
+        run_script_line (text, line);
+    fclose (f);
+    return 0;
+}
+
+
+/* wait up to SETTLE_MS for a counter to pass a value; returns 0 if it did */
+static int
+wait_past (unsigned long (*counter) (), unsigned long value)
+{
+    double give_up = now () + SETTLE_MS / 1000.0;
+
+    while (counter () <= value)
+        if (now () > give_up)
+            return -1;
+        else
+            sched_yield ();
+    return 0;
+}
+
+/* LED_SET commands run by the controller */
+static unsigned long
+led_sets ()
+{
+    return __atomic_load_n (&dev.led_sets, __ATOMIC_ACQUIRE);
+}
+
+/* packets parsed by the line discipline */
+static unsigned long
+rx_packets ()
+{
+    struct tux_ld_stats ld;
+
+    tux_ioctl (TUX_GET_LD_STATS, (unsigned long)&ld);
+    return ld.rx_packets;
+}
+
+/*
+ * time_updates
+ *   DESCRIPTION: Time LED updates one at a time: from TUX_SET_LED until
+ *                the controller shows the value, and until its ACK has
+ *                reached the driver.
+ *   INPUTS: n -- number of updates
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: counts failures
+ */
+static void
+time_updates (int n)
+{
+    double t0, shown, acked, shown_sum = 0, acked_sum = 0;
+    double shown_max = 0, acked_max = 0;
+    unsigned long sets, packets;
+    int i, lost = 0;
+
+    for (i = 0; n > i; i++) {
+        sets = led_sets ();
+        packets = rx_packets ();
+        t0 = now ();
+        tux_ioctl (TUX_SET_LED, 0x000F0000 | ((i + 1) & 0xFFFF));
+        if (0 != wait_past (led_sets, sets) ||
+            (shown = now () - t0, 0 != wait_past (rx_packets, packets))) {
+            lost++;
+            continue;
+        }
+        acked = now () - t0;
+        shown_sum += shown;
+        acked_sum += acked;
+        if (shown_max < shown)
+            shown_max = shown;
+        if (acked_max < acked)
+            acked_max = acked;
+    }
+    if (n == lost) {
+        printf ("LED updates: all %d lost\n", n);
+        failures++;
+        return;
+    }
+    printf ("LED updates, one at a time(%d):\n", n);
+    printf ("  shown:      %8.1f us average, %8.1f us longest\n",
+            shown_sum / (n - lost) * 1e6, shown_max * 1e6);
+    printf ("  round trip: %8.1f us average, %8.1f us longest\n",
+            acked_sum / (n - lost) * 1e6, acked_max * 1e6);
+    if (0 != lost) {
+        printf ("  lost: %d\n", lost);
+        failures++;
+    }
+}
+
+/*
+ * measure_throughput
+ *   DESCRIPTION: Set LED values back to back for a while, and report how
+ *                many reached the controller and how the driver combined
+ *                them. The last value set must be shown in the end.
+ *   INPUTS: seconds -- how long to keep setting values
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: counts failures
+ */
+static void
+measure_throughput (int seconds)
+{
+    struct tux_stats st0, st1;
+    struct tux_ld_stats ld;
+    unsigned long sets, count, value = 0;
+    double t0, t;
+    char want[16], got[16];
+
+    tux_ioctl (TUX_GET_STATS, (unsigned long)&st0);
+    sets = led_sets ();
+    t0 = now ();
+    for (count = 0; (t = now () - t0) < seconds; count++) {
+        value = 0x000F0000 | (count % 10000);
+        tux_ioctl (TUX_SET_LED, value);
+    }
+    usleep (SETTLE_MS * 1000 / 4);
+    tux_ioctl (TUX_GET_STATS, (unsigned long)&st1);
+    tux_ioctl (TUX_GET_LD_STATS, (unsigned long)&ld);
+    sets = led_sets () - sets;
+
+    printf ("LED updates, back to back(%d s):\n", seconds);
+    printf ("  set:   %10.0f/s\n", count / t);
+    printf ("  shown: %10.0f/s(%lu sent, %lu coalesced)\n", sets / t,
+            st1.led_sent - st0.led_sent, st1.led_coalesced - st0.led_coalesced);
+    printf ("  line:  %lu bytes sent, %lu received, %lu packets, "
+            "%lu resyncs, %lu overflowed, %lu dropped\n",
+            ld.tx_bytes, ld.rx_bytes, ld.rx_packets, ld.rx_resyncs,
+            ld.rx_overflow, ld.tx_dropped);
+
+    /* The latest value set wins. */
+    snprintf (want, sizeof (want), "%04lX", value & 0xFFFF);
+    dev_display (got);
+    if (0 != strcmp (want, got)) {
+        printf ("  shows %s, not the last value set, %s\n", got, want);
+        failures++;
+    }
+}
+
+/* set and read back LED values as fast as possible */
+static void*
+stress_leds (void* arg)
+{
+    unsigned long* ops = arg;
+    unsigned long value, i;
+
+    for (i = 0; !stress_stop; i++) {
+        value = 0x000F0000 | ((ops - stress_ops) << 24) | (i & 0xFFFF);
+        if (0 != tux_ioctl (TUX_SET_LED, value) ||
+            0 != tux_ioctl (TUX_READ_LED, (unsigned long)&value))
+            __atomic_add_fetch (&stress_errors, 1, __ATOMIC_RELAXED);
+        *ops += 2;
+    }
+    return NULL;
+}
+
+/* read the buttons and drain the button reports as fast as possible */
+static void*
+stress_buttons (void* arg)
+{
+    unsigned long* ops = arg;
+    struct tux_events evs;
+    unsigned char buttons;
+
+    while (!stress_stop) {
+        if (0 != tux_ioctl (TUX_BUTTONS, (unsigned long)&buttons) ||
+            0 != tux_ioctl (TUX_GET_EVENTS, (unsigned long)&evs))
+            __atomic_add_fetch (&stress_errors, 1, __ATOMIC_RELAXED);
+        *ops += 2;
+    }
+    return NULL;
+}
+
+/*
+ * stress_driver
+ *   DESCRIPTION: Issue LED and button ioctls from several threads at once
+ *                for a while, then check that the last LED value set wins
+ *                and report how long the device lock was held(if the
+ *                driver was built with TUXCTL_LOCK_STATS=1).
+ *   INPUTS: seconds -- how long to run the threads
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: counts failures
+ */
+static void
+stress_driver (int seconds)
+{
+    pthread_t thread[2 * STRESS_THREADS];
+    struct tux_stats st0, st1;
+    unsigned long total, value;
+    unsigned long long lock_ns;
+    int i;
+
+    tux_ioctl (TUX_GET_STATS, (unsigned long)&st0);
+    for (i = 0; 2 * STRESS_THREADS > i; i++) {
+        if (0 != pthread_create (&thread[i], NULL, STRESS_THREADS > i ?
+                                 stress_leds : stress_buttons, &stress_ops[i])) {
+            perror ("tuxemu: pthread_create");
+            failures++;
+            stress_stop = 1;
+            while (0 < i--)
+                pthread_join (thread[i], NULL);
+            return;
+        }
+    }
+    sleep (seconds);
+    stress_stop = 1;
+    for (total = 0, i = 0; 2 * STRESS_THREADS > i; i++) {
+        pthread_join (thread[i], NULL);
+        total += stress_ops[i];
+    }
+
+    printf ("%d LED and %d button threads(%d s):\n",
+            STRESS_THREADS, STRESS_THREADS, seconds);
+    printf ("  ioctls: %10.0f/s, %lu errors\n", (double)total / seconds,
+            stress_errors);
+    if (0 != stress_errors)
+        failures++;
+
+    /* The latest value set must win once the threads are done. */
+    tux_ioctl (TUX_SET_LED, 0x000F1234);
+    if (0 != tux_ioctl (TUX_READ_LED, (unsigned long)&value) ||
+        0x000F1234 != value) {
+        printf ("  TUX_READ_LED gave %08lX, not 000F1234\n", value);
+        failures++;
+    }
+    (void)expect ("display", "1234", 0);
+
+    tux_ioctl (TUX_GET_STATS, (unsigned long)&st1);
+    printf ("  LED packets sent: %lu, values coalesced: %lu, ACK waits "
+            "given up: %lu\n", st1.led_sent - st0.led_sent,
+            st1.led_coalesced - st0.led_coalesced,
+            st1.ack_timeouts - st0.ack_timeouts);
+    if (st1.lock_count == st0.lock_count) {
+        printf ("  lock holds: not timed(build with TUXCTL_LOCK_STATS=1)\n");
+    } else {
+        lock_ns = st1.lock_ns - st0.lock_ns;
+        printf ("  lock holds: %lu, %llu ns average, %llu ns longest "
+                "(of the whole run)\n", st1.lock_count - st0.lock_count,
+                lock_ns / (st1.lock_count - st0.lock_count), st1.lock_max_ns);
+    }
+}
+
+
+int
+main (int argc, char** argv)
+{
+    int baud = DEFAULT_BAUD;
+    int updates = DEFAULT_UPDATES;
+    int seconds = DEFAULT_SECONDS;
+    int stress = DEFAULT_STRESS;
+    int opt;
+
+    while (-1 != (opt = getopt (argc, argv, "b:l:t:s:"))) {
+        switch (opt) {
+            case 'b': baud = atoi (optarg); break;
+            case 'l': updates = atoi (optarg); break;
+            case 't': seconds = atoi (optarg); break;
+            case 's': stress = atoi (optarg); break;
+            default:
+                fprintf (stderr, "usage: %s [-b baud] [-l updates] "
+                         "[-t seconds] [-s seconds] [script]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (0 != open_line (baud))
+        return 3;
+
+    if (0 != run_script (optind < argc ? argv[optind] : NULL))
+        return 3;
+    printf ("script: %s\n", 0 == failures ? "passed" : "FAILED");
+    if (0 < updates)
+        time_updates (updates);
+    if (0 < seconds)
+        measure_throughput (seconds);
+    if (0 < stress)
+        stress_driver (stress);
+    if (0 != dev.errors) {
+        printf ("controller received %lu bad bytes\n", dev.errors);
+        failures++;
+    }
+    if (0 != unmap_state_page ())
+        failures++;
+    return (0 != failures);
+}
@@ -153,6 +153,9 @@ enum {
     N_OBJECTS
 };
 
+/* a room_image_t must be able to hold every object */
+typedef char room_image_holds_all_objects[MAX_ROOM_OBJECTS >= N_OBJECTS ? 1 : -1];
+
 /* flag identifiers for recording the player's accomplishments */
 enum {
     FLAG_HAS_EATEN,    /* player has eaten something         */
@@ -184,6 +187,9 @@ struct room_t {
     room_t*     left;       /* room to the "left"             */
     room_t*     enter;      /* doors, etc.                    */
     room_t*     right;      /* room to the "right"            */
+    int32_t     n_damage;   /* changed rectangles(-1 for all) */
+    uint32_t    generation; /* count of changes to the image  */
+    rect_t      damage[MAX_ROOM_DAMAGE]; /* changed rectangles */
 };
 
 /*
@@ -359,6 +365,7 @@ static const swap_data_t swap_data[N_SWAPS] = {
 
 
 /* functions local to this file--see function headers for details */
+static void add_room_damage(const object_t* o);
 static void do_photo_swap(room_t* r, int32_t which);
 static object_t* find_in_room(const room_t* r, const char* arg);
 static void insert_object_at(object_t* o, room_t* r, int32_t x, int32_t y);
@@ -382,6 +389,40 @@ static uint32_t player_flags[(NUM_FLAGS + 31) / 32]; /* accomplishment flags */
 static photo_t* swap_photo[N_SWAPS];                 /* swapping photos      */
 
 
+/*
+ * add_room_damage
+ *   DESCRIPTION: Record the area covered by an object in its room as
+ *                changed, so that it is redrawn.  If the room's list of
+ *                changed rectangles is full, the whole room is marked.
+ *   INPUTS: o -- the object(ignored if it is in limbo)
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: changes the room's damage list and generation
+ */
+static void add_room_damage(const object_t* o) {
+    room_t* r;    /* room containing the object */
+    rect_t* rect; /* new entry in damage list   */
+
+    r = o->loc;
+    if (NULL == r) {
+        return;
+    }
+    r->generation++;
+    if (0 > r->n_damage) {
+        return;
+    }
+    if (MAX_ROOM_DAMAGE == r->n_damage) {
+        r->n_damage = -1;
+        return;
+    }
+    rect = &r->damage[r->n_damage++];
+    rect->x = o->x;
+    rect->y = o->y;
+    rect->w = image_width(o->img);
+    rect->h = image_height(o->img);
+}
+
+
 /*
  * do_photo_swap
  *   DESCRIPTION: Swap a room photo with another stored image.
@@ -389,7 +430,7 @@ static photo_t* swap_photo[N_SWAPS];                 /* swapping photos      */
  *           which -- index into array of stored photos
  *   OUTPUTS: none
  *   RETURN VALUE: none
- *   SIDE EFFECTS: none
+ *   SIDE EFFECTS: marks the whole room as changed
  */
 static void do_photo_swap(room_t* r, int32_t which) {
     photo_t* tmp;    /* temporary variable to help with swap */
@@ -398,6 +439,10 @@ static void do_photo_swap(room_t* r, int32_t which) {
     tmp               = r->view;
     r->view           = swap_photo[which];
     swap_photo[which] = tmp;
+
+    /* The whole room has changed. */
+    r->generation++;
+    r->n_damage = -1;
 }
 
 
@@ -438,7 +483,8 @@ static object_t* find_in_room(const room_t* r, const char* arg) {
  *           y -- the y position for the object
  *   OUTPUTS: none
  *   RETURN VALUE: none
- *   SIDE EFFECTS: takes the object out of its current location
+ *   SIDE EFFECTS: takes the object out of its current location; records
+ *                 the old and new areas covered by the object as changed
  */
 static void insert_object_at(object_t* o, room_t* r, int32_t x, int32_t y) {
     /* Remove object from its current room, if any. */
@@ -452,6 +498,7 @@ static void insert_object_at(object_t* o, room_t* r, int32_t x, int32_t y) {
     o->loc = r;
     o->next = r->contents;
     r->contents = o;
+    add_room_damage(o);
 }
 
 
@@ -608,7 +655,7 @@ static void player_set_flag(int32_t fnum) {
  *   INPUTS: o -- the object
  *   OUTPUTS: none
  *   RETURN VALUE: none
- *   SIDE EFFECTS: none
+ *   SIDE EFFECTS: records the area covered by the object as changed
  */
 static void remove_object(object_t* o) {
     object_t** find;    /* loop index over pointers to objects in room */
@@ -616,6 +663,9 @@ static void remove_object(object_t* o) {
     /* Is object already in limbo? */
     if (NULL != o->loc) {
 
+        /* The object's room must be redrawn where it was. */
+        add_room_damage(o);
+
         /* Remove from previous room(with safety check)... */
         for (find = &o->loc->contents; NULL != *find; find = &(*find)->next) {
             if (o == *find) {
@@ -751,6 +801,88 @@ uint32_t room_photo_width(const room_t* r) {
 }
 
 
+/*
+ * room_generation
+ *   DESCRIPTION: Get a count of the changes made to a room's image(object
+ *                moves and photo swaps).  An image of the room drawn when
+ *                the count had the same value is still correct.
+ *   INPUTS: r -- pointer to the room
+ *   OUTPUTS: none
+ *   RETURN VALUE: the change count of room r
+ *   SIDE EFFECTS: none
+ */
+uint32_t room_generation(const room_t* r) {
+    return r->generation;
+}
+
+
+/*
+ * copy_room_image
+ *   DESCRIPTION: Copy what a room's image is drawn from(its photo and the
+ *                placement of its objects), so that the image can be drawn
+ *                without reading the world.
+ *   INPUTS: r -- pointer to the room
+ *   OUTPUTS: ri -- the copy
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+void copy_room_image(const room_t* r, room_image_t* ri) {
+    const object_t* obj; /* index over room contents */
+    int32_t n;           /* objects copied           */
+
+    ri->photo = r->view;
+    for (n = 0, obj = r->contents; NULL != obj; obj = obj->next, n++) {
+        ri->obj[n].x = obj->x;
+        ri->obj[n].y = obj->y;
+        ri->obj[n].img = obj->img;
+    }
+    ri->n_objs = n;
+}
+
+
+/*
+ * room_neighbor
+ *   DESCRIPTION: Get one of the rooms reached directly from a room by
+ *                moving left, entering, or moving right(rooms reached
+ *                only under special conditions are not included).
+ *   INPUTS: r -- pointer to the room
+ *           which -- 0 for left, 1 for enter, or 2 for right
+ *   OUTPUTS: none
+ *   RETURN VALUE: the neighboring room, or NULL if there is none
+ *   SIDE EFFECTS: none
+ */
+room_t* room_neighbor(const room_t* r, int32_t which) {
+    switch (which) {
+        case 0: return r->left;
+        case 1: return r->enter;
+        case 2: return r->right;
+    }
+    return NULL;
+}
+
+
+/*
+ * take_room_damage
+ *   DESCRIPTION: Get the list of rectangles of a room photo changed by
+ *                object moves(and photo swaps) since the last call, and
+ *                clear the list.
+ *   INPUTS: r -- pointer to the room
+ *   OUTPUTS: rects -- the changed rectangles, in photo pixels
+ *   RETURN VALUE: number of rectangles, or -1 if the whole room changed
+ *   SIDE EFFECTS: clears the room's damage list
+ */
+int32_t take_room_damage(room_t* r, rect_t rects[MAX_ROOM_DAMAGE]) {
+    int32_t n;  /* number of changed rectangles */
+
+    n = r->n_damage;
+    if (0 < n) {
+        (void)memcpy(rects, r->damage, n * sizeof (rects[0]));
+    }
+    r->n_damage = 0;
+    return n;
+}
+
+
 /*
  * build_world
  *   DESCRIPTION: Builds and connects the rooms, creates objects, and
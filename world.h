@@ -39,6 +39,35 @@
 #include "types.h"
 
 
+/*
+ * A rectangle of a room photo(in photo pixels) that has changed since
+ * the room was last drawn; see take_room_damage.
+ */
+typedef struct rect_t rect_t;
+struct rect_t {
+    int32_t x, y;   /* upper left pixel  */
+    int32_t w, h;   /* width and height  */
+};
+
+/* maximum number of changed rectangles recorded per room */
+#define MAX_ROOM_DAMAGE 8
+
+/*
+ * A copy of what a room's image is drawn from: its photo and where its
+ * objects lie.  Photos and object images never change once read, so the
+ * copy may be drawn from while the world goes on changing.
+ */
+#define MAX_ROOM_OBJECTS 32
+typedef struct room_image_t room_image_t;
+struct room_image_t {
+    const photo_t* photo;              /* photo shown for room  */
+    int32_t        n_objs;             /* objects in room       */
+    struct {
+        int32_t        x, y;           /* position within photo */
+        const image_t* img;            /* object's image        */
+    } obj[MAX_ROOM_OBJECTS];
+};
+
 /* structure access functions */
 extern uint16_t obj_get_x(const object_t* obj);
 extern uint16_t obj_get_y(const object_t* obj);
@@ -49,6 +78,18 @@ extern const char* room_name(const room_t* r);
 extern photo_t* room_photo(const room_t* r);
 extern uint32_t room_photo_height(const room_t* r);
 extern uint32_t room_photo_width(const room_t* r);
+extern uint32_t room_generation(const room_t* r);
+extern void copy_room_image(const room_t* r, room_image_t* ri);
+
+/* number of rooms returned by room_neighbor(left, enter, right) */
+#define NUM_ROOM_NEIGHBORS 3
+extern room_t* room_neighbor(const room_t* r, int32_t which);
+
+/*
+ * Get and clear the list of rectangles changed in a room by object moves.
+ * Returns the number of rectangles, or -1 if the whole room must be redrawn.
+ */
+extern int32_t take_room_damage(room_t* r, rect_t rects[MAX_ROOM_DAMAGE]);
 
 /* Build the game world.  Returns 0 on failure, or 1 on success. */
 extern int32_t build_world(void);